@@ -0,0 +1,72 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "commons.h"
+#include "sphere.h"
+#include "vec3.h"
+
+// Positions at given times, moving in straight lines between them. Before
+// the first key and after the last, the position holds still.
+class KeyframeTrack {
+public:
+	// A key at the same time as an earlier one replaces it
+	void add(real time, point3 position) {
+		auto found = std::lower_bound(keys.begin(), keys.end(), time,
+			[](const auto& key, real time) { return key.first < time; });
+
+		if (found != keys.end() && found->first == time)
+			found->second = position;
+		else
+			keys.insert(found, { time, position });
+	}
+
+	bool empty() const { return keys.empty(); }
+	size_t size() const { return keys.size(); }
+
+	point3 at(real time) const {
+		if (time <= keys.front().first)
+			return keys.front().second;
+		if (time >= keys.back().first)
+			return keys.back().second;
+
+		auto next = std::upper_bound(keys.begin(), keys.end(), time,
+			[](real time, const auto& key) { return time < key.first; });
+		auto previous = next - 1;
+
+		real fraction = (time - previous->first) / (next->first - previous->first);
+		return previous->second + fraction * (next->second - previous->second);
+	}
+
+private:
+	// Sorted by time
+	std::vector<std::pair<real, point3>> keys;
+};
+
+// Things of a scene that move over the frames of an animation. setTime()
+// moves them in place, the BVH holding them has to be refit or rebuilt
+// afterwards.
+class Animation {
+public:
+	void addSphere(std::shared_ptr<Sphere> sphere, KeyframeTrack track) {
+		spheres.push_back({ std::move(sphere), std::move(track) });
+	}
+
+	bool empty() const { return spheres.empty(); }
+
+	void setTime(real time) {
+		for (auto& [sphere, track] : spheres)
+			sphere->center = track.at(time);
+	}
+
+private:
+	struct MovingSphere {
+		std::shared_ptr<Sphere> sphere;
+		KeyframeTrack track;
+	};
+
+	std::vector<MovingSphere> spheres;
+};
@@ -0,0 +1,588 @@
+// benchmark.cpp : Micro benchmarks of the building blocks of the renderer
+// and macro benchmarks that render the scenes, reported as JSON so runs can
+// be compared from one build to the next.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <numbers>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "bounding_box.h"
+#include "camera.h"
+#include "color.h"
+#include "framebuffer.h"
+#include "hittable_list.h"
+#include "light.h"
+#include "material.h"
+#include "mesh.h"
+#include "mesh_loader.h"
+#include "option_parsing.h"
+#include "render_config.h"
+#include "renderer.h"
+#include "rng.h"
+#include "sampler.h"
+#include "scene.h"
+#include "sphere.h"
+#include "stats.h"
+#include "vec3.h"
+#include "wide_bounding_volume_hierarchy.h"
+
+using Clock = std::chrono::steady_clock;
+
+double millisecondsSince(Clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Most memory the process has used so far, 0 if the OS won't say
+size_t peakResidentBytes() {
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.PeakWorkingSetSize;
+#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#if defined(__APPLE__)
+	return static_cast<size_t>(usage.ru_maxrss); // already in bytes
+#else
+	return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+
+// MICRO BENCHMARKS
+
+struct MicroResult {
+	std::string name;
+	long long operations;
+	double nanosecondsPerOperation;
+};
+
+// Results of the benchmarks end up here so the compiler can't drop them
+volatile double sink = 0;
+
+// Times batch(n), which does n operations and returns something computed
+// from them. Batches grow until one takes minimumTime, and the fastest of a
+// few batches of that size counts, which filters out the OS getting in the
+// way.
+template<typename Batch>
+MicroResult measure(const std::string& name, double minimumTime, Batch&& batch) {
+	constexpr int REPEATS = 5;
+
+	long long operations = 1;
+	double milliseconds = 0;
+	while (true) {
+		auto start = Clock::now();
+		sink = sink + batch(operations);
+		milliseconds = millisecondsSince(start);
+		if (milliseconds >= minimumTime)
+			break;
+		operations *= 2;
+	}
+
+	double best = milliseconds;
+	for (int i = 1; i < REPEATS; i++) {
+		auto start = Clock::now();
+		sink = sink + batch(operations);
+		best = std::min(best, millisecondsSince(start));
+	}
+
+	fprintf(stderr, "%-40s %10.2f ns\n", name.c_str(), best * 1e6 / operations);
+	return MicroResult{ name, operations, best * 1e6 / operations };
+}
+
+std::vector<vec3> randomVectors(RandomNumberGenerator& rng, size_t count) {
+	std::vector<vec3> vectors;
+	vectors.reserve(count);
+	for (size_t i = 0; i < count; i++)
+		vectors.push_back(vec3::random(rng, -1, 1));
+	return vectors;
+}
+
+// Rays from a sphere of radius distance around the origin, aimed at points
+// within spread of the origin, so most of them hit a unit sized object there
+std::vector<Ray> raysAtOrigin(RandomNumberGenerator& rng, size_t count, real distance, real spread) {
+	std::vector<Ray> rays;
+	rays.reserve(count);
+	for (size_t i = 0; i < count; i++) {
+		auto origin = distance * vec3::onUnitSphere(
+			real(rng.randomDouble()), real(rng.randomDouble())
+		);
+		auto target = spread * vec3::random(rng, -1, 1);
+		rays.push_back(Ray(origin, target - origin));
+	}
+	return rays;
+}
+
+struct MeshGeometry {
+	std::vector<point3> vertices;
+	std::vector<int> indices;
+};
+
+// Unit sphere made of 2 * rings * segments triangles
+MeshGeometry makeSphereGeometry(int rings, int segments) {
+	std::vector<point3> vertices;
+	std::vector<int> indices;
+
+	for (int ring = 0; ring <= rings; ring++) {
+		real theta = std::numbers::pi_v<real> * ring / rings;
+		for (int segment = 0; segment < segments; segment++) {
+			real phi = 2 * std::numbers::pi_v<real> * segment / segments;
+			vertices.push_back(point3(
+				std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi)
+			));
+		}
+	}
+
+	for (int ring = 0; ring < rings; ring++) {
+		for (int segment = 0; segment < segments; segment++) {
+			int next = (segment + 1) % segments;
+			int a = ring * segments + segment, b = ring * segments + next;
+			int c = (ring + 1) * segments + segment, d = (ring + 1) * segments + next;
+			indices.insert(indices.end(), { a, c, b, b, c, d });
+		}
+	}
+
+	return { std::move(vertices), std::move(indices) };
+}
+
+// Copies geometry, which is cheap next to the BVH build
+std::shared_ptr<Mesh> makeMesh(const MeshGeometry& geometry, const Material* material) {
+	return std::make_shared<Mesh>(
+		geometry.vertices, geometry.indices, std::vector<const Material*>{ material }, std::vector<int>{}
+	);
+}
+
+// The same sphere as an OBJ file, in quads
+void writeSphereObj(const std::string& path, int rings, int segments) {
+	std::ofstream file(path);
+	file.precision(9);
+
+	for (int ring = 0; ring <= rings; ring++) {
+		real theta = std::numbers::pi_v<real> * ring / rings;
+		for (int segment = 0; segment < segments; segment++) {
+			real phi = 2 * std::numbers::pi_v<real> * segment / segments;
+			file << "v " << std::sin(theta) * std::cos(phi) << ' ' << std::cos(theta)
+				<< ' ' << std::sin(theta) * std::sin(phi) << '\n';
+		}
+	}
+
+	for (int ring = 0; ring < rings; ring++) {
+		for (int segment = 0; segment < segments; segment++) {
+			int next = (segment + 1) % segments;
+			int a = ring * segments + segment + 1, b = ring * segments + next + 1;
+			file << "f " << a << ' ' << a + segments << ' ' << b + segments << ' ' << b << '\n';
+		}
+	}
+}
+
+std::vector<MicroResult> runMicroBenchmarks(double minimumTime) {
+	constexpr size_t COUNT = 1024;
+	constexpr real INFTY = std::numeric_limits<real>::infinity();
+
+	std::vector<MicroResult> results;
+	RandomNumberGenerator rng(1);
+	MaterialTable materials;
+	auto material = materials.make<LambertianDiffuse>(color3(0.5));
+
+	// vec3
+
+	auto a = randomVectors(rng, COUNT);
+	auto b = randomVectors(rng, COUNT);
+
+	results.push_back(measure("vec3::dot", minimumTime, [&](long long n) {
+		real sum = 0;
+		for (long long i = 0; i < n; i++)
+			sum += a[i % COUNT].dot(b[i % COUNT]);
+		return double(sum);
+	}));
+	results.push_back(measure("vec3::cross", minimumTime, [&](long long n) {
+		vec3 sum(0);
+		for (long long i = 0; i < n; i++)
+			sum += a[i % COUNT].cross(b[i % COUNT]);
+		return double(sum.x);
+	}));
+	results.push_back(measure("vec3::unit", minimumTime, [&](long long n) {
+		vec3 sum(0);
+		for (long long i = 0; i < n; i++)
+			sum += a[i % COUNT].unit();
+		return double(sum.x);
+	}));
+
+	// Random numbers
+
+	results.push_back(measure("RandomNumberGenerator::next", minimumTime, [&](long long n) {
+		uint32_t sum = 0;
+		for (long long i = 0; i < n; i++)
+			sum += rng.next();
+		return double(sum);
+	}));
+	results.push_back(measure("RandomNumberGenerator::randomDouble", minimumTime, [&](long long n) {
+		double sum = 0;
+		for (long long i = 0; i < n; i++)
+			sum += rng.randomDouble();
+		return sum;
+	}));
+	for (auto type : { SamplerType::Independent, SamplerType::Sobol }) {
+		auto sampler = makeSampler(type, 1, 64);
+		std::string name = type == SamplerType::Sobol ? "SobolSampler" : "IndependentSampler";
+		results.push_back(measure(name + "::get2D", minimumTime, [&](long long n) {
+			real sum = 0;
+			for (long long i = 0; i < n; i++) {
+				// A new pixel sample every 8 dimensions, like short paths
+				if (i % 8 == 0)
+					sampler->startPixelSample(int(i >> 3) & 63, 0, int(i >> 9));
+				sum += sampler->get2D().u;
+			}
+			return double(sum);
+		}));
+	}
+
+	// Intersections
+
+	auto rays = raysAtOrigin(rng, COUNT, 5, 1.5);
+
+	Sphere sphere(point3(0), 1, material);
+	results.push_back(measure("Sphere::hit", minimumTime, [&](long long n) {
+		int hits = 0;
+		for (long long i = 0; i < n; i++)
+			hits += sphere.hit(rays[i % COUNT], 0, INFTY).has_value();
+		return double(hits);
+	}));
+
+	BoundingBox box(point3(-1), point3(1));
+	results.push_back(measure("BoundingBox::hit", minimumTime, [&](long long n) {
+		int hits = 0;
+		for (long long i = 0; i < n; i++)
+			hits += box.hit(rays[i % COUNT], 0, INFTY);
+		return double(hits);
+	}));
+
+	std::vector<InverseRay> inverseRays(rays.begin(), rays.end());
+	results.push_back(measure("BoundingBox::hit (InverseRay)", minimumTime, [&](long long n) {
+		int hits = 0;
+		for (long long i = 0; i < n; i++)
+			hits += box.hit(inverseRays[i % COUNT], 0, INFTY);
+		return double(hits);
+	}));
+
+	MeshGeometry sphereGeometry = makeSphereGeometry(64, 128);
+	auto mesh = makeMesh(sphereGeometry, material);
+	results.push_back(measure("Mesh::hit (16k triangles)", minimumTime, [&](long long n) {
+		int hits = 0;
+		for (long long i = 0; i < n; i++)
+			hits += mesh->hit(rays[i % COUNT], 0, INFTY).has_value();
+		return double(hits);
+	}));
+
+	// Loading
+
+	std::string objPath = (std::filesystem::temp_directory_path() / "weekend_raytracing_sphere.obj").string();
+	writeSphereObj(objPath, 64, 128);
+	results.push_back(measure("loadMesh (OBJ, 16k triangles)", minimumTime, [&](long long n) {
+		size_t count = 0;
+		for (long long i = 0; i < n; i++)
+			count += loadMesh(objPath).indices.size();
+		return double(count);
+	}));
+	std::filesystem::remove(objPath);
+
+	// BVH builds
+
+	results.push_back(measure("Mesh build (16k triangles)", minimumTime, [&](long long n) {
+		size_t count = 0;
+		for (long long i = 0; i < n; i++)
+			count += makeMesh(sphereGeometry, material).use_count();
+		return double(count);
+	}));
+
+	HittableList spheres;
+	for (int i = 0; i < 10000; i++) {
+		auto center = 50 * vec3::random(rng, -1, 1);
+		spheres.add(std::make_shared<Sphere>(center, real(rng.randomDouble(0.1, 1)), material));
+	}
+	results.push_back(measure("BVH build (10k spheres)", minimumTime, [&](long long n) {
+		int hits = 0;
+		for (long long i = 0; i < n; i++) {
+			WideBoundingVolumeHierarchy<DEFAULT_BVH_WIDTH> bvh(spheres, 0, 0);
+			hits += bvh.hit(rays[i % COUNT], 0, INFTY).has_value();
+		}
+		return double(hits);
+	}));
+
+	// Same spheres, refit after moving them all a little each time
+	WideBoundingVolumeHierarchy<DEFAULT_BVH_WIDTH> refitBvh(spheres, 0, 0);
+	results.push_back(measure("BVH refit (10k spheres)", minimumTime, [&](long long n) {
+		int hits = 0;
+		for (long long i = 0; i < n; i++) {
+			vec3 offset = real(0.01) * vec3::random(rng, -1, 1);
+			for (const auto& hittable : spheres.hittables)
+				static_cast<Sphere&>(*hittable).center += offset;
+
+			refitBvh.refit(0, 0);
+			hits += refitBvh.hit(rays[i % COUNT], 0, INFTY).has_value();
+		}
+		return double(hits);
+	}));
+
+	return results;
+}
+
+
+// MACRO BENCHMARKS
+
+struct MacroResult {
+	std::string scene;
+	int width, height;
+	int samplesPerPixel;
+	double buildMilliseconds;
+	double renderMilliseconds;
+	// Rays, BVH work and path lengths of the render
+	RenderStatistics statistics;
+	// Average luminance of the image. Renders with the same seed and build
+	// options come out the same, so a change here means the image changed.
+	double meanLuminance;
+	// Peak of the whole process after this render, so it includes the
+	// scenes before it and only grows from one scene to the next
+	size_t processPeakResidentBytes;
+
+	double megaraysPerSecond() const {
+		return statistics.total().rays() / (renderMilliseconds * 1e3);
+	}
+};
+
+MacroResult renderScene(
+	const std::string& name,
+	Scene& scene,
+	int width,
+	int samplesPerPixel,
+	uint64_t seed,
+	int threadCount
+) {
+	// Scenes with random parts take them from globalRng
+	globalRng = RandomNumberGenerator(seed);
+
+	auto buildStart = Clock::now();
+	HittableList worldHittables = scene.build();
+	WideBoundingVolumeHierarchy<DEFAULT_BVH_WIDTH> world(worldHittables, 0.0, 0.0);
+	LightList lights(world);
+	double buildMilliseconds = millisecondsSince(buildStart);
+
+	Camera camera = scene.makeCamera(1.0);
+	Framebuffer framebuffer(width, width);
+
+	RenderState state;
+	state.sampling.minSamples = samplesPerPixel;
+	state.sampling.maxSamples = samplesPerPixel;
+	state.sampling.errorThreshold = 0;
+	state.seed = seed;
+
+	PathConfig pathConfig;
+
+	RenderStatistics statistics(threadCount);
+	auto renderStart = Clock::now();
+	while (true) {
+		auto samplesTaken = renderPass(
+			threadCount, width, width, state, pathConfig, world, lights, camera, framebuffer, statistics
+		);
+		if (samplesTaken == 0)
+			break;
+
+		state.passesDone++;
+	}
+	double renderMilliseconds = millisecondsSince(renderStart);
+
+	double luminanceSum = 0;
+	for (int j = 0; j < width; j++)
+		for (int i = 0; i < width; i++)
+			luminanceSum += luminance(framebuffer.resolve(i, j));
+
+	MacroResult result = {
+		name,
+		width,
+		width,
+		samplesPerPixel,
+		buildMilliseconds,
+		renderMilliseconds,
+		statistics,
+		luminanceSum / (double(width) * width),
+		peakResidentBytes()
+	};
+
+	fprintf(
+		stderr, "%-16s build %8.2f ms, render %9.2f ms, %7.2f Mrays/s\n",
+		name.c_str(), buildMilliseconds, renderMilliseconds, result.megaraysPerSecond()
+	);
+	return result;
+}
+
+
+// REPORT
+
+void writeReport(
+	std::ostream& stream,
+	const std::vector<MicroResult>& micro,
+	const std::vector<MacroResult>& macro,
+	uint64_t seed,
+	int threadCount
+) {
+	stream << "{\n";
+	stream << "  \"build\": {\n";
+	stream << "    \"real\": \"" << (sizeof(real) == sizeof(float) ? "float" : "double") << "\",\n";
+	stream << "    \"bvhWidth\": " << DEFAULT_BVH_WIDTH << "\n";
+	stream << "  },\n";
+	stream << "  \"seed\": " << seed << ",\n";
+	stream << "  \"threads\": " << threadCount << ",\n";
+
+	stream << "  \"micro\": [";
+	for (size_t i = 0; i < micro.size(); i++) {
+		const auto& result = micro[i];
+		stream << (i == 0 ? "\n" : ",\n")
+			<< "    { \"name\": \"" << result.name << "\""
+			<< ", \"operations\": " << result.operations
+			<< ", \"nsPerOperation\": " << result.nanosecondsPerOperation << " }";
+	}
+	stream << (micro.empty() ? "],\n" : "\n  ],\n");
+
+	stream << "  \"macro\": [";
+	for (size_t i = 0; i < macro.size(); i++) {
+		const auto& result = macro[i];
+		stream << (i == 0 ? "\n" : ",\n")
+			<< "    {\n"
+			<< "      \"scene\": \"" << result.scene << "\",\n"
+			<< "      \"width\": " << result.width << ",\n"
+			<< "      \"height\": " << result.height << ",\n"
+			<< "      \"samplesPerPixel\": " << result.samplesPerPixel << ",\n"
+			<< "      \"buildMs\": " << result.buildMilliseconds << ",\n"
+			<< "      \"renderMs\": " << result.renderMilliseconds << ",\n"
+			<< "      \"rays\": " << result.statistics.total().rays() << ",\n"
+			<< "      \"mraysPerSecond\": " << result.megaraysPerSecond() << ",\n"
+			<< "      \"meanLuminance\": " << result.meanLuminance << ",\n"
+			<< "      \"processPeakRssBytes\": " << result.processPeakResidentBytes << ",\n"
+			<< "      \"stats\": ";
+		result.statistics.writeJson(stream, "      ");
+		stream << "\n    }";
+	}
+	stream << (macro.empty() ? "],\n" : "\n  ],\n");
+
+	stream << "  \"peakRssBytes\": " << peakResidentBytes() << "\n";
+	stream << "}\n";
+}
+
+void printUsage() {
+	printf(
+		"Usage: WeekendRaytracingBenchmark [options]\n"
+		"\n"
+		"Prints a JSON report to stdout, progress to stderr.\n"
+		"\n"
+		"Options:\n"
+		"	--output FILE   write the report to FILE instead\n"
+		"	--only KIND     run only the micro or the macro benchmarks\n"
+		"	--width N       width and height of the renders (default 200)\n"
+		"	--samples N     samples per pixel of the renders (default 16)\n"
+		"	--seed N        seed of the renders (default 1)\n"
+		"	--threads N     render threads (default: one per core)\n"
+		"	--min-time MS   shortest time to run a micro benchmark for (default 200)\n"
+	);
+}
+
+int main(int argc, char** argv) {
+	std::string outputPath;
+	std::string only;
+	int width = 200;
+	int samplesPerPixel = 16;
+	uint64_t seed = 1;
+	int threadCount = std::max<int>(std::thread::hardware_concurrency(), 1);
+	double minimumTime = 200;
+
+	try {
+		for (int i = 1; i < argc; i++) {
+			std::string argument = argv[i];
+
+			auto value = [&]() -> std::string {
+				if (i + 1 >= argc)
+					throw std::invalid_argument(argument + " needs a value");
+				return argv[++i];
+			};
+			auto integer = [&](long long minimum, long long maximum) {
+				return static_cast<int>(parseIntegerOption(argument, value(), minimum, maximum));
+			};
+
+			if (argument == "--output")
+				outputPath = value();
+			else if (argument == "--only") {
+				only = value();
+				if (only != "micro" && only != "macro")
+					throw std::invalid_argument("--only takes micro or macro, not " + only);
+			}
+			// Renders map pixels to the camera by width - 1, like the renderer
+			else if (argument == "--width")
+				width = integer(2, 1 << 16);
+			else if (argument == "--samples")
+				samplesPerPixel = integer(1, 1 << 30);
+			else if (argument == "--seed")
+				seed = parseIntegerOption(argument, value(), 0, INT64_MAX);
+			else if (argument == "--threads")
+				threadCount = integer(1, 1 << 12);
+			else if (argument == "--min-time")
+				minimumTime = parseRealOption(argument, value(), 1);
+			else
+				throw std::invalid_argument("Unknown option " + argument);
+		}
+	}
+	catch (const std::invalid_argument& error) {
+		printf("%.200s\n\n", error.what());
+		printUsage();
+		return 1;
+	}
+
+	std::vector<MicroResult> micro;
+	if (only != "macro")
+		micro = runMicroBenchmarks(minimumTime);
+
+	std::vector<MacroResult> macro;
+	if (only != "micro") {
+		TutorialScene tutorial;
+		BookCoverScene bookCover;
+		CornellBoxScene cornellBox;
+
+		macro.push_back(renderScene("TutorialScene", tutorial, width, samplesPerPixel, seed, threadCount));
+		macro.push_back(renderScene("BookCoverScene", bookCover, width, samplesPerPixel, seed, threadCount));
+		macro.push_back(renderScene("CornellBoxScene", cornellBox, width, samplesPerPixel, seed, threadCount));
+	}
+
+	if (!outputPath.empty()) {
+		std::ofstream file(outputPath);
+		if (!file.is_open()) {
+			printf("Error opening file %.200s\n", outputPath.c_str());
+			return 1;
+		}
+		writeReport(file, micro, macro, seed, threadCount);
+	}
+	else {
+		writeReport(std::cout, micro, macro, seed, threadCount);
+	}
+
+	return 0;
+}
@@ -1,10 +1,31 @@
 #pragma once
 
 #include <cassert>
+#include <limits>
 
 #include "ray.h"
 #include "vec3.h"
 
+// A ray prepared for many box tests in a row
+struct InverseRay {
+	point3 origin;
+	vec3 inverseDirection;
+	bool directionIsNegative[3];
+
+	InverseRay(const Ray& ray) :
+		origin(ray.origin),
+		inverseDirection(
+			1 / ray.direction.x,
+			1 / ray.direction.y,
+			1 / ray.direction.z
+		),
+		directionIsNegative{
+			inverseDirection.x < 0,
+			inverseDirection.y < 0,
+			inverseDirection.z < 0
+		} {}
+};
+
 // Axis-Aligned Bounding Box (AABB)
 class BoundingBox {
 public:
@@ -12,10 +33,11 @@ public:
 	BoundingBox(point3 cornerMin, point3 cornerMax) :
 		cornerMin(cornerMin), cornerMax(cornerMax) {
 		
+		// Flat boxes are fine, e.g. around axis-aligned triangles
 		assert(
-			cornerMin.x < cornerMax.x
-			&& cornerMin.y < cornerMax.y
-			&& cornerMin.z < cornerMax.z
+			cornerMin.x <= cornerMax.x
+			&& cornerMin.y <= cornerMax.y
+			&& cornerMin.z <= cornerMax.z
 		);
 	}
 
@@ -26,19 +48,19 @@ public:
 	}
 
 	// https://raytracing.github.io/books/RayTracingTheNextWeek#boundingvolumehierarchies/anoptimizedaabbhitmethod
-	bool hit(const Ray& ray, double tMin, double tMax) const {
+	bool hit(const Ray& ray, real tMin, real tMax) const {
 		for (int dimension = 0; dimension < 3; dimension++) {
-			double inverseDirection = 1.0 / ray.direction[dimension];
-			double t0 = (cornerMin[dimension] - ray.origin[dimension])
+			real inverseDirection = 1 / ray.direction[dimension];
+			real t0 = (cornerMin[dimension] - ray.origin[dimension])
 				* inverseDirection;
-			double t1 = (cornerMax[dimension] - ray.origin[dimension])
+			real t1 = (cornerMax[dimension] - ray.origin[dimension])
 				* inverseDirection;
 
-			if (inverseDirection < 0.0)
+			if (inverseDirection < 0)
 				std::swap(t0, t1);
 
-			tMin = std::max<double>(tMin, t0);
-			tMax = std::min<double>(tMax, t1);
+			tMin = std::max<real>(tMin, t0);
+			tMax = std::min<real>(tMax, t1);
 
 			if (tMax <= tMin)
 				return false;
@@ -47,31 +69,76 @@ public:
 		return true;
 	}
 
+	// Same as above but with the reciprocal direction precomputed, and the
+	// near and far planes picked by the sign of the direction instead of a
+	// swap. Meant for BVH traversal where one ray is tested against many
+	// boxes.
+	bool hit(const InverseRay& ray, real tMin, real tMax) const {
+		for (int dimension = 0; dimension < 3; dimension++) {
+			bool isNegative = ray.directionIsNegative[dimension];
+			const point3& nearCorner = isNegative ? cornerMax : cornerMin;
+			const point3& farCorner = isNegative ? cornerMin : cornerMax;
+
+			real t0 = (nearCorner[dimension] - ray.origin[dimension])
+				* ray.inverseDirection[dimension];
+			real t1 = (farCorner[dimension] - ray.origin[dimension])
+				* ray.inverseDirection[dimension];
+
+			// Push the far plane out by the rounding error of the lines
+			// above so that hits right on the edge of a box aren't lost
+			t1 *= ROUNDING_ERROR_SCALE;
+
+			tMin = t0 > tMin ? t0 : tMin;
+			tMax = t1 < tMax ? t1 : tMax;
+
+			// Not <=, so that flat boxes (t0 == t1) can still be hit
+			if (tMax < tMin)
+				return false;
+		}
+
+		return true;
+	}
+
 	void include(const point3& point) {
-		cornerMin.x = std::min<double>(cornerMin.x, point.x);
-		cornerMin.y = std::min<double>(cornerMin.y, point.y);
-		cornerMin.z = std::min<double>(cornerMin.z, point.z);
+		cornerMin.x = std::min<real>(cornerMin.x, point.x);
+		cornerMin.y = std::min<real>(cornerMin.y, point.y);
+		cornerMin.z = std::min<real>(cornerMin.z, point.z);
 
-		cornerMax.x = std::max<double>(cornerMax.x, point.x);
-		cornerMax.y = std::max<double>(cornerMax.y, point.y);
-		cornerMax.z = std::max<double>(cornerMax.z, point.z);
+		cornerMax.x = std::max<real>(cornerMax.x, point.x);
+		cornerMax.y = std::max<real>(cornerMax.y, point.y);
+		cornerMax.z = std::max<real>(cornerMax.z, point.z);
+	}
+
+	point3 centroid() const {
+		return 0.5 * (cornerMin + cornerMax);
+	}
+
+	real surfaceArea() const {
+		auto size = cornerMax - cornerMin;
+		return 2 * (size.x * size.y + size.y * size.z + size.z * size.x);
 	}
 
 	static BoundingBox merge(const BoundingBox& a, const BoundingBox& b) {
 		return BoundingBox(
 			point3(
-				std::min<double>(a.cornerMin.x, b.cornerMin.x),
-				std::min<double>(a.cornerMin.y, b.cornerMin.y),
-				std::min<double>(a.cornerMin.z, b.cornerMin.z)
+				std::min<real>(a.cornerMin.x, b.cornerMin.x),
+				std::min<real>(a.cornerMin.y, b.cornerMin.y),
+				std::min<real>(a.cornerMin.z, b.cornerMin.z)
 			),
 			point3(
-				std::max<double>(a.cornerMax.x, b.cornerMax.x),
-				std::max<double>(a.cornerMax.y, b.cornerMax.y),
-				std::max<double>(a.cornerMax.z, b.cornerMax.z)
+				std::max<real>(a.cornerMax.x, b.cornerMax.x),
+				std::max<real>(a.cornerMax.y, b.cornerMax.y),
+				std::max<real>(a.cornerMax.z, b.cornerMax.z)
 			)
 		);
 	}
 
+	// Bounds the relative error of the 3 operations it takes to compute a
+	// slab distance (pbrt, "Floating-Point Arithmetic and Error Propagation")
+	static constexpr real ROUNDING_ERROR_SCALE =
+		1.0 + 2.0 * (3.0 * std::numeric_limits<real>::epsilon())
+		/ (1.0 - 3.0 * std::numeric_limits<real>::epsilon());
+
 	// It is always true that
 	// cornerMin.x <= cornerMax.x
 	// cornerMin.y <= cornerMax.y
@@ -1,164 +1,503 @@
 #pragma once
 
-#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
 #include <memory>
+#include <numeric>
 #include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 #include "bounding_box.h"
 #include "commons.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "stats.h"
+
+// One node of a flattened BVH.
+//
+// Nodes are stored depth-first in one array: the first child of an interior
+// node is always the node right after it, so only the second child needs an
+// index. Leaves instead point to a contiguous range of primitives.
+//
+// A node is 64 bytes in double builds and 32 bytes in float builds, so two
+// fit in a cache line.
+struct alignas(8 * sizeof(real)) BvhNode {
+	BoundingBox aabb;
 
-// Binary Tree of (Axis-Aligned) Bounding Boxes, abbreviated BVH
-class BoundingVolumeHierarchyNode : public Hittable {
-public:
-	BoundingVolumeHierarchyNode() {}
+	// Leaf: index of its first primitive
+	// Interior: index of its second child
+	uint32_t offset;
+	// 0 for interior nodes
+	uint16_t primitiveCount;
+	// Axis the children were split along, interior nodes only
+	uint8_t axis;
 
-	BoundingVolumeHierarchyNode(
-		const HittableList& list, double tStart, double tEnd
-	) : BoundingVolumeHierarchyNode(list.hittables, tStart, tEnd) { }
+	bool isLeaf() const { return primitiveCount > 0; }
+};
 
-	BoundingVolumeHierarchyNode(
-		const std::vector<std::shared_ptr<Hittable>>& list,
-		double tStart,
-		double tEnd
-	) : BoundingVolumeHierarchyNode(
-		list, tStart, tEnd, 0, list.size()
-	) {	}
-
-	BoundingVolumeHierarchyNode(
-		const std::vector<std::shared_ptr<Hittable>>& sourceList,
-		const double tStart,
-		const double tEnd,
-		const size_t start,
-		const size_t end
-	) {
+static_assert(
+	sizeof(BvhNode) == 8 * sizeof(real),
+	"BvhNode should be the box plus 8 bytes of padded bookkeeping"
+);
+
+// Tuning knobs of the SAH builder
+struct BvhBuildConfig {
+	// Leaves stop splitting below this size if the SAH says a split isn't
+	// worth it. Larger leaves are always split.
+	int maxPrimitivesInLeaf = 4;
+	// Candidate split planes per axis are placed at bin boundaries
+	int binCount = 16;
+	// Relative cost of visiting a node and of intersecting a primitive
+	double traversalCost = 1.0;
+	double intersectionCost = 1.0;
+};
 
-		auto hittableCount = end - start;
-		if (hittableCount == 1) {
-			left = right = sourceList[0];
+// Binary Tree of (Axis-Aligned) Bounding Boxes, abbreviated BVH, flattened
+// into an array.
+//
+// The tree knows nothing about what it contains. It is built from a list of
+// bounding boxes and leaves refer to primitives by their position in
+// primitiveOrder, so whoever owns the primitives should store them in that
+// order and intersect them when asked to during traversal.
+class BvhTree {
+public:
+	static constexpr int MAX_DEPTH = 64;
+	// BvhNode::primitiveCount is 16 bits, bigger leaves are always split
+	static constexpr size_t MAX_LEAF_PRIMITIVES = std::numeric_limits<uint16_t>::max();
+
+	std::vector<BvhNode> nodes;
+	// The i-th primitive reachable from the leaves is
+	// primitiveOrder[i] in the list the tree was built from
+	std::vector<uint32_t> primitiveOrder;
+
+	BvhTree() {}
+
+	BvhTree(
+		const std::vector<BoundingBox>& primitiveBounds,
+		const BvhBuildConfig& config = BvhBuildConfig()
+	) : config(config) {
+		if (primitiveBounds.empty())
+			throw std::invalid_argument("BVH requires at least one primitive");
+		if (config.maxPrimitivesInLeaf < 1 || config.binCount < 2)
+			throw std::invalid_argument("Invalid BVH build config");
+
+		primitiveOrder.resize(primitiveBounds.size());
+		std::iota(primitiveOrder.begin(), primitiveOrder.end(), 0);
+
+		// Splits are decided by centroids, so compute them only once
+		std::vector<point3> centroids;
+		centroids.reserve(primitiveBounds.size());
+		for (const auto& box : primitiveBounds)
+			centroids.push_back(box.centroid());
+
+		nodes.reserve(2 * primitiveBounds.size() - 1);
+		buildNode(primitiveBounds, centroids, 0, primitiveOrder.size(), 0);
+	}
 
-			auto box = left->boundingBox(tStart, tEnd);
-			if (!box)
-				throw NO_BOX_ERROR;
+	const BoundingBox& boundingBox() const {
+		return nodes[0].aabb;
+	}
+
+	// Finds the closest hit along the ray.
+	//
+	// intersect(i, tMax) is called for every primitive i (in primitiveOrder
+	// order) whose leaf the ray reaches. It should return true and lower tMax
+	// if the primitive is hit closer than tMax.
+	template<typename IntersectPrimitive>
+	bool traverse(
+		const Ray& ray,
+		real tMin,
+		real tMax,
+		IntersectPrimitive&& intersect
+	) const {
+		const InverseRay inverseRay(ray);
+		bool hitAnything = false;
+		TraversalCounts counts;
+
+		uint32_t stack[MAX_DEPTH];
+		int stackSize = 0;
+		uint32_t current = 0;
+
+		while (true) {
+			const BvhNode& node = nodes[current];
+
+			counts.boxTests++;
+			if (node.aabb.hit(inverseRay, tMin, tMax)) {
+				counts.nodesVisited++;
+				if (node.isLeaf()) {
+					counts.primitiveTests += node.primitiveCount;
+					for (uint32_t i = 0; i < node.primitiveCount; i++) {
+						if (intersect(node.offset + i, tMax))
+							hitAnything = true;
+					}
+				}
+				else {
+					// Visit the child closer to the ray origin first so that
+					// tMax shrinks early and the far child can be culled
+					if (inverseRay.directionIsNegative[node.axis]) {
+						stack[stackSize++] = current + 1;
+						current = node.offset;
+					}
+					else {
+						stack[stackSize++] = node.offset;
+						current = current + 1;
+					}
+					continue;
+				}
+			}
 
-			aabb = box.value();
-			return;
+			if (stackSize == 0)
+				break;
+			current = stack[--stackSize];
 		}
 
-		partitionHittables(sourceList, tStart, tEnd, start, end);
-		computeAABB(tStart, tEnd);
+		return hitAnything;
 	}
 
-	std::optional<HitRecord> hit(
-		const Ray& ray, double tMin, double tMax
+	// Whether the ray hits anything at all, for shadow rays.
+	//
+	// test(i) is called for primitives the same way as in traverse(), and
+	// should return true if primitive i is hit between tMin and tMax.
+	// Returns as soon as it does, without looking for the closest hit.
+	template<typename TestPrimitive>
+	bool traverseAny(
+		const Ray& ray,
+		real tMin,
+		real tMax,
+		TestPrimitive&& test
 	) const {
-		if (!aabb.hit(ray, tMin, tMax))
-			return {};
+		const InverseRay inverseRay(ray);
+		TraversalCounts counts;
+
+		uint32_t stack[MAX_DEPTH];
+		int stackSize = 0;
+		uint32_t current = 0;
+
+		while (true) {
+			const BvhNode& node = nodes[current];
+
+			counts.boxTests++;
+			if (node.aabb.hit(inverseRay, tMin, tMax)) {
+				counts.nodesVisited++;
+				if (node.isLeaf()) {
+					for (uint32_t i = 0; i < node.primitiveCount; i++) {
+						counts.primitiveTests++;
+						if (test(node.offset + i))
+							return true;
+					}
+				}
+				else {
+					// Order doesn't matter, any hit will do
+					stack[stackSize++] = node.offset;
+					current = current + 1;
+					continue;
+				}
+			}
 
-		auto hitsLeft = left->hit(ray, tMin, tMax);
-		if (hitsLeft)
-			tMax = hitsLeft.value().t;
+			if (stackSize == 0)
+				break;
+			current = stack[--stackSize];
+		}
 
-		auto hitsRight = right->hit(ray, tMin, tMax);
+		return false;
+	}
 
-		if (hitsRight)
-			return hitsRight;
+private:
+	BvhBuildConfig config;
 
-		return hitsLeft;
-	}
+	// Beyond this depth, fall back to median splits so the tree can't get
+	// deeper than the traversal stack no matter how lopsided the SAH is
+	static constexpr int SAH_MAX_DEPTH = MAX_DEPTH / 2;
 
-	std::optional<BoundingBox> boundingBox(double tStart, double tEnd) const {
-		return aabb;
-	}
+	struct Bin {
+		BoundingBox aabb;
+		size_t count = 0;
 
-private:
-	// Children nodes
-	std::shared_ptr<Hittable> left;
-	std::shared_ptr<Hittable> right;
+		void add(const BoundingBox& box) {
+			aabb = count == 0 ? box : BoundingBox::merge(aabb, box);
+			count++;
+		}
+	};
+
+	struct Split {
+		int axis = -1; // -1 when no split was found
+		int bin = 0; // primitives in bins [0, bin) go to the first child
+		double cost = std::numeric_limits<double>::infinity();
+	};
+
+	// Builds the subtree of primitiveOrder[start, end) and returns the index
+	// of its root
+	uint32_t buildNode(
+		const std::vector<BoundingBox>& primitiveBounds,
+		const std::vector<point3>& centroids,
+		size_t start,
+		size_t end,
+		int depth
+	) {
+		uint32_t nodeIndex = static_cast<uint32_t>(nodes.size());
+		nodes.emplace_back();
 
-	BoundingBox aabb;
+		BoundingBox aabb = primitiveBounds[primitiveOrder[start]];
+		BoundingBox centroidBounds;
+		centroidBounds.cornerMin = centroidBounds.cornerMax =
+			centroids[primitiveOrder[start]];
 
-	
-	static const std::invalid_argument NO_BOX_ERROR;
+		for (size_t i = start + 1; i < end; i++) {
+			aabb = BoundingBox::merge(aabb, primitiveBounds[primitiveOrder[i]]);
+			centroidBounds.include(centroids[primitiveOrder[i]]);
+		}
+		nodes[nodeIndex].aabb = aabb;
+
+		size_t primitiveCount = end - start;
+		if (primitiveCount == 1 || depth >= MAX_DEPTH - 1)
+			return makeLeaf(nodeIndex, start, end);
+
+		size_t middle = start;
+		int axis = 0;
+
+		if (depth < SAH_MAX_DEPTH) {
+			Split split = findSahSplit(
+				primitiveBounds, centroids, centroidBounds, start, end
+			);
+
+			double leafCost = config.intersectionCost * primitiveCount;
+			bool fitsInLeaf = primitiveCount <= std::min(
+				static_cast<size_t>(config.maxPrimitivesInLeaf), MAX_LEAF_PRIMITIVES
+			);
+			if (fitsInLeaf && (split.axis < 0 || split.cost >= leafCost))
+				return makeLeaf(nodeIndex, start, end);
+
+			if (split.axis >= 0) {
+				axis = split.axis;
+				auto orderBegin = primitiveOrder.begin();
+				auto partitionPoint = std::partition(
+					orderBegin + start,
+					orderBegin + end,
+					[&](uint32_t index) {
+						return binOf(centroids[index], centroidBounds, axis)
+							< split.bin;
+					}
+				);
+				middle = partitionPoint - orderBegin;
+			}
+		}
 
-	void computeAABB(double tStart, double tEnd) {
-		auto leftBox = left->boundingBox(tStart, tEnd);
-		auto rightBox = right->boundingBox(tStart, tEnd);
-		if (!leftBox || !rightBox)
-			throw NO_BOX_ERROR;
+		// All centroids in one spot, or too deep for the SAH
+		if (middle == start || middle == end) {
+			axis = longestAxis(centroidBounds);
+			middle = splitAtMedian(centroids, axis, start, end);
+		}
 
-		aabb = BoundingBox::merge(leftBox.value(), rightBox.value());
-	}
+		buildNode(primitiveBounds, centroids, start, middle, depth + 1);
+		uint32_t secondChild =
+			buildNode(primitiveBounds, centroids, middle, end, depth + 1);
 
-	void partitionHittables(
-		const std::vector<std::shared_ptr<Hittable>>& sourceList,
-		const double tStart,
-		const double tEnd,
-		const size_t start,
-		const size_t end
-	) {
-		// TODO: Reevaluate this globalRNG usage
-		// Get random axis
-		const Axis axis = static_cast<Axis>(globalRng.randomInt(0, 2));
-		const auto comparator = makeBoundingBoxComparator(axis, tStart, tEnd);
+		nodes[nodeIndex].offset = secondChild;
+		nodes[nodeIndex].primitiveCount = 0;
+		nodes[nodeIndex].axis = static_cast<uint8_t>(axis);
+		return nodeIndex;
+	}
 
-		auto hittableCount = end - start;
+	uint32_t makeLeaf(uint32_t nodeIndex, size_t start, size_t end) {
+		// Median splits past SAH_MAX_DEPTH halve leaves quicker than this
+		// can happen with 32-bit primitive indices, but don't truncate
+		if (end - start > MAX_LEAF_PRIMITIVES) {
+			throw std::runtime_error(
+				"BVH leaf of " + std::to_string(end - start) + " primitives at the maximum depth"
+			);
+		}
 
-		if (hittableCount == 2) {
-			auto hittableA = sourceList[start];
-			auto hittableB = sourceList[start + 1];
+		nodes[nodeIndex].offset = static_cast<uint32_t>(start);
+		nodes[nodeIndex].primitiveCount = static_cast<uint16_t>(end - start);
+		nodes[nodeIndex].axis = 0;
+		return nodeIndex;
+	}
 
-			if (comparator(hittableA, hittableB)) {
-				left = hittableA;
-				right = hittableB;
+	// Bins primitives by centroid along every axis and returns the bin
+	// boundary with the lowest surface area heuristic cost
+	Split findSahSplit(
+		const std::vector<BoundingBox>& primitiveBounds,
+		const std::vector<point3>& centroids,
+		const BoundingBox& centroidBounds,
+		size_t start,
+		size_t end
+	) const {
+		const int binCount = config.binCount;
+		std::vector<Bin> bins(binCount);
+		// Cost of the primitives on the right of each bin boundary
+		std::vector<double> rightCosts(binCount);
+
+		double parentArea = nodes.back().aabb.surfaceArea();
+		// Boxes of zero area (flat nodes) would make every split look free
+		if (parentArea <= 0.0)
+			parentArea = 1.0;
+
+		Split best;
+
+		for (int axis = 0; axis < 3; axis++) {
+			if (centroidBounds.cornerMax[axis] <= centroidBounds.cornerMin[axis])
+				continue;
+
+			std::fill(bins.begin(), bins.end(), Bin());
+			for (size_t i = start; i < end; i++) {
+				auto index = primitiveOrder[i];
+				int bin = binOf(centroids[index], centroidBounds, axis);
+				bins[bin].add(primitiveBounds[index]);
 			}
-			else {
-				left = hittableB;
-				right = hittableA;
+
+			// Sweep from the right...
+			Bin right;
+			for (int bin = binCount - 1; bin > 0; bin--) {
+				if (bins[bin].count > 0) {
+					right.aabb = right.count == 0
+						? bins[bin].aabb
+						: BoundingBox::merge(right.aabb, bins[bin].aabb);
+					right.count += bins[bin].count;
+				}
+				rightCosts[bin] = right.count * right.aabb.surfaceArea();
 			}
 
-			return;
+			// ...then from the left, evaluating the split at each boundary
+			Bin left;
+			for (int bin = 1; bin < binCount; bin++) {
+				const Bin& previous = bins[bin - 1];
+				if (previous.count > 0) {
+					left.aabb = left.count == 0
+						? previous.aabb
+						: BoundingBox::merge(left.aabb, previous.aabb);
+					left.count += previous.count;
+				}
+
+				if (left.count == 0 || left.count == end - start)
+					continue;
+
+				double leftCost = left.count * left.aabb.surfaceArea();
+				double cost = config.traversalCost
+					+ config.intersectionCost
+					* (leftCost + rightCosts[bin]) / parentArea;
+
+				if (cost < best.cost) {
+					best.axis = axis;
+					best.bin = bin;
+					best.cost = cost;
+				}
+			}
 		}
 
-		// Copy sourceList
-		std::vector<std::shared_ptr<Hittable>> list = sourceList;
+		return best;
+	}
 
-		auto listBegin = list.begin();
-		std::sort(listBegin + start, listBegin + end, comparator);
+	int binOf(
+		const point3& centroid, const BoundingBox& centroidBounds, int axis
+	) const {
+		double extent =
+			centroidBounds.cornerMax[axis] - centroidBounds.cornerMin[axis];
+		double offset =
+			(centroid[axis] - centroidBounds.cornerMin[axis]) / extent;
 
-		// Recursion
+		int bin = static_cast<int>(offset * config.binCount);
+		return std::clamp(bin, 0, config.binCount - 1);
+	}
+
+	size_t splitAtMedian(
+		const std::vector<point3>& centroids, int axis, size_t start, size_t end
+	) {
 		size_t middle = (start + end) / 2;
-		left = std::make_shared<BoundingVolumeHierarchyNode>(
-			list, tStart, tEnd, start, middle
-		);
-		right = std::make_shared<BoundingVolumeHierarchyNode>(
-			list, tStart, tEnd, middle, end
+		auto orderBegin = primitiveOrder.begin();
+		std::nth_element(
+			orderBegin + start,
+			orderBegin + middle,
+			orderBegin + end,
+			[&](uint32_t a, uint32_t b) {
+				return centroids[a][axis] < centroids[b][axis];
+			}
 		);
+		return middle;
 	}
 
-	std::function<
-		bool(
-			const std::shared_ptr<Hittable>, 
-			const std::shared_ptr<Hittable>
-			)
-	> makeBoundingBoxComparator(Axis axis, double tStart, double tEnd) {
-		return [=](
-			const std::shared_ptr<Hittable> a,
-			const std::shared_ptr<Hittable> b
-			) {
-				auto boxA = a->boundingBox(tStart, tEnd);
-				if (!boxA)
-					throw NO_BOX_ERROR;
+	static int longestAxis(const BoundingBox& box) {
+		auto size = box.cornerMax - box.cornerMin;
+		if (size.x >= size.y && size.x >= size.z)
+			return Axis::X;
+		return size.y >= size.z ? Axis::Y : Axis::Z;
+	}
+};
 
-				auto boxB = b->boundingBox(tStart, tEnd);
-				if (!boxB)
-					throw NO_BOX_ERROR;
+// BVH over the hittables of a scene
+class BoundingVolumeHierarchy : public Hittable {
+public:
+	BoundingVolumeHierarchy(
+		const HittableList& list,
+		real tStart,
+		real tEnd,
+		const BvhBuildConfig& config = BvhBuildConfig()
+	) : BoundingVolumeHierarchy(list.hittables, tStart, tEnd, config) { }
+
+	BoundingVolumeHierarchy(
+		const std::vector<std::shared_ptr<Hittable>>& list,
+		real tStart,
+		real tEnd,
+		const BvhBuildConfig& config = BvhBuildConfig()
+	) {
+		std::vector<BoundingBox> bounds;
+		bounds.reserve(list.size());
 
-				return boxA.value().cornerMin[axis] < boxB.value().cornerMin[axis];
-		};
+		for (const auto& hittable : list) {
+			auto box = hittable->boundingBox(tStart, tEnd);
+			if (!box)
+				throw NO_BOX_ERROR;
+
+			bounds.push_back(box.value());
+		}
+
+		tree = BvhTree(bounds, config);
+
+		// Store the hittables in the order the leaves expect
+		hittables.reserve(list.size());
+		for (auto index : tree.primitiveOrder)
+			hittables.push_back(list[index]);
+	}
+
+	virtual bool intersect(
+		const Ray& ray, real tMin, real tMax, HitCandidate& closest
+	) const override {
+		return tree.traverse(ray, tMin, tMax, [&](uint32_t index, real& tMax) {
+			if (!hittables[index]->intersect(ray, tMin, tMax, closest))
+				return false;
+
+			tMax = closest.t;
+			return true;
+		});
+	}
+
+	virtual HitRecord finalize(const Ray& ray, const HitCandidate& candidate) const override {
+		return candidate.hittable->finalize(ray, candidate);
+	}
+
+	virtual bool occluded(const Ray& ray, real tMin, real tMax) const override {
+		return tree.traverseAny(ray, tMin, tMax, [&](uint32_t index) {
+			return hittables[index]->occluded(ray, tMin, tMax);
+		});
 	}
+
+	virtual std::optional<BoundingBox> boundingBox(real tStart, real tEnd) const override {
+		return tree.boundingBox();
+	}
+
+	virtual void collectEmitters(std::vector<Emitter>& emitters) const override {
+		for (const auto& hittable : hittables)
+			hittable->collectEmitters(emitters);
+	}
+
+private:
+	BvhTree tree;
+	std::vector<std::shared_ptr<Hittable>> hittables;
+
+	static const std::invalid_argument NO_BOX_ERROR;
 };
 
-const std::invalid_argument BoundingVolumeHierarchyNode::NO_BOX_ERROR = 
-	std::invalid_argument("Hittable does not have a Bounding Box");
\ No newline at end of file
+const std::invalid_argument BoundingVolumeHierarchy::NO_BOX_ERROR =
+	std::invalid_argument("Hittable does not have a Bounding Box");
@@ -2,16 +2,17 @@
 
 #include "commons.h"
 #include "ray.h"
+#include "sampler.h"
 #include "vec3.h"
 
 struct CameraConfig {
     point3 lookFrom;
     point3 lookAt;
     vec3 worldUp;
-    double verticalFovInDegrees;
-    double aspectRatio;
-    double aperture;
-    double focalLength;
+    real verticalFovInDegrees;
+    real aspectRatio;
+    real aperture;
+    real focalLength;
 };
 
 class Camera {
@@ -35,10 +36,11 @@ public:
         lensRadius = config.aperture / 2;
 	}
 
+    // lens is where on the lens the ray starts, uniform in [0, 1)^2
     Ray rayFromUV(
-        double screenU, double screenV, RandomNumberGenerator rng
+        real screenU, real screenV, Sample2D lens
     ) const {
-        vec3 lensPosition = lensRadius * vec3::randomInUnitDisk(rng);
+        vec3 lensPosition = lensRadius * vec3::inUnitDisk(lens.u, lens.v);
         vec3 offset = right * lensPosition.x + up * lensPosition.y;
 
         return Ray(
@@ -59,5 +61,5 @@ private:
     // Their origin is (0,0,0)
     vec3 horizontal, vertical;
     vec3 forward, right, up;
-    double lensRadius;
+    real lensRadius;
 };
\ No newline at end of file
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#include "commons.h"
+#include "framebuffer.h"
+#include "render_config.h"
+
+// Binary checkpoints of a render: the framebuffer (sums, sample counts and
+// variances) plus the RenderState. Only meant to be read back on the same
+// kind of machine with the same build, which the header checks.
+struct CheckpointHeader {
+	static constexpr char MAGIC[4] = { 'W', 'R', 'C', 'P' };
+	static constexpr uint32_t VERSION = 2;
+
+	char magic[4];
+	uint32_t version;
+	uint32_t realSize;
+	int32_t width, height;
+};
+
+template<typename T>
+inline void writeBinary(std::ostream& stream, const T& value) {
+	stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+inline void readBinary(std::istream& stream, T& value) {
+	stream.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+// Writes to a temporary file first and then replaces path with it, so a
+// render killed halfway through saving keeps its last checkpoint
+void saveCheckpoint(
+	const std::string& path,
+	const Framebuffer& framebuffer,
+	const RenderState& state
+) {
+	std::string temporaryPath = path + ".tmp";
+	{
+		std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+		if (!file.is_open())
+			throw std::runtime_error("Can't open " + temporaryPath);
+
+		CheckpointHeader header = {
+			{ 'W', 'R', 'C', 'P' },
+			CheckpointHeader::VERSION,
+			sizeof(real),
+			framebuffer.getWidth(),
+			framebuffer.getHeight()
+		};
+		writeBinary(file, header);
+
+		const SamplingConfig& sampling = state.sampling;
+		writeBinary(file, sampling.minSamples);
+		writeBinary(file, sampling.maxSamples);
+		writeBinary(file, sampling.errorThreshold);
+		writeBinary(file, sampling.checkInterval);
+		writeBinary(file, sampling.passSamples);
+		writeBinary(file, sampling.sampler);
+		writeBinary(file, state.seed);
+		writeBinary(file, state.passesDone);
+
+		framebuffer.write(file);
+
+		if (!file)
+			throw std::runtime_error("Error writing " + temporaryPath);
+	}
+
+	std::filesystem::rename(temporaryPath, path);
+}
+
+Framebuffer loadCheckpoint(const std::string& path, RenderState& state) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open())
+		throw std::runtime_error("Can't open " + path);
+
+	CheckpointHeader header;
+	readBinary(file, header);
+
+	const char* magic = CheckpointHeader::MAGIC;
+	if (!file || !std::equal(magic, magic + 4, header.magic))
+		throw std::runtime_error(path + " isn't a checkpoint");
+	if (header.version != CheckpointHeader::VERSION)
+		throw std::runtime_error(path + " is from another version");
+	if (header.realSize != sizeof(real))
+		throw std::runtime_error(path + " is from a build with another precision");
+	if (header.width <= 0 || header.height <= 0)
+		throw std::runtime_error(path + " has no image");
+
+	SamplingConfig& sampling = state.sampling;
+	readBinary(file, sampling.minSamples);
+	readBinary(file, sampling.maxSamples);
+	readBinary(file, sampling.errorThreshold);
+	readBinary(file, sampling.checkInterval);
+	readBinary(file, sampling.passSamples);
+	readBinary(file, sampling.sampler);
+	readBinary(file, state.seed);
+	readBinary(file, state.passesDone);
+
+	if (!file)
+		throw std::runtime_error(path + " is cut short");
+	if (sampling.sampler < SamplerType::Independent || sampling.sampler > SamplerType::BlueNoise)
+		throw std::runtime_error(path + " has an unknown sampler");
+
+	Framebuffer framebuffer(header.width, header.height);
+	framebuffer.read(file);
+
+	// Anything left over means the layout doesn't match what was saved
+	if (file.peek() != std::ifstream::traits_type::eof())
+		throw std::runtime_error(path + " is longer than its image");
+	return framebuffer;
+}
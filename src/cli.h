@@ -0,0 +1,222 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "option_parsing.h"
+#include "sampler.h"
+
+// Everything the command line sets
+struct Options {
+	// Image, then optionally the heatmap
+	std::vector<std::string> files;
+
+	// Built-in scene name or scene file
+	std::string scene = "cornell";
+	// First and last frame of an animation, both rendered. None renders
+	// the scene as it is at frame 0 to the files as given.
+	std::optional<std::pair<int, int>> frames;
+	int width = 400;
+	int height = 400;
+
+	int minSamples = 16;
+	int maxSamples = 400;
+	// 0 takes maxSamples everywhere
+	double errorThreshold = 0.02;
+	int maxBounces = 50;
+	SamplerType sampler = SamplerType::Sobol;
+	std::optional<uint64_t> seed;
+
+	// 0 uses every core
+	int threads = 0;
+
+	// Overrides the image format of the output's extension
+	std::string format;
+
+	// Where to keep built scene files, none if empty
+	std::string cacheDirectory;
+
+	std::string checkpointPath;
+	std::string resumePath;
+	int topUpSamples = 0;
+
+	std::string statsPath;
+	std::string tracePath;
+};
+
+void printUsage() {
+	printf(
+		"Usage: WeekendRaytracing.exe output.ppm [heatmap.ppm] [options]\n"
+		"\n"
+		"Images are saved as binary .ppm, or as linear HDR .pfm.\n"
+		"heatmap.ppm gets a heatmap of the samples taken per pixel.\n"
+		"\n"
+		"Options:\n"
+		"	--scene SCENE      tutorial, bookcover, cornell (default) or the\n"
+		"	                   path of a scene file\n"
+		"	--frames A-B       render frames A to B of an animated scene, or\n"
+		"	                   just frame A. The last run of # in the file\n"
+		"	                   names becomes the frame number, or _0001 goes\n"
+		"	                   before the extension if there's none\n"
+		"	--width N          image width, 400 by default\n"
+		"	--height N         image height, 400 by default\n"
+		"	--samples N        at most N samples per pixel, 400 by default\n"
+		"	--min-samples N    at least N samples per pixel, 16 by default\n"
+		"	--threshold E      pixels stop taking samples when their relative\n"
+		"	                   error is below E, 0.02 by default. 0 takes\n"
+		"	                   --samples everywhere\n"
+		"	--max-bounces N    longest paths, 50 bounces by default\n"
+		"	--sampler NAME     independent, stratified, sobol (default) or\n"
+		"	                   bluenoise\n"
+		"	--seed N           seed of the random numbers, for repeatable renders\n"
+		"	--threads N        render threads, one per core by default\n"
+		"	--format FORMAT    ppm or pfm, whatever the output's extension\n"
+		"	--cache DIR        save scene files to DIR once built, and load\n"
+		"	                   them from there while their geometry and\n"
+		"	                   materials stay the same\n"
+		"	--checkpoint FILE  save the render to FILE every now and then\n"
+		"	--resume FILE      continue the render saved in FILE, and keep\n"
+		"	                   saving to it. Sampling settings and the seed\n"
+		"	                   come from FILE\n"
+		"	--top-up N         with --resume, allow N more samples per pixel\n"
+		"	--stats FILE       save render statistics to FILE as JSON\n"
+		"	--trace FILE       save a timeline of the render to FILE, for\n"
+		"	                   chrome://tracing or ui.perfetto.dev\n"
+	);
+}
+
+// File of one frame of an animation: path with its last run of # replaced by
+// the frame number, zero padded to that many digits, or with _NNNN before
+// the extension
+std::string framePath(const std::string& path, int frame) {
+	auto last = path.find_last_of('#');
+	if (last != std::string::npos) {
+		auto first = last;
+		while (first > 0 && path[first - 1] == '#')
+			first--;
+
+		std::string number = std::to_string(frame);
+		size_t width = last - first + 1;
+		if (number.size() < width)
+			number.insert(0, width - number.size(), '0');
+
+		return path.substr(0, first) + number + path.substr(last + 1);
+	}
+
+	char number[32];
+	snprintf(number, sizeof(number), "_%04d", frame);
+
+	auto slash = path.find_last_of("/\\");
+	auto dot = path.find_last_of('.');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return path + number;
+	return path.substr(0, dot) + number + path.substr(dot);
+}
+
+// Throws std::invalid_argument saying what's wrong
+Options parseArguments(int argc, char** argv) {
+	Options options;
+
+	const int maxInt = 1 << 30;
+	// Last option given that a checkpoint overrides, see --resume
+	std::string checkpointedOption;
+
+	for (int i = 1; i < argc; i++) {
+		std::string argument = argv[i];
+
+		if (!argument.starts_with("--")) {
+			options.files.push_back(argument);
+			continue;
+		}
+
+		// Options taking a value read it from the next argument
+		auto value = [&]() -> std::string {
+			if (i + 1 >= argc)
+				throw std::invalid_argument(argument + " needs a value");
+			return argv[++i];
+		};
+
+		if (argument == "--samples" || argument == "--min-samples" || argument == "--threshold"
+			|| argument == "--sampler" || argument == "--seed")
+			checkpointedOption = argument;
+
+		auto integer = [&](long long minimum, long long maximum) {
+			return static_cast<int>(parseIntegerOption(argument, value(), minimum, maximum));
+		};
+
+		if (argument == "--scene")
+			options.scene = value();
+		else if (argument == "--frames") {
+			std::string range = value();
+			auto dash = range.find('-', 1);
+			int first = static_cast<int>(parseIntegerOption(argument, range.substr(0, dash), 0, maxInt));
+			int last = first;
+			if (dash != std::string::npos)
+				last = static_cast<int>(parseIntegerOption(argument, range.substr(dash + 1), first, maxInt));
+			options.frames = { first, last };
+		}
+		// At least 2, pixels are mapped to the camera's [0, 1] by size - 1
+		else if (argument == "--width")
+			options.width = integer(2, 1 << 16);
+		else if (argument == "--height")
+			options.height = integer(2, 1 << 16);
+		else if (argument == "--samples")
+			options.maxSamples = integer(1, maxInt);
+		else if (argument == "--min-samples")
+			options.minSamples = integer(1, maxInt);
+		else if (argument == "--threshold")
+			options.errorThreshold = parseRealOption(argument, value(), 0);
+		else if (argument == "--max-bounces")
+			options.maxBounces = integer(1, maxInt);
+		else if (argument == "--sampler")
+			options.sampler = samplerTypeFromName(value());
+		else if (argument == "--seed")
+			options.seed = parseIntegerOption(argument, value(), 0, INT64_MAX);
+		else if (argument == "--threads")
+			options.threads = integer(1, 1 << 12);
+		else if (argument == "--format")
+			options.format = value();
+		else if (argument == "--cache")
+			options.cacheDirectory = value();
+		else if (argument == "--checkpoint")
+			options.checkpointPath = value();
+		else if (argument == "--resume")
+			options.resumePath = value();
+		else if (argument == "--top-up")
+			options.topUpSamples = integer(0, maxInt);
+		else if (argument == "--stats")
+			options.statsPath = value();
+		else if (argument == "--trace")
+			options.tracePath = value();
+		else
+			throw std::invalid_argument("Unknown option " + argument);
+	}
+
+	if (options.files.empty())
+		throw std::invalid_argument("No output file");
+	if (options.files.size() > 2)
+		throw std::invalid_argument("Too many files");
+	if (options.topUpSamples > 0 && options.resumePath.empty())
+		throw std::invalid_argument("--top-up needs --resume");
+	if (!options.resumePath.empty() && !checkpointedOption.empty()) {
+		throw std::invalid_argument(
+			checkpointedOption + " can't be used with --resume, the checkpoint has its own"
+			" (--top-up allows more samples)"
+		);
+	}
+	if (options.frames && !(options.resumePath.empty() && options.checkpointPath.empty()))
+		throw std::invalid_argument("--frames can't be used with --checkpoint or --resume");
+	// Pixels take their minimum before adaptive sampling gets a say
+	if (options.minSamples > options.maxSamples)
+		options.minSamples = options.maxSamples;
+
+	if (!options.resumePath.empty() && options.checkpointPath.empty())
+		options.checkpointPath = options.resumePath;
+
+	return options;
+}
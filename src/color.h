@@ -4,22 +4,19 @@
 
 #include <algorithm>
 #include <cmath>
-#include <iostream>
 
-void writePixel(std::ostream& stream, color3 pixel) {
-	pixel.r = std::clamp(pixel.r, 0.0, 1.0);
-	pixel.g = std::clamp(pixel.g, 0.0, 1.0);
-	pixel.b = std::clamp(pixel.b, 0.0, 1.0);
-
-	stream << static_cast<int>(255.999 * pixel.x) << ' '
-	       << static_cast<int>(255.999 * pixel.y) << ' '
-	       << static_cast<int>(255.999 * pixel.z) << '\n';
+// Perceived brightness of a linear color (Rec. 709 weights)
+real luminance(const color3& color) {
+	return real(0.2126) * color.r + real(0.7152) * color.g + real(0.0722) * color.b;
 }
 
-color3 gammaCorrect(const color3& pixel) {
+// Color ramp for visualizing a value between 0 and 1, going from black
+// through blue and red to yellow
+color3 heatmapColor(real value) {
+	value = std::clamp<real>(value, 0, 1);
 	return color3(
-		std::sqrt(pixel.r),
-		std::sqrt(pixel.g),
-		std::sqrt(pixel.b)
+		std::clamp<real>(3 * value - 1, 0, 1),
+		std::clamp<real>(3 * value - 2, 0, 1),
+		std::clamp<real>(value < real(0.5) ? 3 * value : 3 * (1 - value) - real(0.5), 0, 1)
 	);
-}
\ No newline at end of file
+}
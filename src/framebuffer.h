@@ -0,0 +1,143 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+#include "color.h"
+#include "image.h"
+#include "vec3.h"
+
+// Image that accumulates samples instead of storing finished pixels.
+// Each pixel keeps the sum of its samples plus how many samples went into it,
+// and the final color is their average.
+//
+// Pixels also keep a running variance of their samples' luminance
+// (Welford's algorithm), which tells how noisy their average still is.
+//
+// There is only one of these per render. Threads write to it without locks
+// because the tile scheduler hands every tile to exactly one thread.
+class Framebuffer {
+public:
+	// Pixels darker than this count as this bright in displayError(), so
+	// near-black pixels don't need to be exact
+	static constexpr double MIN_ERROR_LUMINANCE = 0.01;
+
+	Framebuffer(int width, int height) :
+		width(width),
+		height(height),
+		accumulated(width * height, color3(0)),
+		sampleCounts(width * height, 0),
+		luminanceMeans(width * height, 0),
+		luminanceSquaredDeviations(width * height, 0) {}
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+
+	// Row 0 is the top of the image
+	void addSample(int x, int y, const color3& sample) {
+		auto index = indexOf(x, y);
+		accumulated[index] += sample;
+		sampleCounts[index]++;
+
+		double value = luminance(sample);
+		double delta = value - luminanceMeans[index];
+		luminanceMeans[index] += delta / sampleCounts[index];
+		luminanceSquaredDeviations[index] += delta * (value - luminanceMeans[index]);
+	}
+
+	int sampleCount(int x, int y) const {
+		return sampleCounts[indexOf(x, y)];
+	}
+
+	// Average of all samples taken so far, black if there are none
+	color3 resolve(int x, int y) const {
+		auto index = indexOf(x, y);
+		if (sampleCounts[index] == 0)
+			return color3(0);
+
+		return accumulated[index] / sampleCounts[index];
+	}
+
+	// resolve() of every pixel at once
+	Image resolveAll() const {
+		Image image(width, height);
+		float* out = image.pixels.data();
+
+		for (size_t index = 0; index < sampleCounts.size(); index++) {
+			real scale = sampleCounts[index] == 0 ? 0 : real(1) / sampleCounts[index];
+			for (int channel = 0; channel < 3; channel++)
+				*out++ = static_cast<float>(accumulated[index][channel] * scale);
+		}
+
+		return image;
+	}
+
+	// Estimated standard error of the pixel's average luminance, as it will
+	// show once gamma corrected. gammaCorrect() takes the square root, which
+	// turns an error e in an average m into about e / (2 sqrt(m)), so dark
+	// pixels need to be more exact than bright ones.
+	// Infinite until there are two samples to go by.
+	double displayError(int x, int y) const {
+		auto index = indexOf(x, y);
+		int count = sampleCounts[index];
+		if (count < 2)
+			return std::numeric_limits<double>::infinity();
+
+		double variance = luminanceSquaredDeviations[index] / (count - 1);
+		double standardError = std::sqrt(variance / count);
+		double mean = std::max(luminanceMeans[index], MIN_ERROR_LUMINANCE);
+		return standardError / (2 * std::sqrt(mean));
+	}
+
+	// Raw contents for checkpoints, in the machine's own byte order and
+	// precision. read() expects the same image size that was written.
+	void write(std::ostream& stream) const {
+		writeArray(stream, accumulated);
+		writeArray(stream, sampleCounts);
+		writeArray(stream, luminanceMeans);
+		writeArray(stream, luminanceSquaredDeviations);
+	}
+
+	void read(std::istream& stream) {
+		readArray(stream, accumulated);
+		readArray(stream, sampleCounts);
+		readArray(stream, luminanceMeans);
+		readArray(stream, luminanceSquaredDeviations);
+
+		if (!stream)
+			throw std::runtime_error("Framebuffer data is cut short");
+	}
+
+private:
+	int width, height;
+
+	// Sum of samples
+	std::vector<color3> accumulated;
+	// Number of samples per pixel
+	std::vector<int> sampleCounts;
+	// Running mean of the samples' luminance, and the sum of their squared
+	// deviations from it
+	std::vector<double> luminanceMeans;
+	std::vector<double> luminanceSquaredDeviations;
+
+	size_t indexOf(int x, int y) const {
+		return static_cast<size_t>(y) * width + x;
+	}
+
+	template<typename T>
+	static void writeArray(std::ostream& stream, const std::vector<T>& array) {
+		stream.write(
+			reinterpret_cast<const char*>(array.data()), array.size() * sizeof(T)
+		);
+	}
+
+	template<typename T>
+	static void readArray(std::istream& stream, std::vector<T>& array) {
+		stream.read(reinterpret_cast<char*>(array.data()), array.size() * sizeof(T));
+	}
+};
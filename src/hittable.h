@@ -3,34 +3,199 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
 #include <memory>
 #include <optional>
+#include <stdexcept>
+#include <vector>
 
 #include "bounding_box.h"
 #include "ray.h"
+#include "ray_packet.h"
 
+class Hittable;
 class Material;
 
 struct HitRecord {
 	point3 intersection;
+	// Bound on the rounding error of intersection, per axis
+	vec3 intersectionError = vec3(0);
 	vec3 normal;
-	std::shared_ptr<Material> materialPtr;
-	double t; // parameter of ray
+	const Material* materialPtr = nullptr;
+	real t; // parameter of ray
+	// Surface coordinates of the intersection (barycentrics for triangles)
+	real u = 0.0, v = 0.0;
 	bool frontFace; // whether the normal faces in this direction (& for back-face culling)
+	// Primitive that was hit and which part of it (see HitCandidate)
+	const Hittable* hittable = nullptr;
+	uint32_t primitive = 0;
+
+	// Shadow rays from spawnRayTo() end this much (relative to their
+	// length) before the target, so they don't hit the surface it's on
+	static constexpr real SHADOW_EPSILON = real(1e-4);
 
 	// Outward normal refers to the normal that may not necessarily point out of a hittable object
 	inline void setNormalFromOutwardNormal(const Ray& ray, const vec3& outwardNormal) {
 		// the ray and the normal should be facing against each other
-		frontFace = ray.direction.dot(outwardNormal) < 0.0; 
+		frontFace = ray.direction.dot(outwardNormal) < 0; 
 		normal = frontFace ? outwardNormal : -outwardNormal;
 	}
+
+	// Ray that leaves the surface at the intersection, e.g. a bounce. It
+	// can't hit the surface it starts on, so trace it with a tMin of 0.
+	Ray spawnRay(const vec3& direction) const {
+		auto side = direction.dot(normal) < 0 ? -normal : normal;
+		return Ray(offsetRayOrigin(intersection, intersectionError, side), direction);
+	}
+
+	// Ray from the intersection to target, which it reaches at t = 1.
+	// Trace it up to 1 - SHADOW_EPSILON.
+	Ray spawnRayTo(const point3& target) const {
+		Ray ray = spawnRay(target - intersection);
+		ray.direction = target - ray.origin;
+		return ray;
+	}
+};
+
+// Primitive whose material emits light, see Hittable::collectEmitters()
+struct Emitter {
+	const Hittable* hittable;
+	uint32_t primitive;
+	const Material* material;
+	real area;
+};
+
+// Point on the surface of a primitive
+struct SurfaceSample {
+	point3 point;
+	// Unit normal, facing either way
+	vec3 normal;
+};
+
+// Closest hit found by Hittable::intersect(), with just enough data for
+// the hittable that was hit to fill in a HitRecord later (see finalize()).
+// Rays usually go through many candidates before finding the closest, so
+// the rest of the surface data is only ever computed for the winner.
+struct HitCandidate {
+	real t;
+	// Primitive that was hit, null if none
+	const Hittable* hittable = nullptr;
+	// Part of the hittable that was hit, e.g. a triangle of a mesh
+	uint32_t primitive = 0;
+	// Surface coordinates of the hit, if the intersection test gets them
+	// for free (barycentrics for triangles)
+	real u = 0, v = 0;
+};
+
+// Closest hits found so far for each lane of a ray packet
+struct PacketHits {
+	real tMax[RayPacket::MAX_SIZE];
+	HitCandidate candidates[RayPacket::MAX_SIZE];
+
+	PacketHits(real tMaxForAll) {
+		std::fill(std::begin(tMax), std::end(tMax), tMaxForAll);
+	}
 };
 
 class Hittable {
 public:
-	virtual std::optional<HitRecord> hit
-		(const Ray& ray, double tMin, double tMax) const = 0;
+	// Closest-hit query. If the ray hits this between tMin and tMax, fills
+	// in closest and returns true. Computes as little as possible; the
+	// HitRecord is made by finalize() once the closest hit of all is known.
+	virtual bool intersect(
+		const Ray& ray, real tMin, real tMax, HitCandidate& closest
+	) const = 0;
+
+	// Full surface data of a hit found by intersect() of this hittable.
+	// Hittables made of other hittables pass the candidate on to the one
+	// that was hit.
+	virtual HitRecord finalize(
+		const Ray& ray, const HitCandidate& candidate
+	) const = 0;
+
+	// Both of the above in one go
+	std::optional<HitRecord> hit(const Ray& ray, real tMin, real tMax) const {
+		HitCandidate closest;
+		if (!intersect(ray, tMin, tMax, closest))
+			return {};
+
+		return finalize(ray, closest);
+	}
+
+	// Any-hit query: whether anything blocks the ray between tMin and tMax.
+	// Can stop at the first hit it finds.
+	virtual bool occluded(const Ray& ray, real tMin, real tMax) const {
+		HitCandidate closest;
+		return intersect(ray, tMin, tMax, closest);
+	}
+
+	// Traces the lanes of a packet in laneMask. A lane's candidate is only
+	// replaced if the hit is closer than its tMax, which then shrinks.
+	// Hittables that can share work between the rays override this, the
+	// default traces them one at a time.
+	virtual void intersectPacket(
+		const RayPacket& packet,
+		uint32_t laneMask,
+		real tMin,
+		PacketHits& hits
+	) const {
+		forEachLane(laneMask, [&](int lane) {
+			auto& candidate = hits.candidates[lane];
+			if (intersect(packet.ray(lane), tMin, hits.tMax[lane], candidate))
+				hits.tMax[lane] = candidate.t;
+		});
+	}
+
+	// Any-hit queries of the lanes of a packet in laneMask, each up to its
+	// own tMax. Returns the lanes that are blocked. The default tests them
+	// one at a time.
+	virtual uint32_t occludedPacket(
+		const RayPacket& packet,
+		uint32_t laneMask,
+		real tMin,
+		const real tMax[RayPacket::MAX_SIZE]
+	) const {
+		uint32_t blocked = 0;
+		forEachLane(laneMask, [&](int lane) {
+			if (occluded(packet.ray(lane), tMin, tMax[lane]))
+				blocked |= 1u << lane;
+		});
+		return blocked;
+	}
 
 	virtual std::optional<BoundingBox> boundingBox
-		(double tStart, double tEnd) const = 0;
+		(real tStart, real tEnd) const = 0;
+
+	// Adds the primitives of this hittable whose material emits light, for
+	// light sampling
+	virtual void collectEmitters(std::vector<Emitter>& emitters) const {}
+
+	// Point on a primitive added by collectEmitters(), uniformly distributed
+	// over its area. u1 and u2 are uniform random numbers in [0, 1).
+	virtual SurfaceSample samplePrimitive(
+		uint32_t primitive, real u1, real u2
+	) const {
+		throw std::logic_error("Hittable has no primitives to sample");
+	}
+
+	// Point on a primitive added by collectEmitters(), for lighting the
+	// point reference. It only has to cover the part of the primitive that
+	// reference can see, e.g. the near side of a sphere. density gets the
+	// density of the point relative to samplePrimitive(), which this
+	// defaults to (density 1).
+	virtual SurfaceSample samplePrimitiveFrom(
+		uint32_t primitive, const point3& reference, real u1, real u2, real& density
+	) const {
+		density = 1;
+		return samplePrimitive(primitive, u1, u2);
+	}
+
+	// density that samplePrimitiveFrom() gives point
+	virtual real primitiveDensityFrom(
+		uint32_t primitive, const point3& reference, const point3& point
+	) const {
+		return 1;
+	}
 };
\ No newline at end of file
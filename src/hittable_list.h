@@ -5,12 +5,18 @@
 #include <ranges>
 #include <vector>
 
+#include "animation.h"
 #include "hittable.h"
+#include "material.h"
 
 
 class HittableList : public Hittable {
 public:
 	std::vector<std::shared_ptr<Hittable>> hittables;
+	// Materials of the hittables above, when the list is a whole scene
+	MaterialTable materials;
+	// Moving parts of the hittables above, when the list is a whole scene
+	Animation animation;
 
 	HittableList() {}
 	HittableList(std::initializer_list<std::shared_ptr<Hittable>> hittables) { 
@@ -34,36 +40,55 @@ public:
 		hittables.clear();
 	}
 
-	virtual std::optional<HitRecord> hit
-		(const Ray& ray, double tMin, double tMax) const override;
+	virtual bool intersect(
+		const Ray& ray, real tMin, real tMax, HitCandidate& closest
+	) const override;
+
+	virtual HitRecord finalize(
+		const Ray& ray, const HitCandidate& candidate
+	) const override {
+		return candidate.hittable->finalize(ray, candidate);
+	}
+
+	virtual bool occluded(
+		const Ray& ray, real tMin, real tMax
+	) const override {
+		for (const auto& hittable : hittables)
+			if (hittable->occluded(ray, tMin, tMax))
+				return true;
+
+		return false;
+	}
 
 	virtual std::optional<BoundingBox> boundingBox
-		(double tStart, double tEnd) const override;
+		(real tStart, real tEnd) const override;
+
+	virtual void collectEmitters(std::vector<Emitter>& emitters) const override {
+		for (const auto& hittable : hittables)
+			hittable->collectEmitters(emitters);
+	}
 };
 
-std::optional<HitRecord> HittableList::hit(const Ray& ray, double tMin, double tMax) const {
+bool HittableList::intersect(
+	const Ray& ray, real tMin, real tMax, HitCandidate& closest
+) const {
 	// minimum parametric value t corresponds to the closest hittable
 	// (disregarding those behind the ray)
-	double minT = tMax;
-	std::optional<HitRecord> closestHit = {};
+	bool hitAnything = false;
 
 	for (const auto& hittable : hittables) {
-		auto hit = hittable->hit(ray, tMin, tMax);
-		if (!hit)
+		if (!hittable->intersect(ray, tMin, tMax, closest))
 			continue;
 
-		auto record = hit.value();
-		if (!closestHit || minT > record.t) {
-			minT = record.t;
-			closestHit = std::optional<HitRecord>(hit);
-		}
+		hitAnything = true;
+		tMax = closest.t;
 	}
 
-	return closestHit;
+	return hitAnything;
 }
 
 std::optional<BoundingBox> HittableList::boundingBox(
-	double tStart, double tEnd
+	real tStart, real tEnd
 ) const {
 	if (hittables.empty())
 		return {};
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Finished image in linear RGB, as 32-bit floats whatever the precision of
+// the renderer. Row 0 is the top of the image.
+struct Image {
+	int width = 0, height = 0;
+	// width * height * 3 values, r, g and b of each pixel in turn
+	std::vector<float> pixels;
+
+	Image() {}
+	Image(int width, int height) :
+		width(width), height(height), pixels(size_t(width) * height * 3, 0.0f) {}
+
+	float* row(int y) { return pixels.data() + size_t(y) * width * 3; }
+	const float* row(int y) const { return pixels.data() + size_t(y) * width * 3; }
+};
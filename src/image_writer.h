@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#include "image.h"
+
+// Saves images in some file format
+class ImageWriter {
+public:
+	virtual ~ImageWriter() {}
+
+	virtual void write(std::ostream& stream, const Image& image) const = 0;
+
+	void save(const std::string& path, const Image& image) const {
+		std::ofstream file(path, std::ios::binary);
+		if (!file.is_open())
+			throw std::runtime_error("Can't open " + path);
+
+		write(file, image);
+		file.close();
+
+		if (!file)
+			throw std::runtime_error("Error writing " + path);
+	}
+};
+
+// Linear values to gamma corrected (gamma 2) 8-bit values, clamping to
+// [0, 1]. NaNs come out black.
+inline void toDisplayBytes(const float* values, uint8_t* bytes, size_t count) {
+	size_t i = 0;
+
+#if defined(__SSE2__) || defined(_M_X64)
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 scale = _mm_set1_ps(255.999f);
+
+	auto convert = [&](const float* at) {
+		// max() returns its second operand for NaNs
+		__m128 value = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(at), zero), one);
+		return _mm_cvttps_epi32(_mm_mul_ps(_mm_sqrt_ps(value), scale));
+	};
+
+	for (; i + 16 <= count; i += 16) {
+		__m128i low = _mm_packs_epi32(convert(values + i), convert(values + i + 4));
+		__m128i high = _mm_packs_epi32(convert(values + i + 8), convert(values + i + 12));
+		_mm_storeu_si128(
+			reinterpret_cast<__m128i*>(bytes + i), _mm_packus_epi16(low, high)
+		);
+	}
+#endif
+
+	for (; i < count; i++) {
+		float value = values[i] > 0 ? std::min(values[i], 1.0f) : 0.0f;
+		bytes[i] = static_cast<uint8_t>(255.999f * std::sqrt(value));
+	}
+}
+
+// Binary PPM (P6), gamma corrected and clamped to 8 bits per channel
+class PpmWriter : public ImageWriter {
+public:
+	virtual void write(std::ostream& stream, const Image& image) const override {
+		std::vector<uint8_t> bytes(image.pixels.size());
+		toDisplayBytes(image.pixels.data(), bytes.data(), bytes.size());
+
+		stream << "P6\n" << image.width << ' ' << image.height << "\n255\n";
+		stream.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+	}
+};
+
+// Portable float map, the linear values as they are for compositing.
+// Rows go from the bottom up, and a negative scale marks little endian
+// floats.
+class PfmWriter : public ImageWriter {
+public:
+	virtual void write(std::ostream& stream, const Image& image) const override {
+		static_assert(sizeof(float) == 4);
+
+		const bool isLittleEndian = std::endian::native == std::endian::little;
+		stream << "PF\n" << image.width << ' ' << image.height << '\n'
+		       << (isLittleEndian ? "-1.0" : "1.0") << '\n';
+
+		std::vector<float> flipped(image.pixels.size());
+		size_t rowSize = size_t(image.width) * 3;
+		for (int y = 0; y < image.height; y++) {
+			const float* row = image.row(image.height - 1 - y);
+			std::copy(row, row + rowSize, flipped.data() + y * rowSize);
+		}
+
+		stream.write(
+			reinterpret_cast<const char*>(flipped.data()), flipped.size() * sizeof(float)
+		);
+	}
+};
+
+// Writer of a format by name: ppm or pfm
+std::unique_ptr<ImageWriter> makeImageWriterForFormat(std::string format) {
+	std::transform(format.begin(), format.end(), format.begin(),
+		[](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+
+	if (format == "ppm")
+		return std::make_unique<PpmWriter>();
+	if (format == "pfm")
+		return std::make_unique<PfmWriter>();
+
+	throw std::invalid_argument("Unknown image format " + format + ", use ppm or pfm");
+}
+
+// Picks the writer from the extension of path: .ppm or .pfm
+std::unique_ptr<ImageWriter> makeImageWriter(const std::string& path) {
+	std::string extension = std::filesystem::path(path).extension().string();
+	if (extension.empty())
+		throw std::invalid_argument("No image format in " + path + ", use .ppm or .pfm");
+
+	return makeImageWriterForFormat(extension.substr(1));
+}
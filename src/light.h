@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "color.h"
+#include "hittable.h"
+#include "material.h"
+#include "sampler.h"
+#include "vec3.h"
+
+// Point picked on a light by LightList::sample()
+struct LightSample {
+	point3 point;
+	vec3 normal;
+	color3 emitted;
+	// Density of picking point, per unit area of all lights together
+	real pdfArea;
+};
+
+// The emissive primitives of a scene, for sampling lights directly
+// (next event estimation).
+//
+// Lights are picked in proportion to the power they give off, so big
+// bright lights get most of the samples.
+class LightList {
+public:
+	LightList(const Hittable& scene) {
+		scene.collectEmitters(emitters);
+
+		double totalPower = 0;
+		cdf.reserve(emitters.size());
+		for (size_t i = 0; i < emitters.size(); i++) {
+			const auto& emitter = emitters[i];
+			totalPower += emitter.area * luminance(emitter.material->emit());
+			cdf.push_back(totalPower);
+
+			indices[Key{ emitter.hittable, emitter.primitive }] = i;
+		}
+
+		for (auto& value : cdf)
+			value /= totalPower;
+	}
+
+	bool empty() const { return emitters.empty(); }
+	size_t size() const { return emitters.size(); }
+
+	// Point on a light, for lighting the point reference
+	LightSample sample(const point3& reference, Sampler& sampler) const {
+		// Fine to pick past the end from rounding, the last light gets it
+		auto picked = std::upper_bound(cdf.begin(), cdf.end(), sampler.get1D());
+		size_t index = std::min<size_t>(picked - cdf.begin(), emitters.size() - 1);
+		const auto& emitter = emitters[index];
+
+		auto [u, v] = sampler.get2D();
+		real density;
+		auto surface = emitter.hittable->samplePrimitiveFrom(
+			emitter.primitive, reference, u, v, density
+		);
+
+		return LightSample{
+			surface.point,
+			surface.normal,
+			emitter.material->emit(),
+			static_cast<real>(selectionProbability(index) / emitter.area) * density
+		};
+	}
+
+	// Same density as sample() from reference uses, for point on the given
+	// primitive. 0 if the primitive isn't a light.
+	real pdfArea(
+		const Hittable* hittable, uint32_t primitive,
+		const point3& reference, const point3& point
+	) const {
+		auto found = indices.find(Key{ hittable, primitive });
+		if (found == indices.end())
+			return 0;
+
+		size_t index = found->second;
+		return static_cast<real>(selectionProbability(index) / emitters[index].area)
+			* hittable->primitiveDensityFrom(primitive, reference, point);
+	}
+
+private:
+	struct Key {
+		const Hittable* hittable;
+		uint32_t primitive;
+
+		bool operator==(const Key& other) const = default;
+	};
+
+	struct KeyHash {
+		size_t operator()(const Key& key) const {
+			return std::hash<const Hittable*>()(key.hittable)
+				^ (std::hash<uint32_t>()(key.primitive) * 0x9e3779b97f4a7c15ull);
+		}
+	};
+
+	std::vector<Emitter> emitters;
+	// Running sum of the lights' share of the total power
+	std::vector<double> cdf;
+	std::unordered_map<Key, size_t, KeyHash> indices;
+
+	double selectionProbability(size_t index) const {
+		return index == 0 ? cdf[0] : cdf[index] - cdf[index - 1];
+	}
+};
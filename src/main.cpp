@@ -1,247 +1,401 @@
 ﻿// main.cpp : Defines the entry point for the application.
 //
 
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <memory>
-#include <minmax.h>
 #include <numbers>
 #include <numeric>
 #include <optional>
 #include <stdio.h>
+#include <string>
 #include <thread>
 
 #include "main.h"
 
 #include "bounding_volume_hierarchy.h"
 #include "camera.h"
+#include "checkpoint.h"
+#include "cli.h"
 #include "color.h"
+#include "framebuffer.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "image_writer.h"
+#include "light.h"
 #include "material.h"
 #include "ray.h"
+#include "ray_packet.h"
+#include "render_config.h"
+#include "renderer.h"
 #include "scene.h"
+#include "scene_cache.h"
+#include "scene_file.h"
 #include "sphere.h"
+#include "stats.h"
+#include "tile_scheduler.h"
+#include "trace.h"
 #include "vec3.h"
+#include "wide_bounding_volume_hierarchy.h"
 
+int main(int argc, char** argv) {
 
-color3 rayColor(
-	const Hittable& world, 
-	const color3& background,
-	const Ray& ray, 
-	const int maxBounces, 
-	RandomNumberGenerator& rng
-) {
-	constexpr double INFTY = std::numeric_limits<double>::infinity();
-	constexpr double absorption = 0.5;
+	// Arguments
 
-	if (maxBounces <= 0)
-		return color3(0);
+	Options options;
+	try {
+		options = parseArguments(argc, argv);
+	}
+	catch (const std::invalid_argument& error) {
+		printf("%.200s\n\n", error.what());
+		printUsage();
+		return 1;
+	}
 
-	// 0.001 comes from "8.4 Fixing Shadow Acne"
-	auto hit = world.hit(ray, 0.001, INFTY);
-	if (!hit)
-		return background;
+	// File
+	std::unique_ptr<ImageWriter> imageWriter, heatmapWriter;
+	try {
+		imageWriter = options.format.empty()
+			? makeImageWriter(options.files[0])
+			: makeImageWriterForFormat(options.format);
+		if (options.files.size() == 2)
+			heatmapWriter = makeImageWriter(options.files[1]);
+	}
+	catch (const std::invalid_argument& error) {
+		printf("%.200s\n", error.what());
+		return 1;
+	}
 
-	auto record = hit.value();
-	auto scattered = record.materialPtr->scatter(ray, record, rng);
-	color3 emitted = record.materialPtr->emit();
+	// Animations render frames firstFrame to lastFrame, a still frame 0
+	const int firstFrame = options.frames ? options.frames->first : 0;
+	const int lastFrame = options.frames ? options.frames->second : 0;
 
-	if (!scattered)
-		return emitted;
+	auto outputPath = [&](size_t file, int frame) {
+		return options.frames ? framePath(options.files[file], frame) : options.files[file];
+	};
 
-	auto scatterResult = scattered.value();
-	return emitted + 
-		scatterResult.attenuation
-		* rayColor(world, background, scatterResult.outRay, maxBounces - 1, rng);
-}
+	// Opened now to find out early if it can't be, later frames are opened
+	// when saved
+	std::ofstream imageFile(outputPath(0, firstFrame), std::ios::binary);
+	if (!imageFile.is_open()) {
+		// Check this line for vulnerabilities vvv
+		printf("Error opening file %.200s\n", outputPath(0, firstFrame).c_str());
+		return 1;
+	}
 
-void render(
-	const int width,
-	const int height,
-	const int sampleCount,
-	const int seed,
-	const int maxBounces,
-	const Hittable& world,
-	const Camera& camera,
-	std::vector<color3>& image,
-	int& scanlinesDone
-) {
-	RandomNumberGenerator rng(seed);
-	scanlinesDone = 0;
-
-	// Origin is at the bottom left corner
-	for (int j = 0; j < height; j++) {
-
-		for (int i = 0; i < width; i++) {
-
-			color3 pixel(0, 0, 0);
-			for (int s = 0; s < sampleCount; s++) {
-				auto column = i;
-				auto row = height - j - 1;
-				auto u = double(column + rng.randomDouble()) / (width - 1);
-				auto v = double(row + rng.randomDouble()) / (height - 1);
-
-				Ray ray = camera.rayFromUV(u, v, rng);
-				pixel += rayColor(world, color3(0.5, 0.5, 0.8), ray, maxBounces, rng);
-			}
-			image[j * width + i] = pixel / sampleCount;
-		}
+	// Image
 
-		scanlinesDone++;
-	}
-}
+	const int imageWidth = options.width;
+	const int imageHeight = options.height;
+	const double aspectRatio = double(imageWidth) / imageHeight;
 
+	RenderState state;
+	state.sampling.minSamples = options.minSamples;
+	state.sampling.maxSamples = options.maxSamples;
+	state.sampling.errorThreshold = options.errorThreshold;
+	state.sampling.sampler = options.sampler;
+	const uint64_t baseSeed = options.seed.value_or(std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()
+	).count());
+	state.seed = baseSeed;
 
-int main(int argc, char** argv) {
+	Framebuffer framebuffer(imageWidth, imageHeight);
+
+	if (!options.resumePath.empty()) {
+		try {
+			framebuffer = loadCheckpoint(options.resumePath, state);
+		}
+		catch (const std::exception& error) {
+			printf("Error resuming: %.200s\n", error.what());
+			return 1;
+		}
+
+		if (framebuffer.getWidth() != imageWidth || framebuffer.getHeight() != imageHeight) {
+			printf(
+				"Error resuming: the checkpoint is of a %dx%d image, not %dx%d\n",
+				framebuffer.getWidth(), framebuffer.getHeight(), imageWidth, imageHeight
+			);
+			return 1;
+		}
 
-	if (argc != 2) {
+		state.sampling.maxSamples += options.topUpSamples;
 		printf(
-			"Please specify an output file.\n"
-			"For example,\n"
-			"	WeekendRaytracing.exe output.ppm\n"
+			"Resuming after %d pass(es), up to %d samples per pixel\n",
+			state.passesDone, state.sampling.maxSamples
 		);
-		return 1;
 	}
 
-	// File
-	std::ofstream imageFile(argv[1]);
-	if (!imageFile.is_open()) {
-		// Check this line for vulnerabilities vvv
-		printf("Error opening file %.200s\n", argv[1]);
+	// How often to save a checkpoint, between passes
+	const auto checkpointInterval = std::chrono::seconds(60);
+
+	PathConfig pathConfig;
+	pathConfig.maxBounces = options.maxBounces;
+	pathConfig.russianRouletteStart = 3;
+
+#ifdef NDEBUG
+	int threadCount = std::max<int>(std::thread::hardware_concurrency(), 1);
+#else
+	int threadCount = 1;
+#endif
+	if (options.threads > 0)
+		threadCount = options.threads;
+
+	RenderStatistics statistics(threadCount);
+
+	if (!options.tracePath.empty()) {
+		globalTracer.start();
+		globalTracer.attachThread(0, "main");
+	}
+
+	// World
+
+	std::optional<PhaseTimer> phase(std::in_place, statistics, "scene");
+	std::unique_ptr<Scene> masterScene;
+	try {
+		masterScene = loadScene(options.scene);
+	}
+	catch (const std::exception& error) {
+		printf("Error loading scene: %.200s\n", error.what());
 		return 1;
 	}
 
-	// Image
+	// Scene files can be cached once built
+	auto sceneFile = dynamic_cast<SceneFile*>(masterScene.get());
+	std::string cachePath;
+	uint64_t cacheKey = 0;
+	if (sceneFile && !options.cacheDirectory.empty()) {
+		// The cache holds the scene at one time only
+		if (sceneFile->isAnimated()) {
+			printf("Animated scenes aren't cached\n");
+		}
+		else {
+			cacheKey = sceneCacheKey(*sceneFile);
+			cachePath = sceneCachePath(options.cacheDirectory, cacheKey);
+		}
+	}
 
-	const double aspectRatio = 1.0;
-	const int imageWidth = 400;
-	const int imageHeight = static_cast<int>(imageWidth / aspectRatio);
-	const int sampleCount = 100;
-	const int maxBounces = 50;
+	// Owns the materials, whether the scene is built or loaded
+	HittableList worldHittables;
+	std::optional<SceneBvh> world;
 
-	// World
-	CornellBoxScene masterScene;
+	if (!cachePath.empty()) {
+		phase.emplace(statistics, "cache");
+		try {
+			world = loadSceneCache(cachePath, cacheKey, worldHittables.materials);
+			if (world)
+				printf("Scene loaded from %.200s\n", cachePath.c_str());
+		}
+		catch (const std::exception& error) {
+			printf("Ignoring the scene cache: %.200s\n", error.what());
+		}
+	}
 
-	//HittableList world = masterScene.build();
+	if (!world) {
+		phase.emplace(statistics, "scene");
+		try {
+			// Scene files load their meshes on the render threads
+			worldHittables = sceneFile ? sceneFile->build(threadCount) : masterScene->build();
+		}
+		catch (const std::exception& error) {
+			printf("Error loading scene: %.200s\n", error.what());
+			return 1;
+		}
+
+		worldHittables.animation.setTime(firstFrame);
+
+		phase.emplace(statistics, "bvh");
+		world.emplace(worldHittables, firstFrame, firstFrame);
+		printf("BVH Built.");
+
+		if (!cachePath.empty()) {
+			phase.emplace(statistics, "cache");
+			try {
+				saveSceneCache(cachePath, cacheKey, *world);
+				printf(" Saved to %.200s\n", cachePath.c_str());
+			}
+			catch (const std::exception& error) {
+				printf(" Not cached: %.200s\n", error.what());
+			}
+		}
+	}
 
-	HittableList worldHittables = masterScene.build();
-	BoundingVolumeHierarchyNode world(worldHittables, 0.0, 0.0);
-	printf("BVH Built.");
+	phase.emplace(statistics, "lights");
+	// Emitters are the hittables themselves, which stay the same from
+	// frame to frame however the BVH changes
+	LightList lights(*world);
+	phase.reset();
 
 	// Camera
-	Camera mainCamera = masterScene.makeCamera(aspectRatio);
+	Camera mainCamera = masterScene->makeCamera(aspectRatio);
+
+	// Refitting keeps the tree of the last build, which gets worse as
+	// things move away from where they were. Past this much of the cost it
+	// had when built, the BVH is built again.
+	const double rebuildCostRatio = 1.2;
+	double builtCost = world->sahCost();
+
+	for (int frame = firstFrame; frame <= lastFrame; frame++) {
+		if (options.frames) {
+			printf("\nFrame %d\n", frame);
+			state.seed = baseSeed + frame;
+		}
 
-	// Render
-#ifdef NDEBUG
-	const unsigned int threadCount = std::max<unsigned int>(std::thread::hardware_concurrency(), 1);
-#else
-	const unsigned int threadCount = 1u;
-#endif
+		if (frame != firstFrame) {
+			state.passesDone = 0;
+			framebuffer = Framebuffer(imageWidth, imageHeight);
+
+			if (!worldHittables.animation.empty()) {
+				phase.emplace(statistics, "refit");
+				worldHittables.animation.setTime(frame);
+				world->refit(frame, frame);
+
+				double cost = world->sahCost();
+				if (cost > rebuildCostRatio * builtCost) {
+					phase.emplace(statistics, "bvh");
+					world.emplace(worldHittables, frame, frame);
+					printf("BVH rebuilt, refit cost %.2f against %.2f when built\n", cost, builtCost);
+					builtCost = world->sahCost();
+				}
+				phase.reset();
+			}
+		}
 
-	std::vector<std::thread> threads;
-	std::vector<int> scanlinesDoneByThread(threadCount, 0);
-	std::vector<std::vector<color3>> imagesByThread;
-	threads.reserve(threadCount);
-	imagesByThread.reserve(threadCount);
+		// Render
 
-	auto seed = std::chrono::duration_cast<std::chrono::milliseconds>(
-		std::chrono::system_clock::now().time_since_epoch()
-	).count();
-
-	// To make sure all samples are rendered although threadCount doesn't 
-	// divide sampleCount.
-	int samplesLeftToAllocate = sampleCount;
-
-	for (int i = 0; i < threadCount; i++) {
-		int threadSampleCount = samplesLeftToAllocate / (threadCount - i);
-		samplesLeftToAllocate -= threadSampleCount;
-		
-		imagesByThread.push_back(
-			std::vector<color3>(imageWidth * imageHeight, color3(0))
-		);
-		threads.push_back(
-			std::thread(
-				render,
-				// args
+		auto lastCheckpoint = std::chrono::steady_clock::now();
+
+		// Passes go on until one finds every pixel finished
+		while (true) {
+			phase.emplace(statistics, "render");
+			auto samplesTaken = renderPass(
+				threadCount,
 				imageWidth,
 				imageHeight,
-				threadSampleCount,
-				seed + i,
-				maxBounces,
-				std::ref(world),
-				std::ref(mainCamera),
-				std::ref(imagesByThread[i]),
-				std::ref(scanlinesDoneByThread[i])
-			)
-		);
-		
-		seed++;
-	}
+				state,
+				pathConfig,
+				*world,
+				lights,
+				mainCamera,
+				framebuffer,
+				statistics,
+				[&](int tilesDone, int tileCount) {
+					printf(
+						"\rRendering on %d thread(s), pass %d: %5d/%5d tiles done (%.2f%%)",
+						threadCount,
+						state.passesDone + 1,
+						tilesDone,
+						tileCount,
+						100.0 * tilesDone / tileCount
+					);
+					fflush(stdout);
+				}
+			);
+
+			phase.reset();
+
+			if (samplesTaken == 0)
+				break;
+
+			state.passesDone++;
+
+			auto now = std::chrono::steady_clock::now();
+			if (!options.checkpointPath.empty() && now - lastCheckpoint >= checkpointInterval) {
+				PhaseTimer checkpointPhase(statistics, "checkpoint");
+				saveCheckpoint(options.checkpointPath, framebuffer, state);
+				lastCheckpoint = now;
+			}
+		}
+		printf("\nRendering done after %d pass(es)\n", state.passesDone);
 
-	// Progress Reporting
-
-	while (
-		std::none_of(
-			scanlinesDoneByThread.begin(),
-			scanlinesDoneByThread.end(),
-			[=](int scanlinesDone) { return scanlinesDone >= imageHeight; }
-		)
-	) {
-		int totalScanlinesDone = std::accumulate(
-			scanlinesDoneByThread.begin(),
-			scanlinesDoneByThread.end(),
-			0 // initial value
-		);
+		if (!options.checkpointPath.empty()) {
+			// The finished render too, to top it up later
+			PhaseTimer checkpointPhase(statistics, "checkpoint");
+			saveCheckpoint(options.checkpointPath, framebuffer, state);
+		}
 
-		int weightedScanlinesDone = totalScanlinesDone / threadCount;
-		double progress = 100.0 * totalScanlinesDone / (imageHeight * threadCount);
+		long long totalSamples = 0;
+		for (int j = 0; j < imageHeight; j++)
+			for (int i = 0; i < imageWidth; i++)
+				totalSamples += framebuffer.sampleCount(i, j);
 
 		printf(
-			"\rRendering on %d thread(s): %5d/%5d scanlines done (%.2f%%)",
-			threadCount,
-			weightedScanlinesDone,
-			imageHeight,
-			progress
+			"Samples per pixel: %.2f on average\n",
+			double(totalSamples) / (imageWidth * imageHeight)
 		);
-		fflush(stdin);
 
-		// Wait for 1000ms
-		std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-	}
-	printf(
-		"\rRendering on %d thread(s): %5d/%5d scanlines done (100.00%%)\n",
-		threadCount,
-		imageHeight,
-		imageHeight
-	);
+		// Saving
 
-	// Join threads
+		printf("Saving...\n");
 
-	for (auto& thread : threads) {
-		thread.join();
-	}
+		phase.emplace(statistics, "save");
+		Image image = [&]() {
+			TraceScope scope("resolve");
+			return framebuffer.resolveAll();
+		}();
 
-	// Saving
+		if (!imageFile.is_open()) {
+			imageFile.open(outputPath(0, frame), std::ios::binary);
+			if (!imageFile.is_open()) {
+				printf("Error opening file %.200s\n", outputPath(0, frame).c_str());
+				return 1;
+			}
+		}
 
-	printf("Saving...\n");
+		// Closing flushes, so a full disk shows up here too
+		imageWriter->write(imageFile, image);
+		imageFile.close();
+		if (!imageFile) {
+			printf("Error writing file %.200s\n", outputPath(0, frame).c_str());
+			return 1;
+		}
 
-	imageFile << "P3\n" << imageWidth << ' ' << imageHeight << "\n255\n";
+		if (heatmapWriter) {
+			Image heatmap(imageWidth, imageHeight);
+			for (int j = 0; j < imageHeight; j++) {
+				for (int i = 0; i < imageWidth; i++) {
+					real samples = framebuffer.sampleCount(i, j);
+					// Squared, the writer gamma corrects it
+					auto color = heatmapColor(samples / state.sampling.maxSamples);
+					for (int channel = 0; channel < 3; channel++)
+						heatmap.row(j)[3 * i + channel] = float(color[channel] * color[channel]);
+				}
+			}
 
-	for (int j = 0; j < imageHeight; j++) {
-		for (int i = 0; i < imageWidth; i++) {
-			color3 pixel;
-			for (auto& threadImage : imagesByThread) {
-				pixel += threadImage.at(j * imageWidth + i);
+			try {
+				heatmapWriter->save(outputPath(1, frame), heatmap);
+			}
+			catch (const std::runtime_error& error) {
+				printf("%.200s\n", error.what());
+				return 1;
 			}
-			pixel /= threadCount;
+		}
+		phase.reset();
+	}
 
-			writePixel(imageFile, gammaCorrect(pixel));
+	statistics.printSummary(stdout);
+
+	if (!options.statsPath.empty()) {
+		std::ofstream statsFile(options.statsPath);
+		if (!statsFile.is_open()) {
+			printf("Error opening file %.200s\n", options.statsPath.c_str());
+			return 1;
 		}
+		statistics.writeJson(statsFile);
+		statsFile << '\n';
 	}
 
-	printf("Done.\n");
+	if (!options.tracePath.empty()) {
+		std::ofstream traceFile(options.tracePath);
+		if (!traceFile.is_open()) {
+			printf("Error opening file %.200s\n", options.tracePath.c_str());
+			return 1;
+		}
+		globalTracer.write(traceFile);
+	}
 
-	imageFile.close();
+	printf("Done.\n");
 	return 0;
 }
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Whole file mapped into memory, read only. Pages are read in as they're
+// touched and can be dropped again under memory pressure, so even huge
+// files don't need their size in free memory.
+class MappedFile {
+public:
+	explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+		file = CreateFileA(
+			path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr
+		);
+		if (file == INVALID_HANDLE_VALUE)
+			throw std::runtime_error("Can't open " + path);
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize)) {
+			close();
+			throw std::runtime_error("Error reading " + path);
+		}
+		length = static_cast<size_t>(fileSize.QuadPart);
+		if (length == 0)
+			return;
+
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping)
+			bytes = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+		file = open(path.c_str(), O_RDONLY);
+		if (file < 0)
+			throw std::runtime_error("Can't open " + path);
+
+		struct stat status;
+		if (fstat(file, &status) != 0) {
+			close();
+			throw std::runtime_error("Error reading " + path);
+		}
+		length = static_cast<size_t>(status.st_size);
+		if (length == 0)
+			return;
+
+		void* address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, file, 0);
+		if (address != MAP_FAILED) {
+			bytes = static_cast<const char*>(address);
+			// Files are mapped to be read whole, often from several threads
+			madvise(address, length, MADV_WILLNEED);
+		}
+#endif
+		if (!bytes) {
+			close();
+			throw std::runtime_error("Can't map " + path + " into memory");
+		}
+	}
+
+	~MappedFile() {
+		close();
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const char* data() const { return bytes; }
+	size_t size() const { return length; }
+
+private:
+	const char* bytes = nullptr;
+	size_t length = 0;
+
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+
+	void close() {
+		if (bytes)
+			UnmapViewOfFile(bytes);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		bytes = nullptr;
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+	}
+#else
+	int file = -1;
+
+	void close() {
+		if (bytes)
+			munmap(const_cast<char*>(bytes), length);
+		if (file >= 0)
+			::close(file);
+		bytes = nullptr;
+		file = -1;
+	}
+#endif
+};
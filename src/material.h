@@ -1,31 +1,63 @@
 #pragma once
 
 #include <cmath>
+#include <memory>
+#include <numbers>
 #include <optional>
+#include <utility>
+#include <vector>
 
 #include "hittable.h"
 #include "ray.h"
-#include "rng.h"
+#include "sampler.h"
 #include "vec3.h"
 
 struct ScatterResult {
 	Ray outRay;
+	// BSDF * cosine / pdf, what the path's throughput gets multiplied by
 	color3 attenuation;
+	// Specular bounces (mirrors, glass) only go in one direction, so light
+	// sampling can't find them and evaluate() and pdf() don't apply
+	bool isSpecular = true;
+	// Solid angle density of outRay's direction, non-specular bounces only
+	real pdf = 0;
 };
 
 struct HitRecord;
 
 class Material {
 public:
+	virtual ~Material() {}
+
 	virtual std::optional<ScatterResult> scatter(
 		const Ray& rayIn, 
 		const HitRecord& record,
-		RandomNumberGenerator& rng
+		Sampler& sampler
 	) const = 0;
 
-	virtual color3 emit() {
+	virtual color3 emit() const {
 		return color3(0); // black default
 	}
+
+	// BSDF times the cosine of the outgoing direction, for light coming in
+	// from outDirection and leaving along -inDirection, i.e. back the way
+	// rayIn came. Black for specular materials.
+	virtual color3 evaluate(
+		const HitRecord& record,
+		const vec3& inDirection,
+		const vec3& outDirection
+	) const {
+		return color3(0);
+	}
+
+	// Solid angle density of scatter() picking outDirection
+	virtual real pdf(
+		const HitRecord& record,
+		const vec3& inDirection,
+		const vec3& outDirection
+	) const {
+		return 0;
+	}
 };
 
 class LambertianDiffuse : public Material {
@@ -37,9 +69,10 @@ public:
 	virtual std::optional<ScatterResult> scatter(
 		const Ray& rayIn, 
 		const HitRecord& record,
-		RandomNumberGenerator& rng
+		Sampler& sampler
 	) const override {
-		auto scatterDirection = record.normal + vec3::randomOnUnitSphere(rng);
+		auto [u, v] = sampler.get2D();
+		auto scatterDirection = record.normal + vec3::onUnitSphere(u, v);
 
 		// In case the random vector is almost equal to the opposite of the normal,
 		// scatterDirection can become a zero vector, which is invalid
@@ -47,35 +80,56 @@ public:
 			scatterDirection = record.normal;
 
 		ScatterResult result = {
-			/* outRay */      Ray(record.intersection, scatterDirection),
-			/* attenuation */ albedo
+			/* outRay */      record.spawnRay(scatterDirection),
+			/* attenuation */ albedo,
+			/* isSpecular */  false,
+			/* pdf */         pdf(record, rayIn.direction, scatterDirection)
 		};
 		return std::optional(result);
 	}
+
+	virtual color3 evaluate(
+		const HitRecord& record,
+		const vec3& inDirection,
+		const vec3& outDirection
+	) const override {
+		return albedo * pdf(record, inDirection, outDirection);
+	}
+
+	// Directions are cosine distributed (normal + point on the unit sphere)
+	virtual real pdf(
+		const HitRecord& record,
+		const vec3& inDirection,
+		const vec3& outDirection
+	) const override {
+		auto cosTheta = record.normal.dot(outDirection.unit());
+		return std::max<real>(cosTheta, 0) * std::numbers::inv_pi_v<real>;
+	}
 };
 
 class Metal : public Material {
 public:
 	color3 albedo;
-	double fuzz;
+	real fuzz;
 
-	Metal(const color3& albedo, double fuzz)
-		: albedo(albedo), fuzz(std::clamp(fuzz, 0.0, 1.0)) {}
+	Metal(const color3& albedo, real fuzz)
+		: albedo(albedo), fuzz(std::clamp<real>(fuzz, 0, 1)) {}
 
 	virtual std::optional<ScatterResult> scatter(
 		const Ray& rayIn, 
 		const HitRecord& record,
-		RandomNumberGenerator& rng
+		Sampler& sampler
 	) const override {
 		auto inUnitDirection = rayIn.direction.unit();
 		vec3 reflected = inUnitDirection.reflect(record.normal);
 
 		// If ray is coming from inside somehow
-		if (reflected.dot(record.normal) <= 0.0)
+		if (reflected.dot(record.normal) <= 0)
 			return {};
 
-		auto outDirection = reflected + fuzz * vec3::randomInUnitSphere(rng);
-		auto outRay = Ray(record.intersection, outDirection);
+		auto [u, v] = sampler.get2D();
+		auto outDirection = reflected + fuzz * vec3::inUnitSphere(u, v, sampler.get1D());
+		auto outRay = record.spawnRay(outDirection);
 
 		ScatterResult result = {
 			/* outRay */      outRay,
@@ -88,43 +142,43 @@ public:
 // Material that always refracts light
 class Dielectric : public Material {
 public:
-	double ior;
+	real ior;
 
-	Dielectric(double indexOfRefraction) : ior(indexOfRefraction) {}
+	Dielectric(real indexOfRefraction) : ior(indexOfRefraction) {}
 
 	virtual std::optional<ScatterResult> scatter(
 		const Ray& rayIn, 
 		const HitRecord& record, 
-		RandomNumberGenerator& rng
+		Sampler& sampler
 	) const override {
 		// Assumes air has an IOR of 1.000
-		double iorRatio = record.frontFace ? (1.0 / ior) : ior;
+		real iorRatio = record.frontFace ? (1 / ior) : ior;
 		auto inUnitDirection = rayIn.direction.unit();
-		double cosTheta = std::min<double>(-inUnitDirection.dot(record.normal), 1.0);
-		double sinTheta = std::sqrt(1.0 - cosTheta * cosTheta);
+		real cosTheta = std::min<real>(-inUnitDirection.dot(record.normal), 1);
+		real sinTheta = std::sqrt(1 - cosTheta * cosTheta);
 		
-		bool cantRefract = iorRatio * sinTheta > 1.0;
+		bool cantRefract = iorRatio * sinTheta > 1;
 		vec3 outDirection;
 
 		// Check for total internal reflection
-		if (cantRefract || reflectance(cosTheta, iorRatio) > rng.randomDouble())
+		if (cantRefract || reflectance(cosTheta, iorRatio) > sampler.get1D())
 			outDirection = inUnitDirection.reflect(record.normal);
 		else
 			outDirection = inUnitDirection.refract(record.normal, iorRatio);
 
 		ScatterResult result = {
-			/* outRay */      Ray(record.intersection, outDirection),
+			/* outRay */      record.spawnRay(outDirection),
 			/* attenuation */ color3(1.0) // Always white
 		};
 		return std::optional(result);
 	}
 
 private:
-	static double reflectance(double cosTheta, double iorRatio) {
+	static real reflectance(real cosTheta, real iorRatio) {
 		// Schlick's approximation for fresnel reflectance
-		auto r0 = (1.0 - iorRatio) / (1.0 + iorRatio);
+		auto r0 = (1 - iorRatio) / (1 + iorRatio);
 		r0 *= r0; // square it
-		return r0 + (1.0 - r0) * std::pow(1 - cosTheta, 5);
+		return r0 + (1 - r0) * std::pow(1 - cosTheta, 5);
 	}
 };
 
@@ -137,14 +191,35 @@ public:
 	virtual std::optional<ScatterResult> scatter(
 		const Ray& rayIn,
 		const HitRecord& record,
-		RandomNumberGenerator& rng
+		Sampler& sampler
 	) const override {
 		return {}; // No bounces
 	}
 
-	virtual color3 emit() {
+	virtual color3 emit() const override {
 		return color;
 	}
 
 };
 
+// Owns the materials of a scene.
+//
+// Hittables and hit records point to their material with a plain pointer
+// into this table, so that passing hits around never touches a reference
+// count shared by every thread. The table must outlive the hittables that
+// use it.
+class MaterialTable {
+public:
+	template<typename MaterialType, typename... Args>
+	const MaterialType* make(Args&&... args) {
+		auto material = std::make_unique<MaterialType>(std::forward<Args>(args)...);
+		const MaterialType* result = material.get();
+		materials.push_back(std::move(material));
+		return result;
+	}
+
+	size_t size() const { return materials.size(); }
+
+private:
+	std::vector<std::unique_ptr<Material>> materials;
+};
@@ -1,26 +1,33 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <optional>
 #include <ranges>
 #include <stdexcept>
 #include <vector>
 
 #include "bounding_box.h"
+#include "bounding_volume_hierarchy.h"
 #include "hittable.h"
 #include "material.h"
+#include "triangle.h"
 #include "vec3.h"
+#include "wide_bounding_volume_hierarchy.h"
 
-// TODO: implement BVH on Mesh as well
-
+// Triangle mesh with its own BVH over its triangles. The scene's BVH only
+// sees the mesh as a whole, making the two a two-level hierarchy.
 class Mesh : public Hittable {
 private:
-	std::vector<point3> vertices;
-	std::vector<int> indices;
-	std::vector<std::shared_ptr<Material>> materialPtrs;
+	std::vector<const Material*> materialPtrs;
 	std::vector<int> materialIndices;
 
-	BoundingBox aabb; // Axis Aligned Bounding Box
+	// Triangles are stored in the order of the BVH leaves
+	WideBvhTree<DEFAULT_BVH_WIDTH> triangleTree;
+	TriangleArray triangles;
 
 public: 
 
@@ -29,134 +36,277 @@ public:
 	Mesh(
 		std::initializer_list<point3> vertices,
 		std::initializer_list<int> indices,
-		std::shared_ptr<Material> materialPtr
+		const Material* materialPtr
 	) : Mesh(vertices, indices, { materialPtr }, {}) {}
 
 	Mesh(
 		std::initializer_list<point3> vertices,
 		std::initializer_list<int> indices,
-		std::initializer_list<std::shared_ptr<Material>> materialPtrs,
+		std::initializer_list<const Material*> materialPtrs,
 		std::initializer_list<int> materialIndices
+	) : Mesh(
+		std::vector<point3>(vertices),
+		std::vector<int>(indices),
+		std::vector<const Material*>(materialPtrs),
+		std::vector<int>(materialIndices)
+	) {}
+
+	// For meshes built at runtime. Takes the vectors by value so callers can
+	// move large meshes in without a copy. Vertices and indices only live
+	// until the triangles are built from them.
+	Mesh(
+		std::vector<point3> vertices,
+		std::vector<int> indices,
+		std::vector<const Material*> materialPtrs,
+		std::vector<int> materialIndices
 	) :
-		vertices(vertices),
-		indices(indices),
-		materialPtrs(materialPtrs),
-		materialIndices(materialIndices)
+		materialPtrs(std::move(materialPtrs)),
+		materialIndices(std::move(materialIndices))
 	{
-		if (vertices.size() <= 3)
+		if (vertices.size() < 3)
 			throw std::invalid_argument(
 				"Mesh requires at least 3 vertices for a triangle"
 			);
-		if (materialPtrs.size() <= 0)
+		if (this->materialPtrs.size() <= 0)
 			throw std::invalid_argument(
 				"Mesh requires at least one material pointer"
 			);		
+		if (std::ranges::find(this->materialPtrs, nullptr) != this->materialPtrs.end())
+			throw std::invalid_argument("Mesh material pointers can't be null");
+
+		if (indices.size() < 3 || indices.size() % 3 != 0)
+			throw std::invalid_argument(
+				"Mesh requires 3 indices per triangle"
+			);
 
-		// Precalculate bounding box
-		aabb = generateBoundingBox(vertices);
+		buildTriangleTree(vertices, indices);
+	}
+
+	// Mesh built before, e.g. loaded from a scene cache. Triangles and
+	// material indices are in the order of the tree's leaves.
+	Mesh(
+		WideBvhTree<DEFAULT_BVH_WIDTH> triangleTree,
+		TriangleArray triangles,
+		std::vector<const Material*> materialPtrs,
+		std::vector<int> materialIndices
+	) :
+		materialPtrs(std::move(materialPtrs)),
+		materialIndices(std::move(materialIndices)),
+		triangleTree(std::move(triangleTree)),
+		triangles(std::move(triangles))
+	{
+		if (this->materialIndices.size() != this->triangles.size())
+			throw std::invalid_argument("Mesh requires a material index per triangle");
 	}
 
+	const WideBvhTree<DEFAULT_BVH_WIDTH>& getTriangleTree() const { return triangleTree; }
+	const TriangleArray& getTriangles() const { return triangles; }
+	const std::vector<const Material*>& getMaterialPtrs() const { return materialPtrs; }
+	const std::vector<int>& getMaterialIndices() const { return materialIndices; }
+
 	typedef Hittable super;
 
-	virtual std::optional<HitRecord> hit(
+	virtual bool intersect(
 		const Ray& ray,
-		double tMin, double tMax
-	) const {
-		HitRecord record;
-		record.t = tMax; 
+		real tMin, real tMax,
+		HitCandidate& closest
+	) const override {
+		const TriangleRay triangleRay(ray);
 
 		// find closest intersection
-		for (int i = 0; i <= (indices.size() - 1) / 3; i++) {
-			int triangleIndex = i * 3;
-			Triangle triangle(
-				vertices[indices[triangleIndex]],
-				vertices[indices[triangleIndex + 1]],
-				vertices[indices[triangleIndex + 2]]
-			);
-			 
-			double t = triangle.hitPlane(ray);
+		return triangleTree.traverse(
+			ray, tMin, tMax,
+			[&](uint32_t i, real& tMax) {
+				auto triangleHit = triangles.intersect(triangleRay, i, tMin, tMax);
+				if (!triangleHit)
+					return false;
 
-			// Skip if intersection is behind the ray or we've found a closer
-			// one.
-			if (t < tMin || t >= record.t)
-				continue;
+				closest = makeCandidate(i, triangleHit.value());
+				tMax = closest.t;
+				return true;
+			}
+		);
+	}
+
+	virtual void intersectPacket(
+		const RayPacket& packet,
+		uint32_t laneMask,
+		real tMin,
+		PacketHits& hits
+	) const override {
+		std::optional<TriangleRay> triangleRays[RayPacket::MAX_SIZE];
+		forEachLane(laneMask, [&](int lane) {
+			triangleRays[lane].emplace(packet.ray(lane));
+		});
+
+		triangleTree.traversePacket(
+			packet, laneMask, tMin, hits.tMax,
+			[&](uint32_t i, uint32_t laneMask) {
+				// The lanes of a packet share the triangle's data, which is
+				// already in cache after the first lane
+				forEachLane(laneMask, [&](int lane) {
+					auto triangleHit = triangles.intersect(
+						triangleRays[lane].value(), i, tMin, hits.tMax[lane]
+					);
+					if (!triangleHit)
+						return;
+
+					hits.candidates[lane] = makeCandidate(i, triangleHit.value());
+					hits.tMax[lane] = triangleHit.value().t;
+				});
+			}
+		);
+	}
+
+	virtual HitRecord finalize(
+		const Ray& ray, const HitCandidate& candidate
+	) const override {
+		auto triangle = candidate.primitive;
 
-			auto intersection = ray.at(t);
-			
-			if (!triangle.includesPointOnPlane(intersection))
+		HitRecord record;
+		record.t = candidate.t;
+		record.u = candidate.u;
+		record.v = candidate.v;
+		record.intersection = triangles.interpolate(
+			triangle, candidate.u, candidate.v
+		);
+		record.intersectionError = triangles.interpolationError(
+			triangle, candidate.u, candidate.v
+		);
+		record.materialPtr = materialPtrs[materialIndices[triangle]];
+		record.setNormalFromOutwardNormal(ray, triangles.normal(triangle));
+		record.hittable = this;
+		record.primitive = triangle;
+		return record;
+	}
+
+	virtual bool occluded(
+		const Ray& ray, real tMin, real tMax
+	) const override {
+		const TriangleRay triangleRay(ray);
+
+		return triangleTree.traverseAny(ray, tMin, tMax, [&](uint32_t i) {
+			return triangles.intersect(triangleRay, i, tMin, tMax).has_value();
+		});
+	}
+
+	virtual uint32_t occludedPacket(
+		const RayPacket& packet,
+		uint32_t laneMask,
+		real tMin,
+		const real tMax[RayPacket::MAX_SIZE]
+	) const override {
+		std::optional<TriangleRay> triangleRays[RayPacket::MAX_SIZE];
+		forEachLane(laneMask, [&](int lane) {
+			triangleRays[lane].emplace(packet.ray(lane));
+		});
+
+		return triangleTree.traverseAnyPacket(
+			packet, laneMask, tMin, tMax,
+			[&](uint32_t i, uint32_t laneMask) {
+				uint32_t blocked = 0;
+				forEachLane(laneMask, [&](int lane) {
+					if (triangles.intersect(triangleRays[lane].value(), i, tMin, tMax[lane]))
+						blocked |= 1u << lane;
+				});
+				return blocked;
+			}
+		);
+	}
+
+	virtual void collectEmitters(std::vector<Emitter>& emitters) const override {
+		for (size_t i = 0; i < triangleCount(); i++) {
+			const Material* material = materialPtrs[materialIndices[i]];
+			if (material->emit().maxComponent() <= 0)
 				continue;
 
-			record.normal = triangle.normal;
-			record.t = t;
-			record.intersection = intersection;
-			record.materialPtr = materialPtrs[
-				i < materialIndices.size() ? materialIndices[i] : 0
-			];
+			emitters.push_back(Emitter{
+				this, static_cast<uint32_t>(i), material, triangles.area(i)
+			});
 		}
+	}
 
-		// also allows us to not check whether t < tMax inside the for loop
-		bool hit = record.t < tMax;
-		if (!hit)
-			return {};
+	virtual SurfaceSample samplePrimitive(
+		uint32_t primitive, real u1, real u2
+	) const override {
+		// Uniform barycentrics, "Sampling a Triangle" in pbrt
+		real rootU1 = std::sqrt(u1);
+		real u = 1 - rootU1;
+		real v = u2 * rootU1;
 
-		record.setNormalFromOutwardNormal(ray, record.normal.unit());
-		return record;
+		return SurfaceSample{
+			triangles.interpolate(primitive, u, v), triangles.normal(primitive)
+		};
 	}
 
 	virtual std::optional<BoundingBox> boundingBox(
-		double tStart, double tEnd
-	) const {
-		return aabb;
+		real tStart, real tEnd
+	) const override {
+		return triangleTree.boundingBox();
 	}
 
 private:
 
-	BoundingBox generateBoundingBox(std::initializer_list<point3> vertices) {
-		assert(vertices.size() > 0);
+	HitCandidate makeCandidate(
+		uint32_t triangle, const TriangleHit& triangleHit
+	) const {
+		return HitCandidate{
+			/* t */         triangleHit.t,
+			/* hittable */  this,
+			/* primitive */ triangle,
+			/* u */         triangleHit.u,
+			/* v */         triangleHit.v
+		};
+	}
 
-		BoundingBox aabb;
-		aabb.cornerMax = aabb.cornerMin = *vertices.begin();
+	size_t triangleCount() const {
+		return triangles.size();
+	}
 
-		for (const auto& vertex : vertices | std::ranges::views::drop(1)) {
-			aabb.include(vertex);
-		}
+	// Builds the BVH over the triangles and stores the triangles in the
+	// order of its leaves
+	void buildTriangleTree(
+		const std::vector<point3>& vertices,
+		const std::vector<int>& indices
+	) {
+		const size_t count = indices.size() / 3;
 
-		return aabb;
-	}
+		{
+			std::vector<BoundingBox> bounds;
+			bounds.reserve(count);
+
+			for (size_t i = 0; i < count; i++) {
+				BoundingBox box;
+				box.cornerMin = box.cornerMax = vertices.at(indices[i * 3]);
+				box.include(vertices.at(indices[i * 3 + 1]));
+				box.include(vertices.at(indices[i * 3 + 2]));
+				bounds.push_back(box);
+			}
 
-	// Triangle in 3D space
-	class Triangle {
-	public:
-		const point3 a, b, c;
-		const vec3 normal;
-
-		Triangle(point3 a, point3 b, point3 c)
-			: a(a), b(b), c(c), normal((b - a).cross(c - a)) { }
-
-		// Returns a value t where ray.at(t) is the intersection of the plane 
-		// and the ray
-		double hitPlane(const Ray& ray) const {
-			double D = a.dot(normal); // From the plane equation Ax + By + Cz = D
-			double t = (D - normal.dot(ray.origin)) / normal.dot(ray.direction);
-			return t;
+			triangleTree = WideBvhTree<DEFAULT_BVH_WIDTH>(BvhTree(bounds));
 		}
 
-		// Checks if a 3D point, assumed to be on the plane of the triangle,
-		// is inside that triangle
-		bool includesPointOnPlane(point3 point) const {
-			auto AB = b - a;
-			auto BC = c - b;
-			auto CA = a - c;
+		std::vector<int> sortedMaterialIndices;
+		sortedMaterialIndices.reserve(count);
+		triangles.reserve(count);
 
-			// Seems to need a floating point buffer region for edgecases
-			// where point is right on AB, BC, or CA
-			bool rightOfAB = std::signbit(AB.cross(normal).dot(point - a));
-			bool rightOfBC = std::signbit(BC.cross(normal).dot(point - b));
-			bool rightOfCA = std::signbit(CA.cross(normal).dot(point - c));
+		// Indices were all checked by building the bounds
+		for (auto i : triangleTree.primitiveOrder) {
+			triangles.add(
+				vertices[indices[i * 3]],
+				vertices[indices[i * 3 + 1]],
+				vertices[indices[i * 3 + 2]]
+			);
 
-			int positiveCount = rightOfAB + rightOfBC + rightOfCA;
+			// Triangles without a material index use the first material
+			int materialIndex = i < materialIndices.size() ? materialIndices[i] : 0;
+			if (materialIndex < 0
+				|| materialIndex >= static_cast<int>(materialPtrs.size()))
+				throw std::invalid_argument("Mesh material index out of range");
 
-			return positiveCount == 0 || positiveCount == 3;
+			sortedMaterialIndices.push_back(materialIndex);
 		}
-	};
+
+		materialIndices = std::move(sortedMaterialIndices);
+	}
 };
\ No newline at end of file
@@ -0,0 +1,703 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "commons.h"
+#include "mapped_file.h"
+#include "vec3.h"
+
+// Triangles as Mesh takes them
+struct MeshData {
+	std::vector<point3> vertices;
+	// 3 per triangle
+	std::vector<int> indices;
+	// One per triangle, or empty if the file doesn't say
+	std::vector<int> materialIndices;
+	// Names of the material indices, for OBJ files
+	std::vector<std::string> materialNames;
+};
+
+// Runs body(0) to body(count - 1) on a thread each. Rethrows the exception
+// of the lowest index that threw, if any.
+void runInParallel(int count, const std::function<void(int)>& body) {
+	std::vector<std::exception_ptr> errors(count);
+	std::vector<std::thread> threads;
+	threads.reserve(count);
+
+	for (int i = 0; i < count; i++) {
+		threads.emplace_back([&, i]() {
+			try {
+				body(i);
+			}
+			catch (...) {
+				errors[i] = std::current_exception();
+			}
+		});
+	}
+
+	for (auto& thread : threads)
+		thread.join();
+
+	for (const auto& error : errors) {
+		if (error)
+			std::rethrow_exception(error);
+	}
+}
+
+// Chunks of at least this many bytes or elements are worth a thread
+constexpr size_t MIN_LOADER_CHUNK = 1 << 20;
+
+int loaderChunkCount(size_t work, int threadCount) {
+	if (threadCount <= 0)
+		threadCount = std::max<int>(std::thread::hardware_concurrency(), 1);
+	return static_cast<int>(std::clamp<size_t>(work / MIN_LOADER_CHUNK, 1, threadCount));
+}
+
+void checkIndexRange(size_t count, const std::string& path) {
+	if (count > size_t(std::numeric_limits<int>::max()))
+		throw std::runtime_error(path + " has too many vertices or triangles");
+}
+
+
+// OBJ
+
+// Wavefront OBJ, parsed in two passes over chunks of lines in parallel.
+// The first counts the vertices, triangles and lines of every chunk, so the
+// second can parse each chunk straight into its place in the final arrays.
+//
+// Only positions, faces and usemtl are read. Faces with more than three
+// corners become fans of triangles. Material indices are numbered in the
+// order of first usemtl, and faces before any usemtl get 0.
+class ObjLoader {
+public:
+	ObjLoader(const char* data, size_t size, std::string path) :
+		data(data), size(size), path(std::move(path)) {}
+
+	MeshData load(int threadCount) {
+		splitChunks(loaderChunkCount(size, threadCount));
+
+		runInParallel(static_cast<int>(chunks.size()), [&](int i) {
+			count(chunks[i]);
+		});
+
+		MeshData mesh;
+		size_t vertexCount = 0, triangleCount = 0, lineCount = 0;
+		int material = 0;
+		bool anyMaterials = false;
+		for (auto& chunk : chunks) {
+			chunk.firstVertex = vertexCount;
+			chunk.firstTriangle = triangleCount;
+			chunk.firstLine = lineCount;
+			chunk.firstMaterial = material;
+
+			vertexCount += chunk.vertices;
+			triangleCount += chunk.triangles;
+			lineCount += chunk.lines;
+
+			for (auto name : chunk.materials) {
+				auto [found, isNew] = materialIds.try_emplace(
+					name, static_cast<int>(mesh.materialNames.size())
+				);
+				if (isNew)
+					mesh.materialNames.emplace_back(name);
+				material = found->second;
+				anyMaterials = true;
+			}
+		}
+
+		checkIndexRange(vertexCount, path);
+		checkIndexRange(triangleCount * 3, path);
+
+		mesh.vertices.resize(vertexCount);
+		mesh.indices.resize(triangleCount * 3);
+		if (anyMaterials)
+			mesh.materialIndices.resize(triangleCount);
+
+		runInParallel(static_cast<int>(chunks.size()), [&](int i) {
+			parse(chunks[i], mesh);
+		});
+
+		return mesh;
+	}
+
+private:
+	struct Chunk {
+		const char* begin;
+		const char* end;
+
+		// Counted by the first pass
+		size_t lines = 0;
+		size_t vertices = 0;
+		size_t triangles = 0;
+		std::vector<std::string_view> materials;
+
+		// Where the chunk starts in the whole file
+		size_t firstLine = 0;
+		size_t firstVertex = 0;
+		size_t firstTriangle = 0;
+		int firstMaterial = 0;
+	};
+
+	const char* data;
+	size_t size;
+	std::string path;
+
+	std::vector<Chunk> chunks;
+	std::unordered_map<std::string_view, int> materialIds;
+
+	// Chunks of about the same size, each starting at the start of a line
+	void splitChunks(int chunkCount) {
+		const char* fileEnd = data + size;
+		const char* begin = data;
+
+		for (int i = 1; i <= chunkCount && begin < fileEnd; i++) {
+			const char* end = i == chunkCount ? fileEnd : data + size * i / chunkCount;
+			end = std::max(end, begin);
+			if (end < fileEnd) {
+				auto newline = static_cast<const char*>(std::memchr(end, '\n', fileEnd - end));
+				end = newline ? newline + 1 : fileEnd;
+			}
+
+			chunks.push_back(Chunk{ begin, end });
+			begin = end;
+		}
+	}
+
+	// Calls onLine(line) with every line of the chunk, without its line
+	// break
+	template <typename OnLine>
+	static void forEachLine(const Chunk& chunk, OnLine&& onLine) {
+		const char* at = chunk.begin;
+		while (at < chunk.end) {
+			auto newline = static_cast<const char*>(std::memchr(at, '\n', chunk.end - at));
+			const char* lineEnd = newline ? newline : chunk.end;
+
+			std::string_view line(at, lineEnd - at);
+			if (!line.empty() && line.back() == '\r')
+				line.remove_suffix(1);
+			onLine(line);
+
+			at = lineEnd + 1;
+		}
+	}
+
+	static bool isSpace(char c) {
+		return c == ' ' || c == '\t';
+	}
+
+	// Cuts the next word off the front of text
+	static std::string_view nextWord(std::string_view& text) {
+		size_t start = 0;
+		while (start < text.size() && isSpace(text[start]))
+			start++;
+		size_t end = start;
+		while (end < text.size() && !isSpace(text[end]))
+			end++;
+
+		auto word = text.substr(start, end - start);
+		text.remove_prefix(end);
+		return word;
+	}
+
+	static std::string_view trim(std::string_view text) {
+		while (!text.empty() && isSpace(text.front()))
+			text.remove_prefix(1);
+		while (!text.empty() && isSpace(text.back()))
+			text.remove_suffix(1);
+		return text;
+	}
+
+	void count(Chunk& chunk) const {
+		forEachLine(chunk, [&](std::string_view line) {
+			chunk.lines++;
+
+			auto keyword = nextWord(line);
+			if (keyword == "v") {
+				chunk.vertices++;
+			}
+			else if (keyword == "f") {
+				size_t corners = 0;
+				while (!nextWord(line).empty())
+					corners++;
+				if (corners >= 3)
+					chunk.triangles += corners - 2;
+			}
+			else if (keyword == "usemtl") {
+				chunk.materials.push_back(trim(line));
+			}
+		});
+	}
+
+	void parse(const Chunk& chunk, MeshData& mesh) const {
+		size_t line = chunk.firstLine;
+		size_t vertex = chunk.firstVertex;
+		size_t triangle = chunk.firstTriangle;
+		int material = chunk.firstMaterial;
+
+		auto fail = [&](const std::string& message) {
+			throw std::runtime_error(path + ":" + std::to_string(line) + ": " + message);
+		};
+
+		forEachLine(chunk, [&](std::string_view text) {
+			line++;
+
+			auto keyword = nextWord(text);
+			if (keyword == "v") {
+				point3 position;
+				for (int axis = 0; axis < 3; axis++) {
+					auto word = nextWord(text);
+					auto [end, error] = std::from_chars(
+						word.data(), word.data() + word.size(), position[axis]
+					);
+					if (word.empty() || error != std::errc() || end != word.data() + word.size())
+						fail("Expected a number instead of " + std::string(word));
+				}
+				mesh.vertices[vertex++] = position;
+			}
+			else if (keyword == "f") {
+				int first = -1, previous = -1;
+				int corners = 0;
+				for (auto word = nextWord(text); !word.empty(); word = nextWord(text)) {
+					// v, v/vt, v//vn or v/vt/vn, of which only v matters
+					long long index = 0;
+					auto [end, error] = std::from_chars(word.data(), word.data() + word.size(), index);
+					if (error != std::errc() || (end != word.data() + word.size() && *end != '/'))
+						fail("Expected a vertex index instead of " + std::string(word));
+
+					// Counting from 1, or back from the last vertex if negative
+					long long resolved = index > 0 ? index - 1 : static_cast<long long>(vertex) + index;
+					if (index == 0 || resolved < 0 || resolved >= static_cast<long long>(mesh.vertices.size()))
+						fail("Vertex index " + std::string(word) + " out of range");
+
+					int current = static_cast<int>(resolved);
+					if (corners == 0)
+						first = current;
+					else if (corners >= 2) {
+						mesh.indices[triangle * 3] = first;
+						mesh.indices[triangle * 3 + 1] = previous;
+						mesh.indices[triangle * 3 + 2] = current;
+						if (!mesh.materialIndices.empty())
+							mesh.materialIndices[triangle] = material;
+						triangle++;
+					}
+					previous = current;
+					corners++;
+				}
+
+				if (corners < 3)
+					fail("Face with fewer than 3 vertices");
+			}
+			else if (keyword == "usemtl") {
+				material = materialIds.at(trim(text));
+			}
+		});
+	}
+};
+
+
+// PLY
+
+// Binary PLY, either endianness. Vertices need x, y and z, and faces a list
+// of vertex_indices (or vertex_index). An integer material_index property of
+// faces becomes the material indices.
+//
+// Vertices are fixed size records and are parsed in parallel right away.
+// Faces are lists, so one quick pass steps over them to find where every
+// chunk of faces starts before they're parsed in parallel.
+class PlyLoader {
+public:
+	PlyLoader(const char* data, size_t size, std::string path) :
+		data(data), size(size), path(std::move(path)) {}
+
+	MeshData load(int threadCount) {
+		size_t offset = parseHeader();
+
+		MeshData mesh;
+		bool hasVertices = false, hasFaces = false;
+		for (const auto& element : elements) {
+			if (element.name == "vertex") {
+				offset = loadVertices(element, offset, mesh, threadCount);
+				hasVertices = true;
+			}
+			else if (element.name == "face") {
+				offset = loadFaces(element, offset, mesh, threadCount);
+				hasFaces = true;
+			}
+			else {
+				for (size_t i = 0; i < element.count; i++)
+					offset = skipRecord(element, offset);
+			}
+		}
+
+		if (!hasVertices || !hasFaces)
+			fail("Needs both vertex and face elements");
+
+		return mesh;
+	}
+
+private:
+	enum class Type { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+	struct Property {
+		std::string name;
+		Type type;
+		bool isList = false;
+		// Type of the length of lists
+		Type countType = Type::UInt8;
+	};
+
+	struct Element {
+		std::string name;
+		size_t count = 0;
+		std::vector<Property> properties;
+	};
+
+	const char* data;
+	size_t size;
+	std::string path;
+
+	bool swapBytes = false;
+	std::vector<Element> elements;
+
+	[[noreturn]] void fail(const std::string& message) const {
+		throw std::runtime_error(path + ": " + message);
+	}
+
+	static std::optional<Type> typeFromName(const std::string& name) {
+		if (name == "char" || name == "int8") return Type::Int8;
+		if (name == "uchar" || name == "uint8") return Type::UInt8;
+		if (name == "short" || name == "int16") return Type::Int16;
+		if (name == "ushort" || name == "uint16") return Type::UInt16;
+		if (name == "int" || name == "int32") return Type::Int32;
+		if (name == "uint" || name == "uint32") return Type::UInt32;
+		if (name == "float" || name == "float32") return Type::Float32;
+		if (name == "double" || name == "float64") return Type::Float64;
+		return std::nullopt;
+	}
+
+	static size_t typeSize(Type type) {
+		switch (type) {
+		case Type::Int8: case Type::UInt8: return 1;
+		case Type::Int16: case Type::UInt16: return 2;
+		case Type::Int32: case Type::UInt32: case Type::Float32: return 4;
+		default: return 8;
+		}
+	}
+
+	template <typename T>
+	T readRaw(const char* at) const {
+		char bytes[sizeof(T)];
+		std::memcpy(bytes, at, sizeof(T));
+		if (swapBytes)
+			std::reverse(bytes, bytes + sizeof(T));
+		return std::bit_cast<T>(bytes);
+	}
+
+	double readNumber(const char* at, Type type) const {
+		switch (type) {
+		case Type::Float32: return readRaw<float>(at);
+		case Type::Float64: return readRaw<double>(at);
+		default: return static_cast<double>(readInteger(at, type));
+		}
+	}
+
+	long long readInteger(const char* at, Type type) const {
+		switch (type) {
+		case Type::Int8: return readRaw<int8_t>(at);
+		case Type::UInt8: return readRaw<uint8_t>(at);
+		case Type::Int16: return readRaw<int16_t>(at);
+		case Type::UInt16: return readRaw<uint16_t>(at);
+		case Type::Int32: return readRaw<int32_t>(at);
+		case Type::UInt32: return readRaw<uint32_t>(at);
+		case Type::Float32: return static_cast<long long>(readRaw<float>(at));
+		default: return static_cast<long long>(readRaw<double>(at));
+		}
+	}
+
+	// Reads the header and returns where the data starts
+	size_t parseHeader() {
+		size_t offset = 0;
+		auto nextLine = [&]() {
+			auto newline = static_cast<const char*>(std::memchr(data + offset, '\n', size - offset));
+			if (!newline)
+				fail("Header has no end_header");
+
+			std::string line(data + offset, newline);
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			offset = newline - data + 1;
+			return line;
+		};
+
+		if (size < 4 || nextLine() != "ply")
+			fail("Not a PLY file");
+
+		while (true) {
+			std::istringstream line(nextLine());
+			std::string keyword;
+			line >> keyword;
+
+			if (keyword == "end_header")
+				break;
+
+			if (keyword == "format") {
+				std::string format;
+				line >> format;
+				if (format == "binary_little_endian")
+					swapBytes = std::endian::native != std::endian::little;
+				else if (format == "binary_big_endian")
+					swapBytes = std::endian::native != std::endian::big;
+				else
+					fail("Only binary PLY files are supported, not " + format);
+			}
+			else if (keyword == "element") {
+				Element element;
+				line >> element.name >> element.count;
+				if (!line)
+					fail("Bad element line");
+				elements.push_back(element);
+			}
+			else if (keyword == "property") {
+				if (elements.empty())
+					fail("Property before any element");
+
+				Property property;
+				std::string typeName;
+				line >> typeName;
+				if (typeName == "list") {
+					std::string countTypeName;
+					line >> countTypeName >> typeName;
+					auto countType = typeFromName(countTypeName);
+					if (!countType)
+						fail("Unknown type " + countTypeName);
+					property.isList = true;
+					property.countType = countType.value();
+				}
+				line >> property.name;
+
+				auto type = typeFromName(typeName);
+				if (!type || !line)
+					fail("Bad property line");
+				property.type = type.value();
+
+				elements.back().properties.push_back(property);
+			}
+			// comment, obj_info and the like
+		}
+
+		return offset;
+	}
+
+	// Steps over one record of element and returns where the next starts
+	size_t skipRecord(const Element& element, size_t offset) const {
+		for (const auto& property : element.properties) {
+			if (property.isList) {
+				checkSize(offset, typeSize(property.countType));
+				long long count = readInteger(data + offset, property.countType);
+				if (count < 0)
+					fail("Negative list length");
+				offset += typeSize(property.countType) + count * typeSize(property.type);
+			}
+			else {
+				offset += typeSize(property.type);
+			}
+		}
+		checkSize(offset, 0);
+		return offset;
+	}
+
+	void checkSize(size_t offset, size_t bytes) const {
+		if (offset > size || bytes > size - offset)
+			fail("File ends early");
+	}
+
+	size_t loadVertices(const Element& element, size_t offset, MeshData& mesh, int threadCount) {
+		checkIndexRange(element.count, path);
+
+		size_t stride = 0;
+		int found = 0;
+		size_t axisOffsets[3] = {};
+		Type axisTypes[3] = {};
+		for (const auto& property : element.properties) {
+			if (property.isList)
+				fail("Vertices can't have list properties");
+
+			for (int axis = 0; axis < 3; axis++) {
+				if (property.name == std::string(1, char('x' + axis))) {
+					axisOffsets[axis] = stride;
+					axisTypes[axis] = property.type;
+					found |= 1 << axis;
+				}
+			}
+			stride += typeSize(property.type);
+		}
+		if (found != 7)
+			fail("Vertices need x, y and z");
+
+		checkSize(offset, element.count * stride);
+
+		mesh.vertices.resize(element.count);
+		int chunkCount = loaderChunkCount(element.count * stride, threadCount);
+		runInParallel(chunkCount, [&](int chunk) {
+			size_t begin = element.count * chunk / chunkCount;
+			size_t end = element.count * (chunk + 1) / chunkCount;
+			for (size_t i = begin; i < end; i++) {
+				const char* record = data + offset + i * stride;
+				for (int axis = 0; axis < 3; axis++) {
+					mesh.vertices[i][axis] = static_cast<real>(
+						readNumber(record + axisOffsets[axis], axisTypes[axis])
+					);
+				}
+			}
+		});
+
+		return offset + element.count * stride;
+	}
+
+	size_t loadFaces(const Element& element, size_t offset, MeshData& mesh, int threadCount) {
+		const Property* indexList = nullptr;
+		const Property* materialProperty = nullptr;
+		for (const auto& property : element.properties) {
+			if (property.isList && (property.name == "vertex_indices" || property.name == "vertex_index"))
+				indexList = &property;
+			if (!property.isList && property.name == "material_index")
+				materialProperty = &property;
+		}
+		if (!indexList)
+			fail("Faces need a vertex_indices list");
+
+		// Where each chunk of faces starts in the file and the triangles
+		int chunkCount = loaderChunkCount(element.count * 8, threadCount);
+		std::vector<size_t> chunkOffsets(chunkCount + 1), chunkTriangles(chunkCount + 1);
+
+		size_t triangleCount = 0;
+		int chunk = 0;
+		for (size_t i = 0; i < element.count; i++) {
+			if (i == element.count * chunk / chunkCount) {
+				chunkOffsets[chunk] = offset;
+				chunkTriangles[chunk] = triangleCount;
+				chunk++;
+			}
+
+			size_t recordOffset = offset;
+			for (const auto& property : element.properties) {
+				if (property.isList) {
+					checkSize(recordOffset, typeSize(property.countType));
+					long long count = readInteger(data + recordOffset, property.countType);
+					if (count < 0)
+						fail("Negative list length");
+					if (&property == indexList && count >= 3)
+						triangleCount += count - 2;
+					recordOffset += typeSize(property.countType) + count * typeSize(property.type);
+				}
+				else {
+					recordOffset += typeSize(property.type);
+				}
+			}
+			offset = recordOffset;
+		}
+		checkSize(offset, 0);
+		checkIndexRange(triangleCount * 3, path);
+
+		mesh.indices.resize(triangleCount * 3);
+		if (materialProperty)
+			mesh.materialIndices.resize(triangleCount);
+
+		long long vertexCount = static_cast<long long>(mesh.vertices.size());
+		runInParallel(chunkCount, [&](int chunk) {
+			size_t begin = element.count * chunk / chunkCount;
+			size_t end = element.count * (chunk + 1) / chunkCount;
+			size_t recordOffset = chunkOffsets[chunk];
+			size_t triangle = chunkTriangles[chunk];
+
+			for (size_t i = begin; i < end; i++) {
+				int material = 0;
+				size_t firstTriangle = triangle;
+
+				for (const auto& property : element.properties) {
+					size_t valueSize = typeSize(property.type);
+
+					if (!property.isList) {
+						if (&property == materialProperty)
+							material = static_cast<int>(readInteger(data + recordOffset, property.type));
+						recordOffset += valueSize;
+						continue;
+					}
+
+					long long count = readInteger(data + recordOffset, property.countType);
+					recordOffset += typeSize(property.countType);
+
+					if (&property == indexList) {
+						if (count < 3)
+							fail("Face " + std::to_string(i) + " has fewer than 3 vertices");
+
+						int first = 0, previous = 0;
+						for (long long corner = 0; corner < count; corner++) {
+							long long index = readInteger(data + recordOffset + corner * valueSize, property.type);
+							if (index < 0 || index >= vertexCount)
+								fail("Face " + std::to_string(i) + " has a vertex index out of range");
+
+							int current = static_cast<int>(index);
+							if (corner == 0)
+								first = current;
+							else if (corner >= 2) {
+								mesh.indices[triangle * 3] = first;
+								mesh.indices[triangle * 3 + 1] = previous;
+								mesh.indices[triangle * 3 + 2] = current;
+								triangle++;
+							}
+							previous = current;
+						}
+					}
+					recordOffset += count * valueSize;
+				}
+
+				if (materialProperty) {
+					for (size_t t = firstTriangle; t < triangle; t++)
+						mesh.materialIndices[t] = material;
+				}
+			}
+		});
+
+		return offset;
+	}
+};
+
+
+// Loads an .obj or binary .ply file. threadCount 0 uses every core.
+MeshData loadMesh(const std::string& path, int threadCount = 0) {
+	std::string extension = std::filesystem::path(path).extension().string();
+	std::transform(extension.begin(), extension.end(), extension.begin(),
+		[](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+
+	if (extension != ".obj" && extension != ".ply")
+		throw std::invalid_argument("Unknown mesh format " + extension + ", use .obj or .ply");
+
+	MappedFile file(path);
+
+	MeshData mesh = extension == ".obj"
+		? ObjLoader(file.data(), file.size(), path).load(threadCount)
+		: PlyLoader(file.data(), file.size(), path).load(threadCount);
+
+	if (mesh.vertices.size() < 3 || mesh.indices.empty())
+		throw std::runtime_error(path + " has no triangles");
+
+	return mesh;
+}
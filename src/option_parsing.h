@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+// Command line values, shared by the renderer and the benchmark
+
+// Whole number in [minimum, maximum], or std::invalid_argument naming option
+long long parseIntegerOption(
+	const std::string& option, const std::string& text,
+	long long minimum, long long maximum
+) {
+	char* end = nullptr;
+	long long value = std::strtoll(text.c_str(), &end, 10);
+	if (text.empty() || *end != '\0' || value < minimum || value > maximum) {
+		throw std::invalid_argument(
+			option + " takes a whole number from " + std::to_string(minimum)
+			+ " to " + std::to_string(maximum) + ", not " + text
+		);
+	}
+	return value;
+}
+
+// Finite number from minimum up, or std::invalid_argument naming option
+double parseRealOption(const std::string& option, const std::string& text, double minimum) {
+	char* end = nullptr;
+	double value = std::strtod(text.c_str(), &end);
+	if (text.empty() || *end != '\0' || !(value >= minimum) || !std::isfinite(value)) {
+		std::ostringstream message;
+		message << option << " takes a number from " << minimum << " up, not " << text;
+		throw std::invalid_argument(message.str());
+	}
+	return value;
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cmath>
+#include <limits>
+
 #include "vec3.h"
 
 class Ray {
@@ -13,7 +16,48 @@ public:
 	Ray(const point3& origin, const vec3& direction)
 		: origin(origin), direction(direction) {}
 
-	point3 at(double t) const {
+	point3 at(real t) const {
 		return origin + direction * t;
 	}
-};
\ No newline at end of file
+
+	// False if any component is NaN or infinite, e.g. from damaged scene
+	// data. Slab tests let such rays through every box.
+	bool isFinite() const {
+		for (int axis = 0; axis < 3; axis++) {
+			if (!std::isfinite(origin[axis]) || !std::isfinite(direction[axis]))
+				return false;
+		}
+		return true;
+	}
+};
+
+// Origin for a ray leaving a surface at point, in the direction of the side
+// normal points to.
+//
+// point is only known up to error (per axis), so the surface could be on
+// either side of it. Pushing it along the normal by the error projected onto
+// the normal, then rounding away from the surface, puts it on the right
+// side. Rays starting there can't hit the surface they left, without having
+// to guess a minimum t that fits the scale of the scene.
+// (pbrt, "Robust Spawned Ray Origins")
+inline point3 offsetRayOrigin(
+	const point3& point, const vec3& error, const vec3& normal
+) {
+	real distance = std::abs(normal.x) * error.x
+		+ std::abs(normal.y) * error.y
+		+ std::abs(normal.z) * error.z;
+	vec3 offset = distance * normal;
+
+	point3 result = point + offset;
+	for (int axis = 0; axis < 3; axis++) {
+		if (offset[axis] > 0)
+			result[axis] = std::nextafter(
+				result[axis], std::numeric_limits<real>::infinity()
+			);
+		else if (offset[axis] < 0)
+			result[axis] = std::nextafter(
+				result[axis], -std::numeric_limits<real>::infinity()
+			);
+	}
+	return result;
+}
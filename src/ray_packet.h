@@ -0,0 +1,141 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+
+#include "ray.h"
+#include "vec3.h"
+
+// Up to MAX_SIZE rays traced together, stored as a structure of arrays so
+// that loops over the rays (lanes) vectorize.
+//
+// Meant for coherent rays, like the primary rays of neighbouring pixels,
+// which mostly visit the same BVH nodes and primitives.
+class RayPacket {
+public:
+	static constexpr int MAX_SIZE = 16;
+
+	int size;
+
+	real origin[3][MAX_SIZE];
+	real direction[3][MAX_SIZE];
+	real inverseDirection[3][MAX_SIZE];
+
+	// True when all rays point the same way along every axis, which is
+	// what the interval test below needs
+	bool isCoherent;
+	// Per axis, the range of the origins and inverse directions
+	real originMin[3], originMax[3];
+	real inverseDirectionMin[3], inverseDirectionMax[3];
+
+	// Generous, since rounding errors pile up across the whole interval
+	static constexpr real ROUNDING_ERROR_SCALE =
+		1 + 32 * std::numeric_limits<real>::epsilon();
+
+	RayPacket(const Ray* rays, int size) : size(size) {
+		if (size < 1 || size > MAX_SIZE)
+			throw std::invalid_argument("Ray packet size out of range");
+
+		for (int lane = 0; lane < size; lane++) {
+			for (int axis = 0; axis < 3; axis++) {
+				origin[axis][lane] = rays[lane].origin[axis];
+				direction[axis][lane] = rays[lane].direction[axis];
+				inverseDirection[axis][lane] = 1 / rays[lane].direction[axis];
+			}
+		}
+
+		isCoherent = true;
+		for (int axis = 0; axis < 3; axis++) {
+			originMin[axis] = originMax[axis] = origin[axis][0];
+			inverseDirectionMin[axis] = inverseDirectionMax[axis] =
+				inverseDirection[axis][0];
+
+			bool isNegative = inverseDirection[axis][0] < 0;
+
+			for (int lane = 1; lane < size; lane++) {
+				originMin[axis] = std::min(originMin[axis], origin[axis][lane]);
+				originMax[axis] = std::max(originMax[axis], origin[axis][lane]);
+				inverseDirectionMin[axis] =
+					std::min(inverseDirectionMin[axis], inverseDirection[axis][lane]);
+				inverseDirectionMax[axis] =
+					std::max(inverseDirectionMax[axis], inverseDirection[axis][lane]);
+
+				if ((inverseDirection[axis][lane] < 0) != isNegative)
+					isCoherent = false;
+			}
+
+			// Rays parallel to an axis have infinite inverse directions,
+			// which interval arithmetic turns into NaNs
+			if (std::isinf(inverseDirectionMin[axis])
+				|| std::isinf(inverseDirectionMax[axis]))
+				isCoherent = false;
+		}
+	}
+
+	uint32_t allLanes() const {
+		return (1u << size) - 1;
+	}
+
+	Ray ray(int lane) const {
+		return Ray(
+			point3(origin[0][lane], origin[1][lane], origin[2][lane]),
+			vec3(direction[0][lane], direction[1][lane], direction[2][lane])
+		);
+	}
+
+	// Conservative test of the whole packet against a box with interval
+	// arithmetic. False means that no ray in the packet can hit the box.
+	// True means that some might.
+	bool mayHit(
+		const real boxMin[3], const real boxMax[3], real tMin, real tMax
+	) const {
+		if (!isCoherent)
+			return true;
+
+		real entry = tMin;
+		real exit = tMax;
+
+		for (int axis = 0; axis < 3; axis++) {
+			// Ranges of (plane - origin) * inverseDirection over all rays
+			auto lowest = [&](real plane) {
+				return std::min({
+					(plane - originMin[axis]) * inverseDirectionMin[axis],
+					(plane - originMin[axis]) * inverseDirectionMax[axis],
+					(plane - originMax[axis]) * inverseDirectionMin[axis],
+					(plane - originMax[axis]) * inverseDirectionMax[axis]
+				});
+			};
+			auto highest = [&](real plane) {
+				return std::max({
+					(plane - originMin[axis]) * inverseDirectionMin[axis],
+					(plane - originMin[axis]) * inverseDirectionMax[axis],
+					(plane - originMax[axis]) * inverseDirectionMin[axis],
+					(plane - originMax[axis]) * inverseDirectionMax[axis]
+				});
+			};
+
+			bool isNegative = inverseDirectionMin[axis] < 0;
+			real nearPlane = isNegative ? boxMax[axis] : boxMin[axis];
+			real farPlane = isNegative ? boxMin[axis] : boxMax[axis];
+
+			entry = std::max(entry, lowest(nearPlane));
+			exit = std::min(exit, highest(farPlane) * ROUNDING_ERROR_SCALE);
+		}
+
+		return entry <= exit;
+	}
+};
+
+// Calls function(lane) for every set bit in laneMask
+template<typename Function>
+inline void forEachLane(uint32_t laneMask, Function&& function) {
+	while (laneMask != 0) {
+		int lane = std::countr_zero(laneMask);
+		function(lane);
+		laneMask &= laneMask - 1;
+	}
+}
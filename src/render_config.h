@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+
+#include "sampler.h"
+
+// How paths are traced
+struct PathConfig {
+	// Paths are cut (and go black) after this many rays
+	int maxBounces = 50;
+	// Russian roulette may end paths after this many rays
+	int russianRouletteStart = 3;
+};
+
+// How many samples pixels get.
+//
+// With an errorThreshold, sampling is adaptive: a block of pixels stops
+// getting samples once the estimated error of their averages drops below
+// the threshold (see Framebuffer::displayError()).
+// Noisy regions like caustics get more samples than flat walls.
+struct SamplingConfig {
+	// Every pixel gets at least minSamples and at most maxSamples
+	int minSamples = 16;
+	int maxSamples = 100;
+	// 0 gives every pixel maxSamples
+	double errorThreshold = 0;
+	// How often pixels are checked for convergence after minSamples, since
+	// the estimate barely changes from one sample to the next
+	int checkInterval = 8;
+	// Images are rendered in passes of this many samples per pixel, which
+	// is how often checkpoints can be taken
+	int passSamples = 16;
+	// Where the random numbers of samples come from. Stratified samplers
+	// split each dimension in maxSamples strata.
+	SamplerType sampler = SamplerType::Sobol;
+
+	// Whether a block of pixels with this many samples and this error
+	// needs no more
+	bool isFinished(int samplesTaken, double error) const {
+		if (samplesTaken >= maxSamples)
+			return true;
+
+		return errorThreshold > 0
+			&& samplesTaken >= minSamples
+			&& error <= errorThreshold;
+	}
+
+	// Whether to check for convergence after this many samples
+	bool isDue(int samplesTaken) const {
+		return errorThreshold > 0
+			&& samplesTaken >= minSamples
+			&& (samplesTaken - minSamples) % checkInterval == 0;
+	}
+};
+
+// What a render needs besides the framebuffer to pick up where it left off
+struct RenderState {
+	SamplingConfig sampling;
+	// Every sample's random numbers come from this, its pixel and its
+	// number (see Sampler::startPixelSample())
+	uint64_t seed = 0;
+	int passesDone = 0;
+};
@@ -0,0 +1,537 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "camera.h"
+#include "color.h"
+#include "framebuffer.h"
+#include "hittable.h"
+#include "light.h"
+#include "material.h"
+#include "ray.h"
+#include "ray_packet.h"
+#include "render_config.h"
+#include "sampler.h"
+#include "stats.h"
+#include "tile_scheduler.h"
+#include "trace.h"
+#include "vec3.h"
+
+// The path tracer and the passes over the image that run it, shared by the
+// renderer and the benchmarks
+
+// Weight of a sample taken with density pdf, when the other strategy would
+// have taken it with otherPdf (Veach's power heuristic with beta = 2)
+inline real powerHeuristic(real pdf, real otherPdf) {
+	real squared = pdf * pdf;
+	real otherSquared = otherPdf * otherPdf;
+	if (squared + otherSquared == 0)
+		return 0;
+
+	return squared / (squared + otherSquared);
+}
+
+// Shadow ray of next event estimation, and the light it brings along the
+// path unless something blocks it. Trace it up to 1 - SHADOW_EPSILON.
+struct ShadowRay {
+	Ray ray;
+	color3 radiance;
+};
+
+// Shadow ray to a random point on the lights, through the bounce at record
+// (next event estimation). None if the light can't contribute anyway.
+// Weighted against the bounce itself finding the light, see advancePath().
+std::optional<ShadowRay> sampleDirectLight(
+	const LightList& lights,
+	const Ray& ray,
+	const HitRecord& record,
+	Sampler& sampler
+) {
+	auto light = lights.sample(record.intersection, sampler);
+	if (!(light.pdfArea > 0))
+		return {};
+
+	Ray shadowRay = record.spawnRayTo(light.point);
+	real distance = shadowRay.direction.magnitude();
+	if (distance == 0)
+		return {};
+
+	vec3 direction = shadowRay.direction / distance;
+	real lightCosine = std::abs(light.normal.dot(direction));
+	if (lightCosine == 0)
+		return {};
+
+	const Material& material = *record.materialPtr;
+	auto bsdf = material.evaluate(record, ray.direction, direction);
+	if (bsdf.maxComponent() <= 0)
+		return {};
+
+	// Area density to solid angle density
+	real lightPdf = light.pdfArea * distance * distance / lightCosine;
+	real bsdfPdf = material.pdf(record, ray.direction, direction);
+
+	return ShadowRay{
+		shadowRay, bsdf * light.emitted * (powerHeuristic(lightPdf, bsdfPdf) / lightPdf)
+	};
+}
+
+// Path between bounces.
+//
+// The path carries its throughput, the fraction of light that makes it
+// back to the camera through the bounces so far. Past russianRouletteStart
+// bounces, dim paths are ended at random and the ones that survive are
+// brightened to make up for it, so the expected color stays the same.
+//
+// Lights are found two ways: every non-specular bounce samples one
+// directly, and bounces can also hit them by chance. Multiple importance
+// sampling weighs the two so that each counts where it's less noisy.
+struct PathState {
+	color3 radiance = color3(0);
+	color3 throughput = color3(1);
+
+	// The camera ray counts as specular: nothing sampled lights before it
+	bool previousSpecular = true;
+	real previousPdf = 0;
+
+	// Also the number of rays traced so far
+	int bounce = 1;
+
+	// Last ray traced and what it hit
+	Ray ray;
+	std::optional<HitRecord> hit;
+};
+
+// Takes the path through the bounce at path.hit: adds what it sees there and
+// picks the next ray. shadow gets the direct light to add unless occluded,
+// if any. False when the path ends here.
+bool advancePath(
+	PathState& path,
+	const LightList& lights,
+	const color3& background,
+	const PathConfig& config,
+	Sampler& sampler,
+	std::optional<ShadowRay>& shadow
+) {
+	if (!path.hit) {
+		path.radiance += path.throughput * background;
+		return false;
+	}
+
+	const auto& record = path.hit.value();
+	auto emitted = record.materialPtr->emit();
+	if (emitted.maxComponent() > 0) {
+		real lightPdfArea = path.previousSpecular
+			? 0 : lights.pdfArea(
+				record.hittable, record.primitive, path.ray.origin, record.intersection
+			);
+
+		if (lightPdfArea == 0) {
+			path.radiance += path.throughput * emitted;
+		}
+		else {
+			real distance = record.t * path.ray.direction.magnitude();
+			real cosine = std::abs(record.normal.dot(path.ray.direction.unit()));
+			real lightPdf = lightPdfArea * distance * distance / cosine;
+			path.radiance += path.throughput * emitted * powerHeuristic(path.previousPdf, lightPdf);
+		}
+	}
+
+	if (path.bounce >= config.maxBounces)
+		return false;
+
+	auto scattered = record.materialPtr->scatter(path.ray, record, sampler);
+	if (!scattered)
+		return false;
+
+	if (!scattered.value().isSpecular && !lights.empty()) {
+		shadow = sampleDirectLight(lights, path.ray, record, sampler);
+		if (shadow)
+			shadow->radiance = path.throughput * shadow->radiance;
+	}
+
+	path.throughput *= scattered.value().attenuation;
+
+	if (path.bounce >= config.russianRouletteStart) {
+		// Capped so that even white paths end eventually
+		real survival = std::min<real>(path.throughput.maxComponent(), 0.95);
+		if (sampler.get1D() >= survival)
+			return false;
+		path.throughput /= survival;
+	}
+
+	path.previousSpecular = scattered.value().isSpecular;
+	path.previousPdf = scattered.value().pdf;
+
+	path.ray = scattered.value().outRay;
+	return true;
+}
+
+// Traces the ray picked by advancePath()
+void traceBounce(const Hittable& world, PathState& path, ThreadStats& stats) {
+	constexpr real INFTY = std::numeric_limits<real>::infinity();
+
+	// No epsilon against shadow acne: bounces start just off the surface
+	// (see HitRecord::spawnRay)
+	path.hit = world.hit(path.ray, 0, INFTY);
+	path.bounce++;
+	stats.bounceRays++;
+}
+
+// Carries on with a path whose last ray has been traced, one ray at a time,
+// until it ends. Returns its color.
+color3 finishPath(
+	const Hittable& world,
+	const LightList& lights,
+	const color3& background,
+	PathState& path,
+	const PathConfig& config,
+	Sampler& sampler,
+	ThreadStats& stats
+) {
+	while (true) {
+		std::optional<ShadowRay> shadow;
+		bool continues = advancePath(path, lights, background, config, sampler, shadow);
+
+		if (shadow) {
+			stats.shadowRays++;
+			if (!world.occluded(shadow->ray, 0, 1 - HitRecord::SHADOW_EPSILON))
+				path.radiance += shadow->radiance;
+		}
+
+		if (!continues)
+			break;
+
+		traceBounce(world, path, stats);
+	}
+
+	stats.addPathLength(path.bounce);
+	return path.radiance;
+}
+
+// Colors seen along the paths of the camera rays of a packet, whose
+// closest hits are in hits. The shadow rays of the first bounce start close together and
+// mostly head for the same lights, so they're traced as a packet too. After
+// that the paths go their own ways. Writes the colors to colors.
+void tracePacketPaths(
+	const Hittable& world,
+	const LightList& lights,
+	const color3& background,
+	const RayPacket& packet,
+	const PacketHits& hits,
+	const PathConfig& config,
+	Sampler* const samplers[],
+	ThreadStats& stats,
+	color3 colors[]
+) {
+	const int laneCount = packet.size;
+
+	if (config.maxBounces <= 0) {
+		for (int lane = 0; lane < laneCount; lane++) {
+			stats.addPathLength(1);
+			colors[lane] = color3(0);
+		}
+		return;
+	}
+
+	PathState paths[RayPacket::MAX_SIZE];
+	Ray shadowRays[RayPacket::MAX_SIZE];
+	color3 shadowRadiance[RayPacket::MAX_SIZE];
+	uint32_t shadowLanes = 0;
+	uint32_t continuingLanes = 0;
+
+	for (int lane = 0; lane < laneCount; lane++) {
+		auto& path = paths[lane];
+		path.ray = packet.ray(lane);
+		const auto& candidate = hits.candidates[lane];
+		if (candidate.hittable)
+			path.hit = world.finalize(path.ray, candidate);
+
+		std::optional<ShadowRay> shadow;
+		if (advancePath(path, lights, background, config, *samplers[lane], shadow))
+			continuingLanes |= 1u << lane;
+
+		if (shadow) {
+			shadowRays[lane] = shadow->ray;
+			shadowRadiance[lane] = shadow->radiance;
+			shadowLanes |= 1u << lane;
+		}
+	}
+
+	if (shadowLanes != 0) {
+		// Lanes without a shadow ray copy one that has, so they don't spoil
+		// the packet's bounds
+		int firstShadow = std::countr_zero(shadowLanes);
+		for (int lane = 0; lane < laneCount; lane++) {
+			if (!(shadowLanes & (1u << lane)))
+				shadowRays[lane] = shadowRays[firstShadow];
+		}
+
+		RayPacket shadowPacket(shadowRays, laneCount);
+		real tMax[RayPacket::MAX_SIZE];
+		std::fill(std::begin(tMax), std::end(tMax), 1 - HitRecord::SHADOW_EPSILON);
+
+		stats.shadowRays += std::popcount(shadowLanes);
+		uint32_t blocked = world.occludedPacket(shadowPacket, shadowLanes, 0, tMax);
+		forEachLane(shadowLanes & ~blocked, [&](int lane) {
+			paths[lane].radiance += shadowRadiance[lane];
+		});
+	}
+
+	for (int lane = 0; lane < laneCount; lane++) {
+		auto& path = paths[lane];
+		if (!(continuingLanes & (1u << lane))) {
+			stats.addPathLength(path.bounce);
+			colors[lane] = path.radiance;
+			continue;
+		}
+
+		traceBounce(world, path, stats);
+		colors[lane] = finishPath(
+			world, lights, background, path, config, *samplers[lane], stats
+		);
+	}
+}
+
+// Primary rays of a block of PACKET_WIDTH x PACKET_HEIGHT pixels are traced
+// together as one packet, and so are the shadow rays of their first bounce.
+// Bounces are traced one ray at a time, since they scatter in all
+// directions.
+constexpr int PACKET_WIDTH = 4;
+constexpr int PACKET_HEIGHT = 4;
+static_assert(PACKET_WIDTH * PACKET_HEIGHT <= RayPacket::MAX_SIZE);
+
+// Takes up to sampling.passSamples more samples for every block of pixels in
+// the tile that isn't finished yet. Returns how many samples it took.
+long long renderTile(
+	const Tile& tile,
+	const int width,
+	const int height,
+	const SamplingConfig& sampling,
+	const PathConfig& pathConfig,
+	const Hittable& world,
+	const LightList& lights,
+	const Camera& camera,
+	Framebuffer& framebuffer,
+	Sampler* const samplers[],
+	ThreadStats& stats
+) {
+	constexpr real INFTY = std::numeric_limits<real>::infinity();
+	const color3 background(0.5, 0.5, 0.8);
+
+	long long samplesTaken = 0;
+
+	for (int blockY = tile.y0; blockY < tile.y1; blockY += PACKET_HEIGHT) {
+		for (int blockX = tile.x0; blockX < tile.x1; blockX += PACKET_WIDTH) {
+
+			// Pixels of this block, clipped to the tile
+			int columns[RayPacket::MAX_SIZE];
+			int rows[RayPacket::MAX_SIZE];
+			int laneCount = 0;
+			for (int j = blockY; j < std::min(blockY + PACKET_HEIGHT, tile.y1); j++) {
+				for (int i = blockX; i < std::min(blockX + PACKET_WIDTH, tile.x1); i++) {
+					columns[laneCount] = i;
+					rows[laneCount] = j;
+					laneCount++;
+				}
+			}
+
+			// The block stops as a whole, on the RMS error of its pixels.
+			// Pixel by pixel, the ones that haven't run into a rare bright
+			// path yet look converged and stop, darkening the image.
+			auto blockError = [&]() {
+				double squaredErrors = 0;
+				for (int lane = 0; lane < laneCount; lane++) {
+					double error = framebuffer.displayError(columns[lane], rows[lane]);
+					squaredErrors += error * error;
+				}
+				return std::sqrt(squaredErrors / laneCount);
+			};
+
+			// Pixels of a block always get sampled together
+			int firstSample = framebuffer.sampleCount(blockX, blockY);
+			if (sampling.isFinished(firstSample, blockError()))
+				continue;
+
+			int lastSample = std::min(sampling.maxSamples, firstSample + sampling.passSamples);
+			for (int s = firstSample; s < lastSample; s++) {
+				Ray rays[RayPacket::MAX_SIZE];
+				for (int lane = 0; lane < laneCount; lane++) {
+					auto& sampler = *samplers[lane];
+					sampler.startPixelSample(columns[lane], rows[lane], s);
+
+					// Origin is at the bottom left corner
+					auto column = columns[lane];
+					auto row = height - rows[lane] - 1;
+					auto jitter = sampler.get2D();
+					auto u = double(column + jitter.u) / (width - 1);
+					auto v = double(row + jitter.v) / (height - 1);
+
+					rays[lane] = camera.rayFromUV(u, v, sampler.get2D());
+				}
+
+				RayPacket packet(rays, laneCount);
+				PacketHits hits(INFTY);
+				world.intersectPacket(packet, packet.allLanes(), 0, hits);
+
+				color3 colors[RayPacket::MAX_SIZE];
+				tracePacketPaths(
+					world, lights, background, packet, hits, pathConfig, samplers, stats, colors
+				);
+				for (int lane = 0; lane < laneCount; lane++)
+					framebuffer.addSample(columns[lane], rows[lane], colors[lane]);
+				samplesTaken += laneCount;
+				stats.cameraRays += laneCount;
+
+				if (sampling.isDue(s + 1) && blockError() <= sampling.errorThreshold)
+					break;
+			}
+		}
+	}
+
+	return samplesTaken;
+}
+
+void renderWorker(
+	const int worker,
+	TileScheduler& scheduler,
+	const int width,
+	const int height,
+	const RenderState& state,
+	const PathConfig& pathConfig,
+	const Hittable& world,
+	const LightList& lights,
+	const Camera& camera,
+	Framebuffer& framebuffer,
+	ThreadStats& stats,
+	std::atomic<int>& tilesDone,
+	std::atomic<long long>& samplesTaken
+) {
+	ThreadStats::current = &stats;
+	globalTracer.attachThread(worker + 1, "render " + std::to_string(worker));
+	TraceScope workerScope("worker");
+
+	// A sampler per packet lane, since each lane's path asks for its own
+	// dimensions
+	std::unique_ptr<Sampler> ownedSamplers[RayPacket::MAX_SIZE];
+	Sampler* samplers[RayPacket::MAX_SIZE];
+	for (int lane = 0; lane < RayPacket::MAX_SIZE; lane++) {
+		ownedSamplers[lane] = makeSampler(
+			state.sampling.sampler, state.seed, state.sampling.maxSamples
+		);
+		samplers[lane] = ownedSamplers[lane].get();
+	}
+
+	while (auto tile = scheduler.next(worker)) {
+		TraceScope tileScope("tile", "render", "x", tile.value().x0, "y", tile.value().y0);
+		auto start = std::chrono::steady_clock::now();
+		auto samples = renderTile(
+			tile.value(),
+			width,
+			height,
+			state.sampling,
+			pathConfig,
+			world,
+			lights,
+			camera,
+			framebuffer,
+			samplers,
+			stats
+		);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		stats.renderSeconds += elapsed.count();
+		stats.samples += samples;
+		stats.tiles++;
+		samplesTaken += samples;
+		tilesDone++;
+	}
+
+	ThreadStats::current = nullptr;
+	globalTracer.detachThread();
+}
+
+// One pass over the image (see renderTile()) on threadCount threads, which
+// count into the first threadCount ThreadStats of statistics.
+// Calls reportProgress(tilesDone, tileCount) every now and then until the
+// pass is done. Returns how many samples the pass took; none means the
+// render is finished.
+long long renderPass(
+	const int threadCount,
+	const int width,
+	const int height,
+	const RenderState& state,
+	const PathConfig& pathConfig,
+	const Hittable& world,
+	const LightList& lights,
+	const Camera& camera,
+	Framebuffer& framebuffer,
+	RenderStatistics& statistics,
+	const std::function<void(int, int)>& reportProgress = nullptr
+) {
+	if (threadCount > statistics.threadCount())
+		throw std::invalid_argument("More render threads than thread statistics");
+
+	TileScheduler scheduler(width, height, threadCount);
+	const int tileCount = static_cast<int>(scheduler.size());
+
+	std::vector<std::thread> threads;
+	std::atomic<int> tilesDone = 0;
+	std::atomic<long long> samplesTaken = 0;
+	threads.reserve(threadCount);
+
+	for (int i = 0; i < threadCount; i++) {
+		threads.push_back(
+			std::thread(
+				renderWorker,
+				// args
+				i,
+				std::ref(scheduler),
+				width,
+				height,
+				std::cref(state),
+				std::cref(pathConfig),
+				std::cref(world),
+				std::cref(lights),
+				std::cref(camera),
+				std::ref(framebuffer),
+				std::ref(statistics.thread(i)),
+				std::ref(tilesDone),
+				std::ref(samplesTaken)
+			)
+		);
+	}
+
+	if (reportProgress) {
+		auto lastReport = std::chrono::steady_clock::time_point();
+		while (tilesDone < tileCount) {
+			auto now = std::chrono::steady_clock::now();
+			if (now - lastReport >= std::chrono::milliseconds(100)) {
+				reportProgress(tilesDone.load(), tileCount);
+				lastReport = now;
+			}
+
+			// Report every 100 ms, but notice the end of the pass sooner,
+			// since passes can be short
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		}
+	}
+
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	return samplesTaken.load();
+}
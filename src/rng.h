@@ -1,14 +1,58 @@
 #pragma once
 
-#include <random>
+#include <cstdint>
 
+// Scrambles the bits of value so that nearby inputs give unrelated outputs
+// (the finalizer of SplitMix64)
+constexpr uint64_t mixBits(uint64_t value) {
+	value ^= value >> 30;
+	value *= 0xbf58476d1ce4e5b9ull;
+	value ^= value >> 27;
+	value *= 0x94d049bb133111ebull;
+	value ^= value >> 31;
+	return value;
+}
+
+// PCG32 (O'Neill, "PCG: A Family of Simple Fast Space-Efficient
+// Statistically Good Algorithms for Random Number Generation").
+// 16 bytes of state, so it's fine to make one per sample and to copy.
+//
+// Every seed and stream gives a different sequence. forSample() gives each
+// sample of each pixel a sequence of its own, which makes renders come out
+// the same no matter how the image is split between threads, tiles and
+// passes.
 class RandomNumberGenerator {
 public:
-	RandomNumberGenerator() : distribution(0.0, 1.0) {}
-	RandomNumberGenerator(int seed) : distribution(0.0, 1.0), engine(seed) {}
+	RandomNumberGenerator() : RandomNumberGenerator(DEFAULT_SEED) {}
+
+	RandomNumberGenerator(uint64_t seed, uint64_t stream = DEFAULT_STREAM) {
+		state = 0;
+		increment = (stream << 1) | 1;
+		next();
+		state += seed;
+		next();
+	}
+
+	// Sequence for one sample of a pixel
+	static RandomNumberGenerator forSample(uint64_t seed, int x, int y, int sample) {
+		uint64_t pixel = (uint64_t(uint32_t(y)) << 32) | uint32_t(x);
+		return RandomNumberGenerator(
+			mixBits(seed ^ mixBits(uint32_t(sample))), mixBits(pixel ^ seed)
+		);
+	}
 
+	uint32_t next() {
+		uint64_t previous = state;
+		state = previous * MULTIPLIER + increment;
+
+		uint32_t shifted = static_cast<uint32_t>(((previous >> 18) ^ previous) >> 27);
+		uint32_t rotation = static_cast<uint32_t>(previous >> 59);
+		return (shifted >> rotation) | (shifted << ((~rotation + 1) & 31));
+	}
+
+	// In [0, 1), in steps of 2^-32
 	double randomDouble() {
-		return distribution(engine);
+		return next() * 0x1p-32;
 	}
 
 	double randomDouble(double min, double max) {
@@ -21,6 +65,10 @@ public:
 	}
 
 private:
-	std::uniform_real_distribution<double> distribution;
-	std::mt19937 engine;
-};
\ No newline at end of file
+	static constexpr uint64_t MULTIPLIER = 6364136223846793005ull;
+	static constexpr uint64_t DEFAULT_SEED = 0x853c49e6748fea9bull;
+	static constexpr uint64_t DEFAULT_STREAM = 0xda3e39cb94b95bdbull;
+
+	uint64_t state;
+	uint64_t increment;
+};
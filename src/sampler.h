@@ -0,0 +1,368 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "commons.h"
+#include "rng.h"
+
+struct Sample2D {
+	real u, v;
+};
+
+// Supplies the random numbers of a sample, one dimension at a time: the
+// pixel jitter, the lens, then each bounce's light and direction and so on.
+//
+// Samplers other than the independent one place the values of a dimension
+// so that they cover [0, 1) more evenly than uniform randoms, across the
+// samples of a pixel, which makes pixels converge faster. For that the
+// values of a 2D decision (a direction, a point on a light) should be taken
+// together with get2D().
+class Sampler {
+public:
+	virtual ~Sampler() {}
+
+	// Starts sample number index of pixel (x, y), back at the first dimension
+	virtual void startPixelSample(int x, int y, int index) = 0;
+
+	// The next dimension(s), in [0, 1)
+	virtual real get1D() = 0;
+	virtual Sample2D get2D() = 0;
+
+protected:
+	// Largest real below 1
+	static constexpr real ONE_MINUS_EPSILON = 1 - std::numeric_limits<real>::epsilon() / 2;
+
+	static real toUnit(uint32_t bits) {
+		return std::min<real>(real(bits * 0x1p-32), ONE_MINUS_EPSILON);
+	}
+
+	static uint32_t hash(uint64_t a, uint64_t b) {
+		return static_cast<uint32_t>(mixBits(a ^ mixBits(b)));
+	}
+};
+
+// Plain uniform randoms, every dimension independent of the others
+class IndependentSampler : public Sampler {
+public:
+	IndependentSampler(uint64_t seed) : seed(seed) {}
+
+	virtual void startPixelSample(int x, int y, int index) override {
+		rng = RandomNumberGenerator::forSample(seed, x, y, index);
+	}
+
+	virtual real get1D() override {
+		return toUnit(rng.next());
+	}
+
+	virtual Sample2D get2D() override {
+		real u = get1D();
+		real v = get1D();
+		return Sample2D{ u, v };
+	}
+
+private:
+	uint64_t seed;
+	RandomNumberGenerator rng;
+};
+
+// Jittered strata: every dimension is split into samplesPerPixel strata
+// (a grid of about as many cells in 2D), and the samples of a pixel visit
+// them in a random order with a random point in each.
+//
+// A pixel that stops early has visited a random subset of the strata, so
+// adaptive sampling stays unbiased. Past samplesPerPixel samples, the strata
+// are visited again in another order.
+class StratifiedSampler : public Sampler {
+public:
+	StratifiedSampler(uint64_t seed, int samplesPerPixel) :
+		seed(seed),
+		strata1D(std::max(samplesPerPixel, 1)),
+		strataPerAxis(static_cast<int>(std::ceil(std::sqrt(double(strata1D))))) {}
+
+	virtual void startPixelSample(int x, int y, int index) override {
+		pixelSeed = hash(seed, (uint64_t(uint32_t(y)) << 32) | uint32_t(x));
+		sampleIndex = index;
+		dimension = 0;
+		jitter = RandomNumberGenerator::forSample(seed, x, y, index);
+	}
+
+	virtual real get1D() override {
+		uint32_t stratum = stratumOf(strata1D);
+		return std::min<real>(
+			(stratum + real(jitter.randomDouble())) / strata1D, ONE_MINUS_EPSILON
+		);
+	}
+
+	virtual Sample2D get2D() override {
+		uint32_t stratum = stratumOf(strataPerAxis * strataPerAxis);
+		uint32_t column = stratum % strataPerAxis;
+		uint32_t row = stratum / strataPerAxis;
+
+		real u = (column + real(jitter.randomDouble())) / strataPerAxis;
+		real v = (row + real(jitter.randomDouble())) / strataPerAxis;
+		return Sample2D{
+			std::min<real>(u, ONE_MINUS_EPSILON), std::min<real>(v, ONE_MINUS_EPSILON)
+		};
+	}
+
+private:
+	uint64_t seed;
+	uint32_t strata1D;
+	uint32_t strataPerAxis;
+
+	uint32_t pixelSeed = 0;
+	int sampleIndex = 0;
+	int dimension = 0;
+	RandomNumberGenerator jitter;
+
+	// Stratum of the current sample in the next dimension, out of count
+	uint32_t stratumOf(uint32_t count) {
+		uint32_t round = sampleIndex / count;
+		uint32_t permutationSeed = hash(pixelSeed, (uint64_t(round) << 32) | dimension++);
+		return permute(sampleIndex % count, count, permutationSeed);
+	}
+
+	// Position of i in a random permutation of [0, length) picked by seed,
+	// without building the permutation (Kensler, "Correlated Multi-Jittered
+	// Sampling")
+	static uint32_t permute(uint32_t i, uint32_t length, uint32_t seed) {
+		uint32_t mask = length - 1;
+		mask |= mask >> 1;
+		mask |= mask >> 2;
+		mask |= mask >> 4;
+		mask |= mask >> 8;
+		mask |= mask >> 16;
+
+		do {
+			i ^= seed;
+			i *= 0xe170893d;
+			i ^= seed >> 16;
+			i ^= (i & mask) >> 4;
+			i ^= seed >> 8;
+			i *= 0x0929eb3f;
+			i ^= seed >> 23;
+			i ^= (i & mask) >> 1;
+			i *= 1 | seed >> 27;
+			i *= 0x6935fa69;
+			i ^= (i & mask) >> 11;
+			i *= 0x74dcb303;
+			i ^= (i & mask) >> 2;
+			i *= 0x9e501cc3;
+			i ^= (i & mask) >> 2;
+			i *= 0xc860a3df;
+			i &= mask;
+			i ^= i >> 5;
+		} while (i >= length);
+
+		return (i + seed) % length;
+	}
+};
+
+// Tables for SobolSampler::sobol1(): tables[k][byte] is sobol1() of byte
+// shifted left by 8k bits. The direction numbers come from the polynomial
+// x + 1: each is the previous one xor itself shifted by one.
+constexpr std::array<std::array<uint32_t, 256>, 4> makeSobol1Tables() {
+	uint32_t directions[32] = {};
+	directions[0] = 1u << 31;
+	for (int bit = 1; bit < 32; bit++)
+		directions[bit] = directions[bit - 1] ^ (directions[bit - 1] >> 1);
+
+	std::array<std::array<uint32_t, 256>, 4> tables = {};
+	for (int k = 0; k < 4; k++) {
+		for (uint32_t byte = 0; byte < 256; byte++) {
+			uint32_t result = 0;
+			for (int bit = 0; bit < 8; bit++) {
+				if (byte & (1u << bit))
+					result ^= directions[8 * k + bit];
+			}
+			tables[k][byte] = result;
+		}
+	}
+	return tables;
+}
+
+// The first two dimensions of the Sobol sequence, with the hash based Owen
+// scrambling from Burley, "Practical Hash-based Owen Scrambling" (2020).
+//
+// Only two Sobol dimensions are used, and every 2D request gets them with
+// its own scrambling and its own shuffled order of samples ("padding"), so
+// there's no limit on the number of dimensions and no table of direction
+// numbers.
+class SobolSampler : public Sampler {
+public:
+	SobolSampler(uint64_t seed) : seed(seed) {}
+
+	virtual void startPixelSample(int x, int y, int index) override {
+		pixelSeed = hash(seed, (uint64_t(uint32_t(y)) << 32) | uint32_t(x));
+		sampleIndex = static_cast<uint32_t>(index);
+		dimension = 0;
+	}
+
+	virtual real get1D() override {
+		uint32_t dimensionSeed = hash(pixelSeed, dimension++);
+		uint32_t index = nestedUniformScramble(sampleIndex, dimensionSeed);
+		return toUnit(nestedUniformScramble(sobol0(index), hash(dimensionSeed, 1)));
+	}
+
+	virtual Sample2D get2D() override {
+		uint32_t dimensionSeed = hash(pixelSeed, dimension++);
+		uint32_t index = nestedUniformScramble(sampleIndex, dimensionSeed);
+		return Sample2D{
+			toUnit(nestedUniformScramble(sobol0(index), hash(dimensionSeed, 1))),
+			toUnit(nestedUniformScramble(sobol1(index), hash(dimensionSeed, 2)))
+		};
+	}
+
+	// The first dimension is the van der Corput sequence
+	static uint32_t sobol0(uint32_t index) {
+		return reverseBits(index);
+	}
+
+	// The second dimension xors together the direction numbers of index's
+	// set bits. The scrambled indices use all 32 bits, so that's done a
+	// byte at a time from tables instead of a bit at a time.
+	static uint32_t sobol1(uint32_t index) {
+		static constexpr auto tables = makeSobol1Tables();
+		return tables[0][index & 0xff]
+			^ tables[1][(index >> 8) & 0xff]
+			^ tables[2][(index >> 16) & 0xff]
+			^ tables[3][index >> 24];
+	}
+
+	// A random Owen scrambling of x's bits, picked by seed
+	static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+		x = reverseBits(x);
+		// Laine and Karras' permutation, with Burley's constants
+		x += seed;
+		x ^= x * 0x6c50b47cu;
+		x ^= x * 0xb82f1e52u;
+		x ^= x * 0xc7afe638u;
+		x ^= x * 0x8d22f6e6u;
+		return reverseBits(x);
+	}
+
+private:
+	uint64_t seed;
+
+	uint32_t pixelSeed = 0;
+	uint32_t sampleIndex = 0;
+	uint32_t dimension = 0;
+
+	static uint32_t reverseBits(uint32_t x) {
+		x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+		x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+		x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+		x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+		return (x >> 16) | (x << 16);
+	}
+};
+
+// Blue noise dithered sampling (Georgiev and Fajardo, 2016): every pixel
+// gets the same scrambled Sobol points, shifted around [0, 1) by a dither
+// mask. Neighbouring pixels get very different shifts, which turns the
+// error into high frequency noise that looks finer at low sample counts.
+//
+// The mask is Roberts' R2 sequence over the pixel grid instead of a blue
+// noise texture. It has close to blue noise spectrum and needs no data file.
+// Each dimension reads it at its own offset.
+class BlueNoiseSampler : public Sampler {
+public:
+	BlueNoiseSampler(uint64_t seed) : seed(seed) {}
+
+	virtual void startPixelSample(int x, int y, int index) override {
+		pixelX = static_cast<uint32_t>(x);
+		pixelY = static_cast<uint32_t>(y);
+		sampleIndex = static_cast<uint32_t>(index);
+		dimension = 0;
+	}
+
+	virtual real get1D() override {
+		uint32_t dimensionSeed = hash(seed, dimension++);
+		uint32_t index = SobolSampler::nestedUniformScramble(sampleIndex, dimensionSeed);
+		uint32_t value = SobolSampler::nestedUniformScramble(
+			SobolSampler::sobol0(index), hash(dimensionSeed, 1)
+		);
+		return toUnit(value + mask(dimensionSeed));
+	}
+
+	virtual Sample2D get2D() override {
+		uint32_t dimensionSeed = hash(seed, dimension++);
+		uint32_t index = SobolSampler::nestedUniformScramble(sampleIndex, dimensionSeed);
+		uint32_t u = SobolSampler::nestedUniformScramble(
+			SobolSampler::sobol0(index), hash(dimensionSeed, 1)
+		);
+		uint32_t v = SobolSampler::nestedUniformScramble(
+			SobolSampler::sobol1(index), hash(dimensionSeed, 2)
+		);
+		// Adding in 32-bit fixed point wraps around, which is the shift
+		return Sample2D{
+			toUnit(u + mask(hash(dimensionSeed, 3))),
+			toUnit(v + mask(hash(dimensionSeed, 4)))
+		};
+	}
+
+private:
+	uint64_t seed;
+
+	uint32_t pixelX = 0, pixelY = 0;
+	uint32_t sampleIndex = 0;
+	uint32_t dimension = 0;
+
+	// R2 mask at the pixel, as 32-bit fixed point, with the grid moved by
+	// an offset from offsetSeed
+	uint32_t mask(uint32_t offsetSeed) const {
+		// 2^32 / plastic number and 2^32 / plastic number squared
+		constexpr uint32_t ALPHA_X = 3242174889u;
+		constexpr uint32_t ALPHA_Y = 2447445414u;
+
+		uint32_t x = pixelX + (offsetSeed & 0xffff);
+		uint32_t y = pixelY + (offsetSeed >> 16);
+		return x * ALPHA_X + y * ALPHA_Y + (1u << 31);
+	}
+};
+
+enum class SamplerType : int32_t {
+	Independent,
+	Stratified,
+	Sobol,
+	BlueNoise
+};
+
+// One sampler per ray of a packet, so they're made by the renderer
+std::unique_ptr<Sampler> makeSampler(
+	SamplerType type, uint64_t seed, int samplesPerPixel
+) {
+	switch (type) {
+	case SamplerType::Independent:
+		return std::make_unique<IndependentSampler>(seed);
+	case SamplerType::Stratified:
+		return std::make_unique<StratifiedSampler>(seed, samplesPerPixel);
+	case SamplerType::Sobol:
+		return std::make_unique<SobolSampler>(seed);
+	case SamplerType::BlueNoise:
+		return std::make_unique<BlueNoiseSampler>(seed);
+	}
+
+	throw std::invalid_argument("Unknown sampler type");
+}
+
+SamplerType samplerTypeFromName(const std::string& name) {
+	if (name == "independent")
+		return SamplerType::Independent;
+	if (name == "stratified")
+		return SamplerType::Stratified;
+	if (name == "sobol")
+		return SamplerType::Sobol;
+	if (name == "bluenoise")
+		return SamplerType::BlueNoise;
+
+	throw std::invalid_argument("Unknown sampler " + name);
+}
@@ -13,6 +13,7 @@
 class Scene {
 public:
 	Scene() {}
+	virtual ~Scene() {}
 
 	virtual HittableList build() = 0;
 	virtual Camera makeCamera(double aspectRatio) = 0;
@@ -28,10 +29,10 @@ public:
 	virtual HittableList build() override {
 		HittableList world;
 
-		auto materialGround = std::make_shared<LambertianDiffuse>(color3(0.8, 0.8, 0.0));
-		auto materialCenter = std::make_shared<LambertianDiffuse>(color3(0.1, 0.2, 0.5));
-		auto materialLeft = std::make_shared<Dielectric>(1.5);
-		auto materialRight = std::make_shared<Metal>(color3(0.8, 0.6, 0.2), 0.0);
+		auto materialGround = world.materials.make<LambertianDiffuse>(color3(0.8, 0.8, 0.0));
+		auto materialCenter = world.materials.make<LambertianDiffuse>(color3(0.1, 0.2, 0.5));
+		auto materialLeft = world.materials.make<Dielectric>(1.5);
+		auto materialRight = world.materials.make<Metal>(color3(0.8, 0.6, 0.2), 0.0);
 
 
 		world.addMany({
@@ -66,7 +67,7 @@ public:
 	virtual HittableList build() override {
 		HittableList world;
 
-		auto ground_material = std::make_shared<LambertianDiffuse>(color3(0.5, 0.5, 0.5));
+		auto ground_material = world.materials.make<LambertianDiffuse>(color3(0.5, 0.5, 0.5));
 		world.add(std::make_shared<Sphere>(point3(0, -1000, 0), 1000, ground_material));
 
 		for (int a = -11; a < 11; a++) {
@@ -79,37 +80,37 @@ public:
 				);
 
 				if ((center - point3(4, 0.2, 0)).magnitude() > 0.9) {
-					std::shared_ptr<Material> sphereMaterial;
+					const Material* sphereMaterial;
 
 					if (chooseMaterial < 0.8) {
 						// diffuse
 						auto albedo = color3::random(globalRng) * color3::random(globalRng);
-						sphereMaterial = std::make_shared<LambertianDiffuse>(albedo);
+						sphereMaterial = world.materials.make<LambertianDiffuse>(albedo);
 						world.add(std::make_shared<Sphere>(center, 0.2, sphereMaterial));
 					}
 					else if (chooseMaterial < 0.95) {
 						// metal
 						auto albedo = color3::random(globalRng, 0.5, 1);
 						auto fuzz = globalRng.randomDouble(0, 0.5);
-						sphereMaterial = std::make_shared<Metal>(albedo, fuzz);
+						sphereMaterial = world.materials.make<Metal>(albedo, fuzz);
 						world.add(std::make_shared<Sphere>(center, 0.2, sphereMaterial));
 					}
 					else {
 						// glass
-						sphereMaterial = std::make_shared<Dielectric>(1.5);
+						sphereMaterial = world.materials.make<Dielectric>(1.5);
 						world.add(std::make_shared<Sphere>(center, 0.2, sphereMaterial));
 					}
 				}
 			}
 		}
 
-		auto material1 = std::make_shared<Dielectric>(1.5);
+		auto material1 = world.materials.make<Dielectric>(1.5);
 		world.add(std::make_shared<Sphere>(point3(0, 1, 0), 1.0, material1));
 
-		auto material2 = std::make_shared<LambertianDiffuse>(color3(0.4, 0.2, 0.1));
+		auto material2 = world.materials.make<LambertianDiffuse>(color3(0.4, 0.2, 0.1));
 		world.add(std::make_shared<Sphere>(point3(-4, 1, 0), 1.0, material2));
 
-		auto material3 = std::make_shared<Metal>(color3(0.7, 0.6, 0.5), 0.0);
+		auto material3 = world.materials.make<Metal>(color3(0.7, 0.6, 0.5), 0.0);
 		world.add(std::make_shared<Sphere>(point3(4, 1, 0), 1.0, material3));
 
 		return world;
@@ -169,11 +170,11 @@ public:
 					6, 7, 11, 6, 11, 10, // right eave
 					5, 6, 10, 10, 9, 5   // back eave 
 				},
-				std::initializer_list<std::shared_ptr<Material>> {
-					std::make_shared<LambertianDiffuse>(color3(0.73)),
-					std::make_shared<LambertianDiffuse>(color3(1, 0, 0)),
-					std::make_shared<LambertianDiffuse>(color3(0, 1, 0)),
-					std::make_shared<DiffuseLight>(color3(1) * 15.0)
+				std::initializer_list<const Material*> {
+					world.materials.make<LambertianDiffuse>(color3(0.73)),
+					world.materials.make<LambertianDiffuse>(color3(1, 0, 0)),
+					world.materials.make<LambertianDiffuse>(color3(0, 1, 0)),
+					world.materials.make<DiffuseLight>(color3(1) * 15.0)
 				},
 				std::initializer_list<int> {
 					0, 0, // bottom face
@@ -191,17 +192,17 @@ public:
 			std::make_shared<Sphere>(
 				point3(-0.5, -0.65, 0.1),
 				0.35,
-				std::make_shared<Metal>(color3(0, 0.2, 0.8), 0.8)
+				world.materials.make<Metal>(color3(0, 0.2, 0.8), 0.8)
 			),
 			std::make_shared<Sphere>(
 				point3(0.4, -0.5, 0.3),
 				0.5,
-				std::make_shared<LambertianDiffuse>(color3(0.4, 0.1, 0))
+				world.materials.make<LambertianDiffuse>(color3(0.4, 0.1, 0))
 			),
 			std::make_shared<Sphere>(
 				point3(0, -0.6, -0.2),
 				0.4,
-				std::make_shared<Dielectric>(1.250)
+				world.materials.make<Dielectric>(1.250)
 			)
 		});
 
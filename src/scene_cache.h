@@ -0,0 +1,430 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <stdio.h>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "bounding_box.h"
+#include "commons.h"
+#include "hittable.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "mesh.h"
+#include "scene_file.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "wide_bounding_volume_hierarchy.h"
+
+// Built scenes saved to disk: materials, spheres, meshes with their
+// triangle BVHs, and the BVH over the whole scene. Loading one skips
+// building the scene and every BVH in it, e.g. for farm jobs rendering the
+// same scene from different cameras.
+//
+// The file is a header and then flat arrays, each starting on a 64 byte
+// boundary and found by where it is in the file rather than by pointers,
+// so the file can be memory-mapped as is. The structures of the renderer
+// own their memory, so each array is then copied out of the mapping in one
+// go.
+//
+// A cache only fits the build that wrote it: the version, the precision of
+// real and the BVH width are checked along with the key.
+constexpr uint32_t SCENE_CACHE_VERSION = 1;
+
+using SceneBvh = WideBoundingVolumeHierarchy<DEFAULT_BVH_WIDTH>;
+
+// FNV-1a, 64 bits
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+	auto bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// Key of the cache of a scene file, from its geometry and materials. The
+// camera can change without a rebuild.
+uint64_t sceneCacheKey(const SceneFile& scene) {
+	const std::string& source = scene.getGeometrySource();
+	uint32_t build[3] = { SCENE_CACHE_VERSION, sizeof(real), DEFAULT_BVH_WIDTH };
+
+	uint64_t hash = hashBytes(build, sizeof(build));
+	return hashBytes(source.data(), source.size(), hash);
+}
+
+// Cache file of key in directory
+std::string sceneCachePath(const std::string& directory, uint64_t key) {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.scenecache", static_cast<unsigned long long>(key));
+	return (std::filesystem::path(directory) / name).string();
+}
+
+struct SceneCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t realSize;
+	uint32_t bvhWidth;
+	uint32_t padding;
+	uint64_t key;
+};
+
+constexpr char SCENE_CACHE_MAGIC[8] = { 'W', 'R', 'S', 'C', 'E', 'N', 'E', '\0' };
+
+enum class CachedMaterialType : uint32_t { Lambertian, Metal, Dielectric, Light };
+
+struct CachedMaterial {
+	CachedMaterialType type;
+	uint32_t padding;
+	real color[3];
+	// Fuzz of metals, index of refraction of dielectrics
+	real parameter;
+};
+
+enum class CachedObjectType : uint32_t { Sphere, Mesh };
+
+// Hittable of the scene, in the order of the scene BVH's leaves. Meshes
+// keep their arrays after the scene's, in the same order.
+struct CachedObject {
+	CachedObjectType type;
+	// Of spheres
+	uint32_t material;
+	real center[3];
+	real radius;
+};
+
+class SceneCacheWriter {
+public:
+	SceneCacheWriter(const std::string& path) : file(path, std::ios::binary) {
+		if (!file.is_open())
+			throw std::runtime_error("Can't open " + path);
+	}
+
+	template<typename T>
+	void write(const T& value) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		writeBytes(&value, sizeof(T));
+	}
+
+	// Count, then the values from the next 64 byte boundary
+	template<typename T>
+	void writeArray(const T* values, size_t count) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		write<uint64_t>(count);
+
+		static const char zeros[64] = {};
+		writeBytes(zeros, (64 - offset % 64) % 64);
+		writeBytes(values, count * sizeof(T));
+	}
+
+	template<typename T>
+	void writeArray(const std::vector<T>& values) {
+		writeArray(values.data(), values.size());
+	}
+
+	void writeBox(const BoundingBox& box) {
+		real corners[6];
+		for (int axis = 0; axis < 3; axis++) {
+			corners[axis] = box.cornerMin[axis];
+			corners[3 + axis] = box.cornerMax[axis];
+		}
+		write(corners);
+	}
+
+	void close(const std::string& path) {
+		file.close();
+		if (!file)
+			throw std::runtime_error("Error writing " + path);
+	}
+
+private:
+	std::ofstream file;
+	size_t offset = 0;
+
+	void writeBytes(const void* bytes, size_t size) {
+		file.write(static_cast<const char*>(bytes), size);
+		offset += size;
+	}
+};
+
+class SceneCacheReader {
+public:
+	SceneCacheReader(const char* data, size_t size, std::string path) :
+		data(data), size(size), path(std::move(path)) {}
+
+	template<typename T>
+	T read() {
+		static_assert(std::is_trivially_copyable_v<T>);
+		T value;
+		std::memcpy(&value, take(sizeof(T)), sizeof(T));
+		return value;
+	}
+
+	template<typename T>
+	std::vector<T> readArray() {
+		static_assert(std::is_trivially_copyable_v<T>);
+		uint64_t count = read<uint64_t>();
+		take((64 - offset % 64) % 64);
+
+		if (count > (size - offset) / sizeof(T))
+			fail();
+
+		std::vector<T> values(count);
+		if (count > 0)
+			std::memcpy(values.data(), take(count * sizeof(T)), count * sizeof(T));
+		return values;
+	}
+
+	BoundingBox readBox() {
+		auto corners = read<std::array<real, 6>>();
+		BoundingBox box;
+		for (int axis = 0; axis < 3; axis++) {
+			box.cornerMin[axis] = corners[axis];
+			box.cornerMax[axis] = corners[3 + axis];
+		}
+		return box;
+	}
+
+	[[noreturn]] void fail() const {
+		throw std::runtime_error(path + " is damaged");
+	}
+
+private:
+	const char* data;
+	size_t size;
+	std::string path;
+	size_t offset = 0;
+
+	const char* take(size_t bytes) {
+		if (bytes > size - offset)
+			fail();
+		const char* at = data + offset;
+		offset += bytes;
+		return at;
+	}
+};
+
+// Saves world, made of spheres and meshes, to path. The file appears
+// whole or not at all, so jobs sharing a cache never see half of one.
+// Throws std::runtime_error if it can't, e.g. for other kinds of hittables.
+void saveSceneCache(const std::string& path, uint64_t key, const SceneBvh& world) {
+	// Materials in order of first use
+	std::vector<CachedMaterial> materials;
+	std::unordered_map<const Material*, uint32_t> materialIds;
+	auto materialId = [&](const Material* material) {
+		auto [found, isNew] = materialIds.try_emplace(
+			material, static_cast<uint32_t>(materials.size())
+		);
+		if (!isNew)
+			return found->second;
+
+		CachedMaterial cached = {};
+		color3 color;
+		if (auto lambertian = dynamic_cast<const LambertianDiffuse*>(material)) {
+			cached.type = CachedMaterialType::Lambertian;
+			color = lambertian->albedo;
+		}
+		else if (auto metal = dynamic_cast<const Metal*>(material)) {
+			cached.type = CachedMaterialType::Metal;
+			color = metal->albedo;
+			cached.parameter = metal->fuzz;
+		}
+		else if (auto dielectric = dynamic_cast<const Dielectric*>(material)) {
+			cached.type = CachedMaterialType::Dielectric;
+			cached.parameter = dielectric->ior;
+		}
+		else if (auto light = dynamic_cast<const DiffuseLight*>(material)) {
+			cached.type = CachedMaterialType::Light;
+			color = light->color;
+		}
+		else {
+			throw std::runtime_error("Can't cache a scene with this kind of material");
+		}
+
+		for (int channel = 0; channel < 3; channel++)
+			cached.color[channel] = color[channel];
+		materials.push_back(cached);
+		return found->second;
+	};
+
+	std::vector<CachedObject> objects;
+	std::vector<const Mesh*> meshes;
+	std::vector<std::vector<uint32_t>> meshMaterials;
+	for (const auto& hittable : world.getHittables()) {
+		CachedObject object = {};
+
+		if (auto sphere = dynamic_cast<const Sphere*>(hittable.get())) {
+			object.type = CachedObjectType::Sphere;
+			object.material = materialId(sphere->materialPtr);
+			for (int axis = 0; axis < 3; axis++)
+				object.center[axis] = sphere->center[axis];
+			object.radius = sphere->radius;
+		}
+		else if (auto mesh = dynamic_cast<const Mesh*>(hittable.get())) {
+			object.type = CachedObjectType::Mesh;
+			meshes.push_back(mesh);
+			meshMaterials.emplace_back();
+			for (auto material : mesh->getMaterialPtrs())
+				meshMaterials.back().push_back(materialId(material));
+		}
+		else {
+			throw std::runtime_error("Can't cache a scene with this kind of hittable");
+		}
+
+		objects.push_back(object);
+	}
+
+	std::filesystem::path finalPath(path);
+	if (finalPath.has_parent_path())
+		std::filesystem::create_directories(finalPath.parent_path());
+
+	// Written next to the cache and renamed over it once complete
+	std::string temporaryPath = path + "." + std::to_string(std::random_device()()) + ".tmp";
+	try {
+		SceneCacheWriter writer(temporaryPath);
+
+		SceneCacheHeader header = {};
+		std::memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic));
+		header.version = SCENE_CACHE_VERSION;
+		header.realSize = sizeof(real);
+		header.bvhWidth = DEFAULT_BVH_WIDTH;
+		header.key = key;
+		writer.write(header);
+
+		writer.writeArray(materials);
+		writer.writeArray(objects);
+		writer.writeArray(world.getTree().nodes);
+		writer.writeBox(world.getTree().boundingBox());
+
+		for (size_t i = 0; i < meshes.size(); i++) {
+			writer.writeArray(meshMaterials[i]);
+			writer.writeArray(meshes[i]->getMaterialIndices());
+			writer.writeArray(meshes[i]->getTriangleTree().nodes);
+			writer.writeBox(meshes[i]->getTriangleTree().boundingBox());
+			for (int array = 0; array < TriangleArray::ARRAY_COUNT; array++)
+				writer.writeArray(meshes[i]->getTriangles().array(array));
+		}
+
+		writer.close(temporaryPath);
+		std::filesystem::rename(temporaryPath, path);
+	}
+	catch (...) {
+		std::error_code error;
+		std::filesystem::remove(temporaryPath, error);
+		throw;
+	}
+}
+
+// Loads the scene cached at path, with its materials going into materials.
+// Returns nothing if there's no cache there or it's of another scene or
+// build, and throws std::runtime_error if it's damaged.
+std::optional<SceneBvh> loadSceneCache(
+	const std::string& path, uint64_t key, MaterialTable& materials
+) {
+	if (!std::filesystem::exists(path))
+		return std::nullopt;
+
+	MappedFile file(path);
+	SceneCacheReader reader(file.data(), file.size(), path);
+
+	if (file.size() < sizeof(SceneCacheHeader))
+		return std::nullopt;
+	auto header = reader.read<SceneCacheHeader>();
+	if (std::memcmp(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic)) != 0
+		|| header.version != SCENE_CACHE_VERSION
+		|| header.realSize != sizeof(real)
+		|| header.bvhWidth != DEFAULT_BVH_WIDTH
+		|| header.key != key)
+		return std::nullopt;
+
+	std::vector<const Material*> materialPtrs;
+	for (const auto& cached : reader.readArray<CachedMaterial>()) {
+		color3 color(cached.color[0], cached.color[1], cached.color[2]);
+		switch (cached.type) {
+		case CachedMaterialType::Lambertian:
+			materialPtrs.push_back(materials.make<LambertianDiffuse>(color));
+			break;
+		case CachedMaterialType::Metal:
+			materialPtrs.push_back(materials.make<Metal>(color, cached.parameter));
+			break;
+		case CachedMaterialType::Dielectric:
+			materialPtrs.push_back(materials.make<Dielectric>(cached.parameter));
+			break;
+		case CachedMaterialType::Light:
+			materialPtrs.push_back(materials.make<DiffuseLight>(color));
+			break;
+		default:
+			reader.fail();
+		}
+	}
+
+	auto material = [&](uint32_t id) {
+		if (id >= materialPtrs.size())
+			reader.fail();
+		return materialPtrs[id];
+	};
+
+	auto objects = reader.readArray<CachedObject>();
+	auto sceneNodes = reader.readArray<WideBvhNode<DEFAULT_BVH_WIDTH>>();
+	auto sceneBox = reader.readBox();
+
+	std::vector<std::shared_ptr<Hittable>> hittables;
+	hittables.reserve(objects.size());
+	for (const auto& object : objects) {
+		if (object.type == CachedObjectType::Sphere) {
+			point3 center(object.center[0], object.center[1], object.center[2]);
+			hittables.push_back(std::make_shared<Sphere>(
+				center, object.radius, material(object.material)
+			));
+			continue;
+		}
+		if (object.type != CachedObjectType::Mesh)
+			reader.fail();
+
+		std::vector<const Material*> meshMaterials;
+		for (auto id : reader.readArray<uint32_t>())
+			meshMaterials.push_back(material(id));
+
+		auto materialIndices = reader.readArray<int>();
+		auto nodes = reader.readArray<WideBvhNode<DEFAULT_BVH_WIDTH>>();
+		auto box = reader.readBox();
+
+		TriangleArray triangles;
+		for (int array = 0; array < TriangleArray::ARRAY_COUNT; array++) {
+			triangles.array(array) = reader.readArray<real>();
+			if (triangles.array(array).size() != materialIndices.size())
+				reader.fail();
+		}
+
+		for (int index : materialIndices) {
+			if (index < 0 || size_t(index) >= meshMaterials.size())
+				reader.fail();
+		}
+
+		WideBvhTree<DEFAULT_BVH_WIDTH> tree(std::move(nodes), box);
+		if (!tree.isValid(materialIndices.size()))
+			reader.fail();
+
+		hittables.push_back(std::make_shared<Mesh>(
+			std::move(tree),
+			std::move(triangles), std::move(meshMaterials), std::move(materialIndices)
+		));
+	}
+
+	// Traversal trusts the nodes, damaged ones would send it anywhere
+	WideBvhTree<DEFAULT_BVH_WIDTH> sceneTree(std::move(sceneNodes), sceneBox);
+	if (!sceneTree.isValid(hittables.size()))
+		reader.fail();
+
+	return SceneBvh(std::move(sceneTree), std::move(hittables));
+}
@@ -0,0 +1,530 @@
+#pragma once
+
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "animation.h"
+#include "camera.h"
+#include "commons.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "mesh.h"
+#include "mesh_loader.h"
+#include "scene.h"
+#include "sphere.h"
+#include "vec3.h"
+
+// Scene read from a text file, so scenes can change without a rebuild.
+//
+// Every line is a statement, and # starts a comment:
+//
+//	material NAME lambertian R G B
+//	material NAME metal R G B FUZZ
+//	material NAME dielectric IOR
+//	material NAME light R G B
+//
+//	sphere X Y Z RADIUS MATERIAL
+//		keyframe FRAME X Y Z
+//
+//	mesh MATERIAL [MATERIAL...]
+//		v X Y Z
+//		f A B C [M]
+//	end
+//
+//	mesh_file PATH MATERIAL [MATERIAL...]
+//
+//	camera
+//		lookfrom X Y Z
+//		lookat X Y Z
+//		up X Y Z
+//		fov DEGREES
+//		aperture DIAMETER
+//		focus DISTANCE
+//	end
+//
+// Materials must come before the things that use them. Mesh faces index
+// the mesh's vertices from 0 in the order they're listed, and M picks one of
+// the mesh's materials (the first by default). Camera settings left out
+// keep their defaults: looking from the origin down -z with a 40 degree
+// field of view, a pinhole, and focus on lookat.
+//
+// keyframe lines after a sphere move its center over the frames of an
+// animation, in a straight line from one key to the next. The sphere's own
+// center is its key at frame 0 unless a keyframe says otherwise.
+//
+// mesh_file loads an .obj or binary .ply file, relative to the scene file.
+// The file's material indices pick from the materials listed, see
+// loadMesh().
+//
+// The file is parsed once when loaded; build() can be called any number of
+// times. Mesh files are only loaded by build(), straight into their Mesh.
+class SceneFile : public Scene {
+public:
+	// Throws std::runtime_error naming the line of the first mistake
+	SceneFile(const std::string& text, const std::string& sourceName = "scene") :
+		sourceName(sourceName),
+		directory(std::filesystem::path(sourceName).parent_path()) {
+		camera.lookFrom = point3(0, 0, 0);
+		camera.lookAt = point3(0, 0, -1);
+		camera.worldUp = vec3(0, 1, 0);
+		camera.verticalFovInDegrees = 40;
+		camera.aperture = 0;
+
+		parse(text);
+	}
+
+	static SceneFile load(const std::string& path) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file.is_open())
+			throw std::runtime_error("Can't open " + path);
+
+		std::stringstream text;
+		text << file.rdbuf();
+		if (!file && !file.eof())
+			throw std::runtime_error("Error reading " + path);
+
+		return SceneFile(text.str(), path);
+	}
+
+	virtual HittableList build() override {
+		return build(0);
+	}
+
+	// Mesh files load on threadCount threads, 0 uses every core
+	HittableList build(int threadCount) {
+		HittableList world;
+
+		std::vector<const Material*> materialPtrs;
+		for (const auto& material : materials)
+			materialPtrs.push_back(makeMaterial(world.materials, material));
+
+		// In the order of the file, which the BVH build can depend on
+		for (const auto& object : objects) {
+			if (auto sphere = std::get_if<SphereDescription>(&object)) {
+				auto built = std::make_shared<Sphere>(
+					sphere->track.at(0), sphere->radius, materialPtrs[sphere->material]
+				);
+				world.add(built);
+				if (sphere->track.size() > 1)
+					world.animation.addSphere(built, sphere->track);
+				continue;
+			}
+
+			if (auto meshFile = std::get_if<MeshFileDescription>(&object)) {
+				world.add(loadMeshFile(*meshFile, materialPtrs, threadCount));
+				continue;
+			}
+
+			const auto& mesh = std::get<MeshDescription>(object);
+			std::vector<const Material*> meshMaterials;
+			for (auto material : mesh.materials)
+				meshMaterials.push_back(materialPtrs[material]);
+
+			world.add(std::make_shared<Mesh>(
+				mesh.vertices, mesh.indices, meshMaterials, mesh.materialIndices
+			));
+		}
+
+		return world;
+	}
+
+	// The statements that make the geometry and materials, without the
+	// camera, to key caches of the built scene by. Mesh files go in by path,
+	// size and modification time.
+	const std::string& getGeometrySource() const {
+		return geometrySource;
+	}
+
+	// Whether anything moves from one frame to the next
+	bool isAnimated() const {
+		return animated;
+	}
+
+	virtual Camera makeCamera(double aspectRatio) override {
+		CameraConfig config = camera;
+		config.aspectRatio = aspectRatio;
+		config.focalLength = focusDistance > 0
+			? focusDistance
+			: (config.lookAt - config.lookFrom).magnitude();
+
+		return Camera(config);
+	}
+
+private:
+	struct MaterialDescription {
+		std::string name;
+		std::string type;
+		color3 color;
+		// Fuzz of metals, index of refraction of dielectrics
+		real parameter = 0;
+	};
+
+	struct SphereDescription {
+		real radius;
+		size_t material;
+		// Center over time, a single key when it doesn't move
+		KeyframeTrack track;
+	};
+
+	struct MeshDescription {
+		std::vector<point3> vertices;
+		std::vector<int> indices;
+		std::vector<size_t> materials;
+		std::vector<int> materialIndices;
+	};
+
+	struct MeshFileDescription {
+		std::filesystem::path path;
+		std::vector<size_t> materials;
+	};
+
+	std::string sourceName;
+	// Where paths in the file start from
+	std::filesystem::path directory;
+	int lineNumber = 0;
+	std::string geometrySource;
+	bool animated = false;
+	// Whether the last statement was a sphere or one of its keyframes
+	bool keyframesAllowed = false;
+
+	std::vector<MaterialDescription> materials;
+	std::vector<std::variant<SphereDescription, MeshDescription, MeshFileDescription>> objects;
+	CameraConfig camera;
+	// 0 focuses on lookat
+	real focusDistance = 0;
+
+	static const Material* makeMaterial(MaterialTable& table, const MaterialDescription& material) {
+		if (material.type == "lambertian")
+			return table.make<LambertianDiffuse>(material.color);
+		if (material.type == "metal")
+			return table.make<Metal>(material.color, material.parameter);
+		if (material.type == "dielectric")
+			return table.make<Dielectric>(material.parameter);
+		return table.make<DiffuseLight>(material.color);
+	}
+
+	static std::shared_ptr<Mesh> loadMeshFile(
+		const MeshFileDescription& meshFile,
+		const std::vector<const Material*>& materialPtrs,
+		int threadCount
+	) {
+		MeshData data = loadMesh(meshFile.path.string(), threadCount);
+
+		std::vector<const Material*> meshMaterials;
+		for (auto material : meshFile.materials)
+			meshMaterials.push_back(materialPtrs[material]);
+
+		for (int material : data.materialIndices) {
+			if (material < 0 || size_t(material) >= meshMaterials.size()) {
+				std::string message = meshFile.path.string() + " uses material index "
+					+ std::to_string(material) + " but mesh_file lists "
+					+ std::to_string(meshMaterials.size()) + " material(s)";
+				if (size_t(material) < data.materialNames.size())
+					message += " (it's usemtl " + data.materialNames[material] + ")";
+				throw std::runtime_error(message);
+			}
+		}
+
+		return std::make_shared<Mesh>(
+			std::move(data.vertices), std::move(data.indices),
+			std::move(meshMaterials), std::move(data.materialIndices)
+		);
+	}
+
+	void parse(const std::string& text) {
+		std::istringstream stream(text);
+
+		// Statements are read from here, blocks take over until their end
+		std::vector<std::string> tokens;
+		while (nextStatement(stream, tokens)) {
+			const std::string& keyword = tokens[0];
+			if (keyword != "keyframe" && keyword != "sphere")
+				keyframesAllowed = false;
+
+			if (keyword == "material")
+				parseMaterial(tokens);
+			else if (keyword == "sphere")
+				parseSphere(tokens);
+			else if (keyword == "mesh")
+				parseMesh(stream, tokens);
+			else if (keyword == "keyframe")
+				parseKeyframe(tokens);
+			else if (keyword == "mesh_file")
+				parseMeshFile(tokens);
+			else if (keyword == "camera")
+				parseCamera(stream, tokens);
+			else
+				fail("Unknown statement " + keyword);
+		}
+	}
+
+	void parseMaterial(const std::vector<std::string>& tokens) {
+		expectAtLeast(tokens, 3);
+		addToGeometrySource(tokens);
+
+		MaterialDescription material;
+		material.name = tokens[1];
+		material.type = tokens[2];
+
+		for (const auto& other : materials) {
+			if (other.name == material.name)
+				fail("Material " + material.name + " is already defined");
+		}
+
+		if (material.type == "lambertian" || material.type == "light") {
+			expectCount(tokens, 6);
+			material.color = parseVector(tokens, 3);
+		}
+		else if (material.type == "metal") {
+			expectCount(tokens, 7);
+			material.color = parseVector(tokens, 3);
+			material.parameter = parseNumber(tokens[6]);
+		}
+		else if (material.type == "dielectric") {
+			expectCount(tokens, 4);
+			material.parameter = parseNumber(tokens[3]);
+		}
+		else {
+			fail("Unknown material type " + material.type);
+		}
+
+		materials.push_back(material);
+	}
+
+	void parseSphere(const std::vector<std::string>& tokens) {
+		expectCount(tokens, 6);
+		addToGeometrySource(tokens);
+
+		// Negative radii make hollow spheres, with normals pointing inwards
+		real radius = parseNumber(tokens[4]);
+		if (radius == 0 || !std::isfinite(radius))
+			fail("Sphere radius can't be " + tokens[4]);
+
+		auto& object = objects.emplace_back(std::in_place_type<SphereDescription>,
+			radius, findMaterial(tokens[5])
+		);
+		std::get<SphereDescription>(object).track.add(0, parseVector(tokens, 1));
+		keyframesAllowed = true;
+	}
+
+	void parseKeyframe(const std::vector<std::string>& tokens) {
+		expectCount(tokens, 5);
+		if (!keyframesAllowed)
+			fail("keyframe must follow a sphere");
+		addToGeometrySource(tokens);
+
+		auto& sphere = std::get<SphereDescription>(objects.back());
+		sphere.track.add(parseNumber(tokens[1]), parseVector(tokens, 2));
+		if (sphere.track.size() > 1)
+			animated = true;
+	}
+
+	void parseMesh(std::istream& stream, const std::vector<std::string>& header) {
+		expectAtLeast(header, 2);
+
+		addToGeometrySource(header);
+
+		MeshDescription mesh;
+		for (size_t i = 1; i < header.size(); i++)
+			mesh.materials.push_back(findMaterial(header[i]));
+
+		bool anyMaterialIndex = false;
+		std::vector<std::string> tokens;
+		while (true) {
+			if (!nextStatement(stream, tokens))
+				fail("Mesh is missing its end");
+			addToGeometrySource(tokens);
+			if (tokens[0] == "end")
+				break;
+
+			if (tokens[0] == "v") {
+				expectCount(tokens, 4);
+				mesh.vertices.push_back(parseVector(tokens, 1));
+			}
+			else if (tokens[0] == "f") {
+				if (tokens.size() != 4 && tokens.size() != 5)
+					fail("Expected f A B C [M]");
+
+				for (int corner = 1; corner <= 3; corner++) {
+					int index = parseIndex(tokens[corner], mesh.vertices.size());
+					mesh.indices.push_back(index);
+				}
+
+				int material = 0;
+				if (tokens.size() == 5) {
+					material = parseIndex(tokens[4], mesh.materials.size());
+					anyMaterialIndex = true;
+				}
+				mesh.materialIndices.push_back(material);
+			}
+			else {
+				fail("Unknown mesh statement " + tokens[0]);
+			}
+		}
+
+		if (mesh.indices.empty())
+			fail("Mesh has no faces");
+
+		// Same as giving none, the mesh falls back to its first material
+		if (!anyMaterialIndex)
+			mesh.materialIndices.clear();
+
+		objects.push_back(std::move(mesh));
+	}
+
+	void parseMeshFile(const std::vector<std::string>& tokens) {
+		expectAtLeast(tokens, 3);
+
+		MeshFileDescription meshFile;
+		meshFile.path = directory / tokens[1];
+		for (size_t i = 2; i < tokens.size(); i++)
+			meshFile.materials.push_back(findMaterial(tokens[i]));
+
+		// Hashing the contents of a big mesh would take about as long as
+		// loading it. Missing files get an error when the scene is built.
+		std::error_code error;
+		auto size = std::filesystem::file_size(meshFile.path, error);
+		auto time = std::filesystem::last_write_time(meshFile.path, error);
+		addToGeometrySource(tokens);
+		geometrySource += std::to_string(size) + " "
+			+ std::to_string(time.time_since_epoch().count()) + "\n";
+
+		objects.push_back(std::move(meshFile));
+	}
+
+	void parseCamera(std::istream& stream, const std::vector<std::string>& header) {
+		expectCount(header, 1);
+
+		std::vector<std::string> tokens;
+		while (true) {
+			if (!nextStatement(stream, tokens))
+				fail("Camera is missing its end");
+			if (tokens[0] == "end")
+				break;
+
+			const std::string& setting = tokens[0];
+			if (setting == "lookfrom" || setting == "lookat" || setting == "up") {
+				expectCount(tokens, 4);
+				auto value = parseVector(tokens, 1);
+				if (setting == "lookfrom")
+					camera.lookFrom = value;
+				else if (setting == "lookat")
+					camera.lookAt = value;
+				else
+					camera.worldUp = value;
+			}
+			else if (setting == "fov" || setting == "aperture" || setting == "focus") {
+				expectCount(tokens, 2);
+				real value = parseNumber(tokens[1]);
+				if (setting == "fov")
+					camera.verticalFovInDegrees = value;
+				else if (setting == "aperture")
+					camera.aperture = value;
+				else
+					focusDistance = value;
+			}
+			else {
+				fail("Unknown camera setting " + setting);
+			}
+		}
+	}
+
+	// Reads the next line with something on it into tokens. False at the
+	// end of the text.
+	bool nextStatement(std::istream& stream, std::vector<std::string>& tokens) {
+		std::string line;
+		while (std::getline(stream, line)) {
+			lineNumber++;
+
+			auto comment = line.find('#');
+			if (comment != std::string::npos)
+				line.erase(comment);
+
+			tokens.clear();
+			std::istringstream words(line);
+			std::string word;
+			while (words >> word)
+				tokens.push_back(word);
+
+			if (!tokens.empty())
+				return true;
+		}
+		return false;
+	}
+
+	void addToGeometrySource(const std::vector<std::string>& tokens) {
+		for (const auto& token : tokens)
+			geometrySource += token + " ";
+		geometrySource += "\n";
+	}
+
+	size_t findMaterial(const std::string& name) const {
+		for (size_t i = 0; i < materials.size(); i++) {
+			if (materials[i].name == name)
+				return i;
+		}
+		fail("Unknown material " + name);
+	}
+
+	real parseNumber(const std::string& token) const {
+		char* end = nullptr;
+		double value = std::strtod(token.c_str(), &end);
+		if (token.empty() || *end != '\0')
+			fail("Expected a number instead of " + token);
+		return static_cast<real>(value);
+	}
+
+	vec3 parseVector(const std::vector<std::string>& tokens, size_t first) const {
+		return vec3(
+			parseNumber(tokens[first]),
+			parseNumber(tokens[first + 1]),
+			parseNumber(tokens[first + 2])
+		);
+	}
+
+	// Index into something with count elements
+	int parseIndex(const std::string& token, size_t count) const {
+		char* end = nullptr;
+		long value = std::strtol(token.c_str(), &end, 10);
+		if (token.empty() || *end != '\0' || value < 0 || size_t(value) >= count)
+			fail("Expected an index below " + std::to_string(count) + " instead of " + token);
+		return static_cast<int>(value);
+	}
+
+	void expectCount(const std::vector<std::string>& tokens, size_t count) const {
+		if (tokens.size() != count)
+			fail(tokens[0] + " takes " + std::to_string(count - 1) + " value(s)");
+	}
+
+	void expectAtLeast(const std::vector<std::string>& tokens, size_t count) const {
+		if (tokens.size() < count)
+			fail(tokens[0] + " takes at least " + std::to_string(count - 1) + " value(s)");
+	}
+
+	[[noreturn]] void fail(const std::string& message) const {
+		throw std::runtime_error(
+			sourceName + ":" + std::to_string(lineNumber) + ": " + message
+		);
+	}
+};
+
+// One of the scenes in scene.h by name (tutorial, bookcover or cornell),
+// or else a scene file
+std::unique_ptr<Scene> loadScene(const std::string& nameOrPath) {
+	if (nameOrPath == "tutorial")
+		return std::make_unique<TutorialScene>();
+	if (nameOrPath == "bookcover")
+		return std::make_unique<BookCoverScene>();
+	if (nameOrPath == "cornell")
+		return std::make_unique<CornellBoxScene>();
+
+	return std::make_unique<SceneFile>(SceneFile::load(nameOrPath));
+}
@@ -1,66 +1,304 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <memory>
+#include <numbers>
 #include <optional>
+#include <vector>
 
 #include "hittable.h"
+#include "material.h"
 #include "vec3.h"
 
 
 class Sphere : public Hittable {
 public:
 	point3 center;
-	double radius;
-	std::shared_ptr<Material> materialPtr;
+	real radius;
+	const Material* materialPtr = nullptr;
 
 	Sphere() {}
-	Sphere(point3 center, double radius, std::shared_ptr<Material> materialPtr) 
+	Sphere(point3 center, real radius, const Material* materialPtr) 
 		: center(center), radius(radius), materialPtr(materialPtr) {}
 
-	virtual std::optional<HitRecord> hit
-		(const Ray& ray, double tMin, double tMax) const override;
+	virtual bool intersect(
+		const Ray& ray, real tMin, real tMax, HitCandidate& closest
+	) const override;
+
+	virtual HitRecord finalize(
+		const Ray& ray, const HitCandidate& candidate
+	) const override;
+
+	virtual void intersectPacket(
+		const RayPacket& packet,
+		uint32_t laneMask,
+		real tMin,
+		PacketHits& hits
+	) const override;
+
+	virtual uint32_t occludedPacket(
+		const RayPacket& packet,
+		uint32_t laneMask,
+		real tMin,
+		const real tMax[RayPacket::MAX_SIZE]
+	) const override;
 
 	virtual std::optional<BoundingBox> boundingBox
-		(double tStart, double tEnd) const override;
+		(real tStart, real tEnd) const override;
+
+	virtual void collectEmitters(std::vector<Emitter>& emitters) const override;
+
+	virtual SurfaceSample samplePrimitive(
+		uint32_t primitive, real u1, real u2
+	) const override;
+
+	virtual SurfaceSample samplePrimitiveFrom(
+		uint32_t primitive, const point3& reference, real u1, real u2, real& density
+	) const override;
+
+	virtual real primitiveDensityFrom(
+		uint32_t primitive, const point3& reference, const point3& point
+	) const override;
+
+private:
+	// Half angle of the cone of directions from reference that hit the
+	// sphere, as its squared sine and 1 - its cosine. False if reference
+	// is inside the sphere, where every direction does.
+	bool visibleCone(
+		const point3& reference, real& sinSquaredMax, real& oneMinusCosMax
+	) const;
 };
 
-std::optional<HitRecord> Sphere::hit(
-	const Ray& ray, double tMin, double tMax
+bool Sphere::intersect(
+	const Ray& ray, real tMin, real tMax, HitCandidate& closest
 ) const {
 	auto deltaCenter = ray.origin - center;
 
-	// Setup quadratic equation
-	double a = ray.direction.squareMagnitude();
-	double b = 2 * ray.direction.dot(deltaCenter);
-	double c = deltaCenter.squareMagnitude() - radius * radius;
+	// Setup quadratic equation, a t^2 - 2 b t + c = 0
+	real a = ray.direction.squareMagnitude();
+	real b = -ray.direction.dot(deltaCenter);
+	real c = deltaCenter.squareMagnitude() - radius * radius;
+
+	// b^2 - a c loses everything to cancellation when the sphere is small
+	// compared to its distance, a c / a^2 is the same thing computed
+	// without it (Ray Tracing Gems, "Precision Improvements for
+	// Ray/Sphere Intersection")
+	auto closestApproach = deltaCenter + (b / a) * ray.direction;
+	auto discriminant = radius * radius - closestApproach.squareMagnitude();
+	if (discriminant < 0)
+		return false;
 
-	auto discriminant = b * b - 4 * a * c;
-	if (discriminant < 0.0)
-		return {};
+	// The two roots without subtracting nearly equal numbers
+	real q = b + std::copysign(std::sqrt(a * discriminant), b);
+	real tNear = c / q;
+	real tFar = q / a;
+	if (tFar < tNear)
+		std::swap(tNear, tFar);
 
 	// Find root between tMin and tMax
-	double sqrtDiscriminant = sqrt(discriminant);
-	double t = (-b - sqrtDiscriminant) / (2 * a);
+	real t = tNear;
 	if (t < tMin || tMax < t) {
-		t += sqrtDiscriminant / a;
+		t = tFar;
 		if (t < tMin || tMax < t) {
-			return {};
+			return false;
 		}
 	}	
 
+	closest = HitCandidate{ t, this };
+	return true;
+}
+
+// Same as intersect() for every lane, written without branches so that the loop
+// runs on all lanes in SIMD
+void Sphere::intersectPacket(
+	const RayPacket& packet,
+	uint32_t laneMask,
+	real tMin,
+	PacketHits& hits
+) const {
+	real roots[RayPacket::MAX_SIZE];
+	uint32_t hitMask = 0;
+
+	for (int lane = 0; lane < packet.size; lane++) {
+		real dx = packet.direction[0][lane];
+		real dy = packet.direction[1][lane];
+		real dz = packet.direction[2][lane];
+		real ox = packet.origin[0][lane] - center.x;
+		real oy = packet.origin[1][lane] - center.y;
+		real oz = packet.origin[2][lane] - center.z;
+
+		real a = dx * dx + dy * dy + dz * dz;
+		real b = -(dx * ox + dy * oy + dz * oz);
+		real c = ox * ox + oy * oy + oz * oz - radius * radius;
+
+		real px = ox + (b / a) * dx;
+		real py = oy + (b / a) * dy;
+		real pz = oz + (b / a) * dz;
+		real discriminant = radius * radius - (px * px + py * py + pz * pz);
+
+		real q = b + std::copysign(std::sqrt(std::max<real>(a * discriminant, 0)), b);
+		real root0 = c / q;
+		real root1 = q / a;
+		real tNear = std::min(root0, root1);
+		real tFar = std::max(root0, root1);
+		real tMax = hits.tMax[lane];
+
+		bool nearInRange = tMin <= tNear && tNear <= tMax;
+		bool farInRange = tMin <= tFar && tFar <= tMax;
+
+		roots[lane] = nearInRange ? tNear : tFar;
+		hitMask |= static_cast<uint32_t>(
+			discriminant >= 0 && (nearInRange || farInRange)
+		) << lane;
+	}
+
+	forEachLane(hitMask & laneMask, [&](int lane) {
+		hits.tMax[lane] = roots[lane];
+		hits.candidates[lane] = HitCandidate{ roots[lane], this };
+	});
+}
+
+HitRecord Sphere::finalize(
+	const Ray& ray, const HitCandidate& candidate
+) const {
 	HitRecord result;
-	result.intersection = ray.at(t);
-	result.t = t;
-	auto outwardNormal = (result.intersection - center) / radius;
+	result.t = candidate.t;
+
+	// ray.at(t) is off by the rounding error of t times the length of the
+	// ray, which can be a lot. Projecting it back onto the sphere bounds the
+	// error by the size of the sphere instead.
+	auto fromCenter = ray.at(candidate.t) - center;
+	fromCenter *= std::abs(radius) / fromCenter.magnitude();
+	result.intersection = center + fromCenter;
+
+	for (int axis = 0; axis < 3; axis++)
+		result.intersectionError[axis] = roundingErrorBound(5)
+			* (std::abs(fromCenter[axis]) + std::abs(result.intersection[axis]));
+
+	auto outwardNormal = fromCenter / radius;
 	result.setNormalFromOutwardNormal(ray, outwardNormal);
 	result.materialPtr = materialPtr;
+	result.hittable = this;
 
 	return result;
 }
 
+// intersectPacket() does every lane at once, any hit closer than tMax blocks
+uint32_t Sphere::occludedPacket(
+	const RayPacket& packet,
+	uint32_t laneMask,
+	real tMin,
+	const real tMax[RayPacket::MAX_SIZE]
+) const {
+	PacketHits hits(0);
+	std::copy(tMax, tMax + RayPacket::MAX_SIZE, hits.tMax);
+	intersectPacket(packet, laneMask, tMin, hits);
+
+	uint32_t blocked = 0;
+	forEachLane(laneMask, [&](int lane) {
+		if (hits.candidates[lane].hittable)
+			blocked |= 1u << lane;
+	});
+	return blocked;
+}
+
 std::optional<BoundingBox> Sphere::boundingBox(
-	double tStart, double tEnd
+	real tStart, real tEnd
 ) const {
 	auto halfBox = point3(radius);
 	return BoundingBox(center - halfBox, center + halfBox);
-}
\ No newline at end of file
+}
+
+void Sphere::collectEmitters(std::vector<Emitter>& emitters) const {
+	if (!materialPtr || materialPtr->emit().maxComponent() <= 0)
+		return;
+
+	real area = 4 * std::numbers::pi_v<real> * radius * radius;
+	emitters.push_back(Emitter{ this, 0, materialPtr, area });
+}
+
+SurfaceSample Sphere::samplePrimitive(
+	uint32_t primitive, real u1, real u2
+) const {
+	// Uniform on the sphere: z is uniform in [-1, 1] (Archimedes)
+	real z = 1 - 2 * u1;
+	real ringRadius = std::sqrt(std::max<real>(1 - z * z, 0));
+	real phi = 2 * std::numbers::pi_v<real> * u2;
+	vec3 normal(ringRadius * std::cos(phi), ringRadius * std::sin(phi), z);
+
+	return SurfaceSample{ center + std::abs(radius) * normal, normal };
+}
+
+bool Sphere::visibleCone(
+	const point3& reference, real& sinSquaredMax, real& oneMinusCosMax
+) const {
+	real distanceSquared = (center - reference).squareMagnitude();
+	real radiusSquared = radius * radius;
+	if (distanceSquared <= radiusSquared)
+		return false;
+
+	sinSquaredMax = radiusSquared / distanceSquared;
+	real cosMax = std::sqrt(std::max<real>(1 - sinSquaredMax, 0));
+	// Same as 1 - cosMax, without the cancellation for small or far spheres
+	oneMinusCosMax = sinSquaredMax / (1 + cosMax);
+	return true;
+}
+
+// Uniform over the cone of directions from reference that hit the sphere,
+// so no samples are wasted on the far side ("Sampling Spheres" in pbrt)
+SurfaceSample Sphere::samplePrimitiveFrom(
+	uint32_t primitive, const point3& reference, real u1, real u2, real& density
+) const {
+	real sinSquaredMax, oneMinusCosMax;
+	if (!visibleCone(reference, sinSquaredMax, oneMinusCosMax)) {
+		density = 1;
+		return samplePrimitive(primitive, u1, u2);
+	}
+
+	// Direction in the cone, at angle theta to the center
+	real oneMinusCos = u1 * oneMinusCosMax;
+	real cosTheta = 1 - oneMinusCos;
+	real sinSquared = oneMinusCos * (2 - oneMinusCos);
+
+	// Where it first hits the sphere, as the angle alpha between the
+	// normal there and the direction from the center back to reference
+	real cosAlpha = sinSquared / std::sqrt(sinSquaredMax)
+		+ cosTheta * std::sqrt(std::max<real>(1 - sinSquared / sinSquaredMax, 0));
+	real sinAlpha = std::sqrt(std::max<real>(1 - cosAlpha * cosAlpha, 0));
+	real phi = 2 * std::numbers::pi_v<real> * u2;
+
+	// Basis around the direction to the center (Duff et al., "Building an
+	// Orthonormal Basis, Revisited")
+	vec3 axis = (center - reference).unit();
+	real sign = std::copysign(real(1), axis.z);
+	real a = -1 / (sign + axis.z);
+	real b = axis.x * axis.y * a;
+	vec3 tangent(1 + sign * axis.x * axis.x * a, sign * b, -sign * axis.x);
+	vec3 bitangent(b, sign + axis.y * axis.y * a, -axis.y);
+
+	vec3 normal = -(sinAlpha * std::cos(phi) * tangent
+		+ sinAlpha * std::sin(phi) * bitangent
+		+ cosAlpha * axis);
+	point3 point = center + std::abs(radius) * normal;
+
+	density = primitiveDensityFrom(primitive, reference, point);
+	return SurfaceSample{ point, normal };
+}
+
+real Sphere::primitiveDensityFrom(
+	uint32_t primitive, const point3& reference, const point3& point
+) const {
+	real sinSquaredMax, oneMinusCosMax;
+	if (!visibleCone(reference, sinSquaredMax, oneMinusCosMax))
+		return 1;
+
+	// Solid angle density 1 / (2 pi oneMinusCosMax) turned into density per
+	// unit area, over the uniform 1 / (4 pi radius^2)
+	vec3 toReference = reference - point;
+	real distanceSquared = toReference.squareMagnitude();
+	vec3 normal = (point - center) / std::abs(radius);
+	real cosine = std::abs(normal.dot(toReference)) / std::sqrt(distanceSquared);
+
+	return 2 * radius * radius * cosine / (oneMinusCosMax * distanceSquared);
+}
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "trace.h"
+
+// Counters of one render thread. Every thread has its own, each on cache
+// lines of its own, so counting never makes threads wait on each other.
+struct alignas(64) ThreadStats {
+	// Paths of this many rays or more share the last bucket of pathLengths
+	static constexpr int PATH_LENGTH_BUCKETS = 16;
+
+	// Stats of the render thread this runs on, for code too deep down to
+	// be handed them (BVH traversal). Null outside of renders.
+	static inline thread_local ThreadStats* current = nullptr;
+
+	long long samples = 0;
+	long long tiles = 0;
+
+	long long cameraRays = 0;
+	long long bounceRays = 0;
+	long long shadowRays = 0;
+
+	// BVH nodes whose children were tested, boxes tested (every child
+	// slot of a wide node counts) and primitives tested in the leaves
+	long long nodesVisited = 0;
+	long long boxTests = 0;
+	long long primitiveTests = 0;
+
+	// pathLengths[n - 1] is the number of paths of n rays, camera ray
+	// included
+	long long pathLengths[PATH_LENGTH_BUCKETS] = {};
+
+	// Time spent rendering tiles. The rest of a pass, the thread was
+	// starting up or out of tiles.
+	double renderSeconds = 0;
+
+	long long rays() const {
+		return cameraRays + bounceRays + shadowRays;
+	}
+
+	void addPathLength(int length) {
+		pathLengths[std::clamp(length, 1, PATH_LENGTH_BUCKETS) - 1]++;
+	}
+
+	ThreadStats& operator+=(const ThreadStats& other) {
+		samples += other.samples;
+		tiles += other.tiles;
+		cameraRays += other.cameraRays;
+		bounceRays += other.bounceRays;
+		shadowRays += other.shadowRays;
+		nodesVisited += other.nodesVisited;
+		boxTests += other.boxTests;
+		primitiveTests += other.primitiveTests;
+		for (int i = 0; i < PATH_LENGTH_BUCKETS; i++)
+			pathLengths[i] += other.pathLengths[i];
+		renderSeconds += other.renderSeconds;
+		return *this;
+	}
+};
+
+// Counts of one BVH traversal. They're kept in registers while it runs and
+// added to ThreadStats::current once at the end.
+struct TraversalCounts {
+	uint32_t nodesVisited = 0;
+	uint32_t boxTests = 0;
+	uint32_t primitiveTests = 0;
+
+	~TraversalCounts() {
+		if (ThreadStats* stats = ThreadStats::current) {
+			stats->nodesVisited += nodesVisited;
+			stats->boxTests += boxTests;
+			stats->primitiveTests += primitiveTests;
+		}
+	}
+};
+
+// Statistics of a whole render: the counters of every render thread plus
+// how long each phase (building the scene, rendering, saving...) took.
+// The threads' counters are only added up once they're done.
+class RenderStatistics {
+public:
+	RenderStatistics(int threadCount) : threads(std::max(threadCount, 1)) {}
+
+	int threadCount() const { return static_cast<int>(threads.size()); }
+
+	ThreadStats& thread(int index) { return threads.at(index); }
+	const ThreadStats& thread(int index) const { return threads.at(index); }
+
+	ThreadStats total() const {
+		ThreadStats sum;
+		for (const auto& stats : threads)
+			sum += stats;
+		return sum;
+	}
+
+	// Phases with the same name add up, e.g. the passes of a render
+	void addPhase(const std::string& name, double seconds) {
+		auto found = std::find_if(phases.begin(), phases.end(),
+			[&](const auto& phase) { return phase.first == name; });
+
+		if (found == phases.end())
+			phases.emplace_back(name, seconds);
+		else
+			found->second += seconds;
+	}
+
+	double phaseSeconds(const std::string& name) const {
+		for (const auto& [phaseName, seconds] : phases) {
+			if (phaseName == name)
+				return seconds;
+		}
+		return 0;
+	}
+
+	void printSummary(FILE* file) const {
+		ThreadStats sum = total();
+		double rays = std::max<double>(sum.rays(), 1);
+
+		fprintf(file, "Statistics:\n");
+		fprintf(
+			file, "  Rays: %lld camera, %lld bounce, %lld shadow\n",
+			sum.cameraRays, sum.bounceRays, sum.shadowRays
+		);
+
+		double renderTime = phaseSeconds("render");
+		if (renderTime > 0)
+			fprintf(file, "  %.2f Mrays/s\n", sum.rays() / renderTime * 1e-6);
+
+		fprintf(
+			file, "  Per ray: %.2f nodes visited, %.2f box tests, %.2f primitive tests\n",
+			sum.nodesVisited / rays, sum.boxTests / rays, sum.primitiveTests / rays
+		);
+
+		fprintf(file, "  Path lengths:");
+		long long paths = std::max<long long>(sum.samples, 1);
+		for (int i = 0; i < ThreadStats::PATH_LENGTH_BUCKETS; i++) {
+			if (sum.pathLengths[i] > 0) {
+				fprintf(
+					file, " %d%s: %.1f%%", i + 1,
+					i + 1 == ThreadStats::PATH_LENGTH_BUCKETS ? "+" : "",
+					100.0 * sum.pathLengths[i] / paths
+				);
+			}
+		}
+		fprintf(file, "\n");
+
+		// How evenly the work was spread between threads
+		double least = threads[0].renderSeconds, most = threads[0].renderSeconds;
+		for (const auto& stats : threads) {
+			least = std::min(least, stats.renderSeconds);
+			most = std::max(most, stats.renderSeconds);
+		}
+		fprintf(
+			file, "  Threads: %d, rendering for %.2f s to %.2f s each\n",
+			threadCount(), least, most
+		);
+
+		fprintf(file, "  Phases:");
+		for (const auto& [name, seconds] : phases)
+			fprintf(file, " %s %.3f s", name.c_str(), seconds);
+		fprintf(file, "\n");
+	}
+
+	// JSON object, with every line after the first starting with indent
+	void writeJson(std::ostream& stream, const std::string& indent = "") const {
+		ThreadStats sum = total();
+
+		stream << "{\n";
+		stream << indent << "  \"threads\": " << threadCount() << ",\n";
+
+		stream << indent << "  \"total\": ";
+		writeCounters(stream, sum);
+		stream << ",\n";
+
+		stream << indent << "  \"pathLengths\": [";
+		for (int i = 0; i < ThreadStats::PATH_LENGTH_BUCKETS; i++)
+			stream << (i == 0 ? "" : ", ") << sum.pathLengths[i];
+		stream << "],\n";
+
+		stream << indent << "  \"perThread\": [";
+		for (size_t i = 0; i < threads.size(); i++) {
+			stream << (i == 0 ? "\n" : ",\n") << indent << "    ";
+			writeCounters(stream, threads[i]);
+		}
+		stream << "\n" << indent << "  ],\n";
+
+		stream << indent << "  \"phases\": {";
+		for (size_t i = 0; i < phases.size(); i++) {
+			stream << (i == 0 ? "\n" : ",\n") << indent << "    \""
+				<< phases[i].first << "\": " << phases[i].second;
+		}
+		stream << (phases.empty() ? "}\n" : "\n" + indent + "  }\n");
+
+		stream << indent << "}";
+	}
+
+private:
+	std::vector<ThreadStats> threads;
+	// Name and seconds, in the order they started
+	std::vector<std::pair<std::string, double>> phases;
+
+	static void writeCounters(std::ostream& stream, const ThreadStats& stats) {
+		stream << "{ \"samples\": " << stats.samples
+			<< ", \"tiles\": " << stats.tiles
+			<< ", \"cameraRays\": " << stats.cameraRays
+			<< ", \"bounceRays\": " << stats.bounceRays
+			<< ", \"shadowRays\": " << stats.shadowRays
+			<< ", \"nodesVisited\": " << stats.nodesVisited
+			<< ", \"boxTests\": " << stats.boxTests
+			<< ", \"primitiveTests\": " << stats.primitiveTests
+			<< ", \"renderSeconds\": " << stats.renderSeconds << " }";
+	}
+};
+
+// Adds the time between its construction and destruction to a phase, and
+// to the trace if there is one
+class PhaseTimer {
+public:
+	PhaseTimer(RenderStatistics& statistics, const char* name) :
+		statistics(statistics),
+		name(name),
+		start(std::chrono::steady_clock::now()),
+		traceScope(name, "phase") {}
+
+	~PhaseTimer() {
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		statistics.addPhase(name, elapsed.count());
+	}
+
+private:
+	RenderStatistics& statistics;
+	const char* name;
+	std::chrono::steady_clock::time_point start;
+	TraceScope traceScope;
+};
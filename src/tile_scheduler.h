@@ -0,0 +1,150 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// Rectangular region of the image, covering columns [x0, x1) and
+// rows [y0, y1)
+struct Tile {
+	int x0, y0;
+	int x1, y1;
+
+	int width() const { return x1 - x0; }
+	int height() const { return y1 - y0; }
+	int pixelCount() const { return width() * height(); }
+};
+
+// Splits the image into tiles and hands them out to worker threads.
+// Every worker owns a deque of tiles. A worker takes tiles from the front of
+// its own deque and, once it runs dry, steals from the back of somebody
+// else's. That way every pixel is rendered on one core from start to finish
+// and expensive regions (say, the light panel of the Cornell box) don't hold
+// up the rest of the threads.
+class TileScheduler {
+public:
+	static constexpr int DEFAULT_TILE_SIZE = 32;
+
+	TileScheduler(
+		int imageWidth,
+		int imageHeight,
+		int workerCount,
+		int tileSize = DEFAULT_TILE_SIZE
+	) : queues(std::max(workerCount, 1)) {
+		auto tiles = makeTiles(imageWidth, imageHeight, tileSize);
+		tileCount = tiles.size();
+
+		// Give each worker a contiguous run of the Morton curve so its tiles
+		// are next to each other in the image (and in the scene)
+		size_t tilesLeftToAllocate = tiles.size();
+		auto tile = tiles.begin();
+		for (size_t i = 0; i < queues.size(); i++) {
+			size_t workerTileCount = tilesLeftToAllocate / (queues.size() - i);
+			tilesLeftToAllocate -= workerTileCount;
+
+			queues[i].tiles.assign(tile, tile + workerTileCount);
+			tile += workerTileCount;
+		}
+	}
+
+	size_t size() const { return tileCount; }
+
+	// Returns the next tile for this worker, or nothing when all tiles
+	// have been handed out
+	std::optional<Tile> next(int worker) {
+		auto ownTile = popFront(queues[worker]);
+		if (ownTile)
+			return ownTile;
+
+		// Steal, starting from our neighbour so thieves spread out
+		for (size_t i = 1; i < queues.size(); i++) {
+			auto& victim = queues[(worker + i) % queues.size()];
+			auto stolenTile = popBack(victim);
+			if (stolenTile)
+				return stolenTile;
+		}
+
+		return {};
+	}
+
+private:
+	// Padded so workers don't fight over each other's cache lines
+	struct alignas(64) WorkerQueue {
+		std::mutex mutex;
+		std::deque<Tile> tiles;
+	};
+
+	std::vector<WorkerQueue> queues;
+	size_t tileCount = 0;
+
+	static std::optional<Tile> popFront(WorkerQueue& queue) {
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tiles.empty())
+			return {};
+
+		Tile tile = queue.tiles.front();
+		queue.tiles.pop_front();
+		return tile;
+	}
+
+	static std::optional<Tile> popBack(WorkerQueue& queue) {
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tiles.empty())
+			return {};
+
+		Tile tile = queue.tiles.back();
+		queue.tiles.pop_back();
+		return tile;
+	}
+
+	static std::vector<Tile> makeTiles(int width, int height, int tileSize) {
+		int columns = (width + tileSize - 1) / tileSize;
+		int rows = (height + tileSize - 1) / tileSize;
+
+		std::vector<std::pair<uint32_t, Tile>> tilesByCode;
+		tilesByCode.reserve(columns * rows);
+
+		for (int row = 0; row < rows; row++) {
+			for (int column = 0; column < columns; column++) {
+				Tile tile = {
+					/* x0 */ column * tileSize,
+					/* y0 */ row * tileSize,
+					/* x1 */ std::min((column + 1) * tileSize, width),
+					/* y1 */ std::min((row + 1) * tileSize, height)
+				};
+				tilesByCode.emplace_back(mortonCode(column, row), tile);
+			}
+		}
+
+		std::sort(
+			tilesByCode.begin(),
+			tilesByCode.end(),
+			[](const auto& a, const auto& b) { return a.first < b.first; }
+		);
+
+		std::vector<Tile> tiles;
+		tiles.reserve(tilesByCode.size());
+		for (const auto& [code, tile] : tilesByCode)
+			tiles.push_back(tile);
+
+		return tiles;
+	}
+
+	// Interleaves the bits of x and y (Z-order curve)
+	static uint32_t mortonCode(uint32_t x, uint32_t y) {
+		return spreadBits(x) | (spreadBits(y) << 1);
+	}
+
+	// Inserts a zero between each of the lower 16 bits
+	static uint32_t spreadBits(uint32_t value) {
+		value &= 0x0000ffff;
+		value = (value | (value << 8)) & 0x00ff00ff;
+		value = (value | (value << 4)) & 0x0f0f0f0f;
+		value = (value | (value << 2)) & 0x33333333;
+		value = (value | (value << 1)) & 0x55555555;
+		return value;
+	}
+};
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Span of time on one thread, e.g. a phase of the render or a tile
+struct TraceEvent {
+	// String literals, so recording never allocates
+	const char* name;
+	const char* category;
+	// Nanoseconds since the tracer started
+	int64_t start;
+	int64_t duration;
+	// Up to two integer arguments, shown with the event. Unused when their
+	// name is null.
+	const char* argumentNames[2];
+	int64_t arguments[2];
+};
+
+// Events of one thread. When it fills up, new events overwrite the oldest,
+// so a long render keeps its last stretch of events with bounded memory.
+// Only its own thread writes to it while tracing.
+class TraceBuffer {
+public:
+	// Buffer of the thread this runs on, null when not tracing
+	static inline thread_local TraceBuffer* current = nullptr;
+
+	TraceBuffer(int threadId, std::string threadName, size_t capacity) :
+		threadId(threadId), threadName(std::move(threadName)), events(capacity) {}
+
+	void record(const TraceEvent& event) {
+		events[recorded % events.size()] = event;
+		recorded++;
+	}
+
+	int getThreadId() const { return threadId; }
+	const std::string& getThreadName() const { return threadName; }
+
+	size_t size() const { return std::min<size_t>(recorded, events.size()); }
+	size_t dropped() const { return recorded - size(); }
+
+	// Events oldest first
+	const TraceEvent& operator[](size_t index) const {
+		size_t first = recorded - size();
+		return events[(first + index) % events.size()];
+	}
+
+private:
+	int threadId;
+	std::string threadName;
+	std::vector<TraceEvent> events;
+	size_t recorded = 0;
+};
+
+// Timeline of what every thread did, saved as a Chrome trace (open it in
+// chrome://tracing or https://ui.perfetto.dev).
+//
+// Tracing is off until start(). Until then TraceScopes only check a null
+// pointer.
+class Tracer {
+public:
+	static constexpr size_t DEFAULT_CAPACITY = 1 << 16;
+
+	void start(size_t eventsPerThread = DEFAULT_CAPACITY) {
+		std::lock_guard lock(mutex);
+		capacity = eventsPerThread;
+		origin = std::chrono::steady_clock::now();
+		enabled = true;
+	}
+
+	bool isEnabled() const { return enabled; }
+
+	// Makes the calling thread record into the buffer of threadId, which
+	// is created the first time. Threads that do the same job from one pass
+	// to the next (say, render worker 3) should use the same id, so they
+	// show up as one row. Does nothing if tracing is off.
+	void attachThread(int threadId, const std::string& threadName) {
+		if (!enabled)
+			return;
+
+		std::lock_guard lock(mutex);
+		for (const auto& buffer : buffers) {
+			if (buffer->getThreadId() == threadId) {
+				TraceBuffer::current = buffer.get();
+				return;
+			}
+		}
+
+		buffers.push_back(std::make_unique<TraceBuffer>(threadId, threadName, capacity));
+		TraceBuffer::current = buffers.back().get();
+	}
+
+	void detachThread() {
+		TraceBuffer::current = nullptr;
+	}
+
+	int64_t now() const {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - origin
+		).count();
+	}
+
+	// Chrome's JSON trace format. Only call once the traced threads are
+	// done.
+	void write(std::ostream& stream) const {
+		std::lock_guard lock(mutex);
+
+		size_t dropped = 0;
+		bool first = true;
+		auto separator = [&]() -> const char* {
+			const char* result = first ? "\n" : ",\n";
+			first = false;
+			return result;
+		};
+
+		stream << "{\"traceEvents\": [";
+		for (const auto& buffer : buffers) {
+			stream << separator()
+				<< "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": "
+				<< buffer->getThreadId() << ", \"args\": {\"name\": \""
+				<< buffer->getThreadName() << "\"}}";
+
+			for (size_t i = 0; i < buffer->size(); i++) {
+				const TraceEvent& event = (*buffer)[i];
+				// Microseconds
+				stream << separator()
+					<< "{\"ph\": \"X\", \"name\": \"" << event.name
+					<< "\", \"cat\": \"" << event.category
+					<< "\", \"pid\": 1, \"tid\": " << buffer->getThreadId()
+					<< ", \"ts\": " << event.start / 1000 << '.' << digits(event.start % 1000)
+					<< ", \"dur\": " << event.duration / 1000 << '.' << digits(event.duration % 1000);
+
+				if (event.argumentNames[0]) {
+					stream << ", \"args\": {\"" << event.argumentNames[0] << "\": "
+						<< event.arguments[0];
+					if (event.argumentNames[1]) {
+						stream << ", \"" << event.argumentNames[1] << "\": "
+							<< event.arguments[1];
+					}
+					stream << '}';
+				}
+				stream << '}';
+			}
+
+			dropped += buffer->dropped();
+		}
+		stream << "\n], \"displayTimeUnit\": \"ms\", \"otherData\": {\"droppedEvents\": "
+			<< dropped << "}}\n";
+	}
+
+private:
+	mutable std::mutex mutex;
+	std::vector<std::unique_ptr<TraceBuffer>> buffers;
+	size_t capacity = DEFAULT_CAPACITY;
+	std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+	bool enabled = false;
+
+	// Three digits with leading zeros, for the fraction of a microsecond
+	static std::string digits(int64_t value) {
+		std::string result = std::to_string(value);
+		return std::string(3 - result.size(), '0') + result;
+	}
+};
+
+Tracer globalTracer;
+
+// Records the time between its construction and destruction as an event
+// on the calling thread, if it's being traced
+class TraceScope {
+public:
+	TraceScope(
+		const char* name,
+		const char* category = "render",
+		const char* argumentName0 = nullptr, int64_t argument0 = 0,
+		const char* argumentName1 = nullptr, int64_t argument1 = 0
+	) : buffer(TraceBuffer::current) {
+		if (!buffer)
+			return;
+
+		event = TraceEvent{
+			name, category, globalTracer.now(), 0,
+			{ argumentName0, argumentName1 }, { argument0, argument1 }
+		};
+	}
+
+	~TraceScope() {
+		if (!buffer)
+			return;
+
+		event.duration = globalTracer.now() - event.start;
+		buffer->record(event);
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+	TraceBuffer* buffer;
+	TraceEvent event;
+};
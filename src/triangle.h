@@ -0,0 +1,248 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "commons.h"
+#include "ray.h"
+#include "vec3.h"
+
+// a * b - c * d, never with the wrong sign.
+//
+// Compilers fuse a * b - c * d into one FMA when FMA is available, which
+// rounds only one of the products. The watertight test below relies on two
+// triangles sharing an edge computing the same value for it, and one fused
+// product breaks that. With FMA, Kahan's algorithm computes it almost
+// exactly instead, so the sign is always right.
+inline real differenceOfProducts(real a, real b, real c, real d) {
+#if defined(__FMA__)
+	real cd = c * d;
+	real error = std::fma(-c, d, cd);
+	return std::fma(a, b, -cd) + error;
+#else
+	return a * b - c * d;
+#endif
+}
+
+// Where a ray hits a triangle.
+// u and v are the barycentric weights of the triangle's second and third
+// vertices; the first one gets 1 - u - v.
+struct TriangleHit {
+	real t;
+	real u, v;
+};
+
+// A ray prepared for the watertight test below: the ray is sheared and
+// scaled so it points down +z from the origin, which turns the 3D test into
+// a 2D one.
+struct TriangleRay {
+	point3 origin;
+	// Axis the ray travels along the most, and the other two
+	int kx, ky, kz;
+	// Shear constants
+	real shearX, shearY, shearZ;
+
+	TriangleRay(const Ray& ray) : origin(ray.origin) {
+		const vec3& direction = ray.direction;
+
+		kz = Axis::X;
+		if (std::abs(direction.y) > std::abs(direction[kz]))
+			kz = Axis::Y;
+		if (std::abs(direction.z) > std::abs(direction[kz]))
+			kz = Axis::Z;
+
+		kx = (kz + 1) % 3;
+		ky = (kx + 1) % 3;
+
+		// Keep the winding of the triangles the same after the transform
+		if (direction[kz] < 0)
+			std::swap(kx, ky);
+
+		shearX = direction[kx] / direction[kz];
+		shearY = direction[ky] / direction[kz];
+		shearZ = 1 / direction[kz];
+	}
+};
+
+// Triangles stored as a structure of arrays, ready to be intersected.
+//
+// Uses the watertight ray/triangle test from Woop, Benthin and Wald (2013),
+// "Watertight Ray/Triangle Intersection". Rays can't slip through the edge
+// two triangles share because both triangles compute the exact same edge
+// function for it. That only holds when both see the exact same vertex
+// positions, which is why vertices are stored as-is instead of as edges.
+class TriangleArray {
+public:
+	TriangleArray() {}
+
+	size_t size() const { return normals[0].size(); }
+
+	// The arrays themselves, for saving and loading them in bulk: the
+	// corners corner by corner and axis by axis, then the normals
+	static constexpr int ARRAY_COUNT = 12;
+
+	std::vector<real>& array(int index) {
+		return index < 9 ? corners[index / 3][index % 3] : normals[index - 9];
+	}
+
+	const std::vector<real>& array(int index) const {
+		return index < 9 ? corners[index / 3][index % 3] : normals[index - 9];
+	}
+
+	void reserve(size_t count) {
+		for (auto& corner : corners)
+			for (auto& axis : corner)
+				axis.reserve(count);
+		for (auto& axis : normals)
+			axis.reserve(count);
+	}
+
+	void add(const point3& a, const point3& b, const point3& c) {
+		const point3* vertices[3] = { &a, &b, &c };
+		for (int corner = 0; corner < 3; corner++)
+			for (int axis = 0; axis < 3; axis++)
+				corners[corner][axis].push_back((*vertices[corner])[axis]);
+
+		auto normal = (b - a).cross(c - a);
+		auto length = normal.magnitude();
+		if (length > 0)
+			normal /= length;
+
+		for (int axis = 0; axis < 3; axis++)
+			normals[axis].push_back(normal[axis]);
+	}
+
+	point3 vertex(size_t triangle, int corner) const {
+		return point3(
+			corners[corner][Axis::X][triangle],
+			corners[corner][Axis::Y][triangle],
+			corners[corner][Axis::Z][triangle]
+		);
+	}
+
+	// Unit geometric normal, following the winding order of the vertices
+	vec3 normal(size_t triangle) const {
+		return vec3(
+			normals[Axis::X][triangle],
+			normals[Axis::Y][triangle],
+			normals[Axis::Z][triangle]
+		);
+	}
+
+	real area(size_t triangle) const {
+		auto a = vertex(triangle, 0);
+		auto b = vertex(triangle, 1);
+		auto c = vertex(triangle, 2);
+		return (b - a).cross(c - a).magnitude() / 2;
+	}
+
+	point3 interpolate(size_t triangle, real u, real v) const {
+		return (1 - u - v) * vertex(triangle, 0)
+			+ u * vertex(triangle, 1)
+			+ v * vertex(triangle, 2);
+	}
+
+	// Bound on the rounding error of interpolate(), per axis
+	vec3 interpolationError(size_t triangle, real u, real v) const {
+		real weights[3] = { 1 - u - v, u, v };
+		vec3 sum(0);
+		for (int corner = 0; corner < 3; corner++)
+			for (int axis = 0; axis < 3; axis++)
+				sum[axis] += std::abs(weights[corner] * corners[corner][axis][triangle]);
+
+		return roundingErrorBound(7) * sum;
+	}
+
+	std::optional<TriangleHit> intersect(
+		const TriangleRay& ray, size_t triangle, real tMin, real tMax
+	) const {
+		// Vertices relative to the ray origin
+		real ax = corners[0][ray.kx][triangle] - ray.origin[ray.kx];
+		real ay = corners[0][ray.ky][triangle] - ray.origin[ray.ky];
+		real az = corners[0][ray.kz][triangle] - ray.origin[ray.kz];
+		real bx = corners[1][ray.kx][triangle] - ray.origin[ray.kx];
+		real by = corners[1][ray.ky][triangle] - ray.origin[ray.ky];
+		real bz = corners[1][ray.kz][triangle] - ray.origin[ray.kz];
+		real cx = corners[2][ray.kx][triangle] - ray.origin[ray.kx];
+		real cy = corners[2][ray.ky][triangle] - ray.origin[ray.ky];
+		real cz = corners[2][ray.kz][triangle] - ray.origin[ray.kz];
+
+		// Shear so the ray runs along +z
+		ax -= ray.shearX * az;
+		ay -= ray.shearY * az;
+		bx -= ray.shearX * bz;
+		by -= ray.shearY * bz;
+		cx -= ray.shearX * cz;
+		cy -= ray.shearY * cz;
+
+		// Scaled barycentrics, i.e. edge functions
+		real edgeU = differenceOfProducts(cx, by, cy, bx);
+		real edgeV = differenceOfProducts(ax, cy, ay, cx);
+		real edgeW = differenceOfProducts(bx, ay, by, ax);
+
+		// Exactly on an edge: redo that edge in higher precision. Only the
+		// edges that came out zero are redone, so that two triangles sharing
+		// an edge always compute it the same way and agree on its sign.
+		using wide = long double;
+		if (edgeU == 0)
+			edgeU = static_cast<real>(wide(cx) * by - wide(cy) * bx);
+		if (edgeV == 0)
+			edgeV = static_cast<real>(wide(ax) * cy - wide(ay) * cx);
+		if (edgeW == 0)
+			edgeW = static_cast<real>(wide(bx) * ay - wide(by) * ax);
+
+		// The ray passes the triangle if it's on the same side of all edges
+		if ((edgeU < 0 || edgeV < 0 || edgeW < 0)
+			&& (edgeU > 0 || edgeV > 0 || edgeW > 0))
+			return {};
+
+		real determinant = edgeU + edgeV + edgeW;
+		if (determinant == 0)
+			return {};
+
+		// Distance along the ray, still scaled by the determinant
+		az *= ray.shearZ;
+		bz *= ray.shearZ;
+		cz *= ray.shearZ;
+		real scaledT = edgeU * az + edgeV * bz + edgeW * cz;
+
+		real inverseDeterminant = 1 / determinant;
+		real t = scaledT * inverseDeterminant;
+		if (t < tMin || t >= tMax)
+			return {};
+
+		// t can come out slightly positive for a ray leaving the
+		// triangle's own surface, so also reject t within its rounding
+		// error of 0 (pbrt, "Conservative Ray-Bounds Intersections")
+		real maxX = std::max({ std::abs(ax), std::abs(bx), std::abs(cx) });
+		real maxY = std::max({ std::abs(ay), std::abs(by), std::abs(cy) });
+		real maxZ = std::max({ std::abs(az), std::abs(bz), std::abs(cz) });
+		real maxEdge = std::max({ std::abs(edgeU), std::abs(edgeV), std::abs(edgeW) });
+
+		real deltaX = roundingErrorBound(5) * (maxX + maxZ);
+		real deltaY = roundingErrorBound(5) * (maxY + maxZ);
+		real deltaZ = roundingErrorBound(3) * maxZ;
+		real deltaEdge = 2 * (roundingErrorBound(2) * maxX * maxY
+			+ deltaY * maxX + deltaX * maxY);
+		real deltaT = 3 * (roundingErrorBound(3) * maxEdge * maxZ
+			+ deltaEdge * maxZ + deltaZ * maxEdge) * std::abs(inverseDeterminant);
+		if (t <= deltaT)
+			return {};
+
+		return TriangleHit{
+			/* t */ t,
+			/* u */ edgeV * inverseDeterminant,
+			/* v */ edgeW * inverseDeterminant
+		};
+	}
+
+private:
+	// corners[corner][axis][triangle]
+	std::vector<real> corners[3][3];
+	// normals[axis][triangle]
+	std::vector<real> normals[3];
+};
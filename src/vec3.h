@@ -1,6 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <math.h>
+#include <numbers>
+#include <type_traits>
+#include <utility>
 
 #include "commons.h"
 
@@ -12,65 +18,73 @@ enum Axis {
 	count = 3 // to help with for loops
 };
 
-class vec3 {
+// 3D vector of Scalar (float or double). The renderer uses vec3, which has
+// the precision the build was configured with (see real in commons.h).
+template<typename Scalar>
+class Vec3 {
 public:
 	union {
-		struct { double x, y, z; };
-		struct { double r, g, b; };
-		double elements[3];
+		struct { Scalar x, y, z; };
+		struct { Scalar r, g, b; };
+		Scalar elements[3];
 	};
 	
 
-	vec3() : elements{ 0, 0, 0 } {}
-	vec3(double a) : elements{ a, a, a } {}
-	vec3(double x, double y, double z) : elements{ x, y, z } {}
+	Vec3() : elements{ 0, 0, 0 } {}
+	Vec3(Scalar a) : elements{ a, a, a } {}
+	Vec3(Scalar x, Scalar y, Scalar z) : elements{ x, y, z } {}
 
-	double operator[](int i) const { return elements[i]; }
-	double& operator[](int i) { return elements[i]; }
+	// Between precisions, e.g. to redo something in double in a float build
+	template<typename OtherScalar>
+	explicit Vec3(const Vec3<OtherScalar>& v)
+		: elements{ Scalar(v.x), Scalar(v.y), Scalar(v.z) } {}
+
+	Scalar operator[](int i) const { return elements[i]; }
+	Scalar& operator[](int i) { return elements[i]; }
 
 	// Operators
-	inline vec3 operator+() const { return *this; }
-	inline vec3 operator-() const { return std::move(vec3(-x, -y, -z)); }
+	inline Vec3 operator+() const { return *this; }
+	inline Vec3 operator-() const { return std::move(Vec3(-x, -y, -z)); }
 
-	vec3& operator+=(const vec3& v) {
+	Vec3& operator+=(const Vec3& v) {
 		x += v.x;
 		y += v.y;
 		z += v.z;
 		return *this;
 	}
 
-	vec3& operator-=(const vec3& v) {
+	Vec3& operator-=(const Vec3& v) {
 		*this += -v;
 		return *this;
 	}
 
-	vec3& operator*=(const double scale) {
+	Vec3& operator*=(const Scalar scale) {
 		x *= scale;
 		y *= scale;
 		z *= scale;
 		return *this;
 	}
 
-	vec3& operator*=(const vec3& v) {
+	Vec3& operator*=(const Vec3& v) {
 		x *= v.x;
 		y *= v.y;
 		z *= v.z;
 		return *this;
 	}
 
-	vec3& operator/=(const double scale) {
-		*this *= 1.0 / scale;
+	Vec3& operator/=(const Scalar scale) {
+		*this *= Scalar(1) / scale;
 		return *this;
 	}
 
 	// Utility functions
-	inline double dot(const vec3 &b) const {
+	inline Scalar dot(const Vec3 &b) const {
 		return x * b.x + y * b.y + z * b.z;
 	}
 
-	inline vec3 cross(const vec3 &b) const {
+	inline Vec3 cross(const Vec3 &b) const {
 		return std::move(
-			vec3(
+			Vec3(
 				y * b.z - z * b.y,
 				z * b.x - x * b.z,
 				x * b.y - y * b.x
@@ -80,27 +94,31 @@ public:
 
 	// Declare other methods (definition below)
 	
-	inline double squareMagnitude() const;
-	inline double magnitude() const;
-	inline vec3 unit() const;
+	inline Scalar squareMagnitude() const;
+	inline Scalar magnitude() const;
+	inline Vec3 unit() const;
+	inline Scalar maxComponent() const;
 	inline bool nearZero() const;
-	vec3 reflect(const vec3& normal) const;
-	vec3 refract(const vec3& normal, double iorRatio) const;
+	Vec3 reflect(const Vec3& normal) const;
+	Vec3 refract(const Vec3& normal, Scalar iorRatio) const;
 
 	// Declare static methods (definition below)
 	
-	static vec3 lerp(const vec3& a, const vec3& b, const double t);
-	static vec3 random(RandomNumberGenerator& rng);
-	static vec3 random(RandomNumberGenerator& rng, double min, double max);
-	static vec3 randomInUnitSphere(RandomNumberGenerator& rng);
-	static vec3 randomOnUnitSphere(RandomNumberGenerator& rng);
-	static vec3 randomInUnitDisk(RandomNumberGenerator& rng);
+	static Vec3 lerp(const Vec3& a, const Vec3& b, const Scalar t);
+	static Vec3 random(RandomNumberGenerator& rng);
+	static Vec3 random(RandomNumberGenerator& rng, Scalar min, Scalar max);
+	// Uniform points from uniform numbers u, v, w in [0, 1)
+	static Vec3 inUnitSphere(Scalar u, Scalar v, Scalar w);
+	static Vec3 onUnitSphere(Scalar u, Scalar v);
+	static Vec3 inUnitDisk(Scalar u, Scalar v);
 
 	void fprint(FILE* stream) {
-		fprintf(stream, "(%.3f, %.3f, %.3f)", x, y, z);
+		fprintf(stream, "(%.3f, %.3f, %.3f)", double(x), double(y), double(z));
 	}
 };
 
+using vec3 = Vec3<real>;
+
 // Type aliases to prevent arithmetic between colors, geometrical points, etc.
 using point3 = vec3;
 using color3 = vec3;
@@ -108,36 +126,46 @@ using color3 = vec3;
 
 // Utility functions
 
-inline vec3 operator+(const vec3& a, const vec3& b) {
+template<typename Scalar>
+inline Vec3<Scalar> operator+(const Vec3<Scalar>& a, const Vec3<Scalar>& b) {
 	return std::move(
-		vec3(
+		Vec3<Scalar>(
 			a.x + b.x,
 			a.y + b.y,
 			a.z + b.z
 		)
 	);
 }
-inline vec3 operator-(const vec3& a, const vec3& b) {
+template<typename Scalar>
+inline Vec3<Scalar> operator-(const Vec3<Scalar>& a, const Vec3<Scalar>& b) {
 	return a + -b;
 }
 
-inline vec3 operator*(const vec3& a, const double scale) {
+// The scale is taken as-is (double literals included) and rounded to the
+// vector's precision, so that 0.5 * v stays a float vector in a float build
+template<typename Scalar, typename Scale>
+	requires std::is_arithmetic_v<Scale>
+inline Vec3<Scalar> operator*(const Vec3<Scalar>& a, const Scale scale) {
+	auto s = static_cast<Scalar>(scale);
 	return std::move(
-		vec3(
-			a.x * scale,
-			a.y * scale,
-			a.z * scale
+		Vec3<Scalar>(
+			a.x * s,
+			a.y * s,
+			a.z * s
 		)
 	);
 }
 
-inline vec3 operator*(const double scale, const vec3& a) {
+template<typename Scalar, typename Scale>
+	requires std::is_arithmetic_v<Scale>
+inline Vec3<Scalar> operator*(const Scale scale, const Vec3<Scalar>& a) {
 	return a * scale;
 }
 
-inline vec3 operator*(const vec3& a, const vec3& b) {
+template<typename Scalar>
+inline Vec3<Scalar> operator*(const Vec3<Scalar>& a, const Vec3<Scalar>& b) {
 	return std::move(
-		vec3(
+		Vec3<Scalar>(
 			a.x * b.x,
 			a.y * b.y,
 			a.z * b.z
@@ -145,41 +173,57 @@ inline vec3 operator*(const vec3& a, const vec3& b) {
 	);
 }
 
-inline vec3 operator/(const vec3 a, const double scale) {
-	return a * (1.0 / scale);
+template<typename Scalar, typename Scale>
+	requires std::is_arithmetic_v<Scale>
+inline Vec3<Scalar> operator/(const Vec3<Scalar> a, const Scale scale) {
+	return a * (Scalar(1) / static_cast<Scalar>(scale));
 }
 
 
 // Other methods
-inline double vec3::squareMagnitude() const {
+template<typename Scalar>
+inline Scalar Vec3<Scalar>::squareMagnitude() const {
 	return this->dot(*this);
 }
 
-inline double vec3::magnitude() const {
-	return sqrt(squareMagnitude());
+template<typename Scalar>
+inline Scalar Vec3<Scalar>::magnitude() const {
+	return std::sqrt(squareMagnitude());
 }
 
-inline vec3 vec3::unit() const {
+template<typename Scalar>
+inline Vec3<Scalar> Vec3<Scalar>::unit() const {
 	return *this / magnitude();
 }
 
-inline bool vec3::nearZero() const {
-	constexpr double epsilon = 1e-8;
-	return squareMagnitude() < epsilon;
+template<typename Scalar>
+inline Scalar Vec3<Scalar>::maxComponent() const {
+	return std::max({ x, y, z });
+}
+
+// Whether every component is tiny compared to 1, the length of the unit
+// vectors this is used on. Scaled to the precision, since float can't
+// resolve 1e-8 next to 1.
+template<typename Scalar>
+inline bool Vec3<Scalar>::nearZero() const {
+	static const Scalar epsilon = std::sqrt(std::numeric_limits<Scalar>::epsilon());
+	return std::abs(x) < epsilon && std::abs(y) < epsilon && std::abs(z) < epsilon;
 }
 
-vec3 vec3::reflect(const vec3& normal) const {
+template<typename Scalar>
+Vec3<Scalar> Vec3<Scalar>::reflect(const Vec3& normal) const {
 	auto unitNormal = normal.unit();
 	return *this - 2 * this->dot(unitNormal) * unitNormal;
 }
 
-vec3 vec3::refract(const vec3& normal, double iorRatio) const {
+template<typename Scalar>
+Vec3<Scalar> Vec3<Scalar>::refract(const Vec3& normal, Scalar iorRatio) const {
 	auto rayIn = this->unit();
-	auto cosTheta = std::min<double>(-rayIn.dot(normal), 1.0);
-	vec3 perpendicularComponent = iorRatio * (rayIn + normal * cosTheta);
-	vec3 parallelComponent = 
+	auto cosTheta = std::min<Scalar>(-rayIn.dot(normal), 1);
+	Vec3 perpendicularComponent = iorRatio * (rayIn + normal * cosTheta);
+	Vec3 parallelComponent = 
 		-std::sqrt(
-			std::abs(1.0 - perpendicularComponent.squareMagnitude())
+			std::abs(1 - perpendicularComponent.squareMagnitude())
 		) * normal;
 	return perpendicularComponent + parallelComponent;
 }
@@ -187,44 +231,53 @@ vec3 vec3::refract(const vec3& normal, double iorRatio) const {
 // Static methods
 
 // Linear interpolation
-vec3 vec3::lerp(const vec3& a, const vec3& b, const double t) {
-	return (1.0 - t) * a + t * b;
+template<typename Scalar>
+Vec3<Scalar> Vec3<Scalar>::lerp(const Vec3& a, const Vec3& b, const Scalar t) {
+	return (1 - t) * a + t * b;
 }
 
-vec3 vec3::random(RandomNumberGenerator& rng) {
-	return vec3(rng.randomDouble(), rng.randomDouble(), rng.randomDouble());
+template<typename Scalar>
+Vec3<Scalar> Vec3<Scalar>::random(RandomNumberGenerator& rng) {
+	return Vec3(
+		Scalar(rng.randomDouble()),
+		Scalar(rng.randomDouble()),
+		Scalar(rng.randomDouble())
+	);
 }
 
-vec3 vec3::random(RandomNumberGenerator& rng, double min, double max) {
-	return vec3::random(rng) * (max - min) + vec3(min);
+template<typename Scalar>
+Vec3<Scalar> Vec3<Scalar>::random(RandomNumberGenerator& rng, Scalar min, Scalar max) {
+	return Vec3::random(rng) * (max - min) + Vec3(min);
 }
 
 // Read details:
 // http://extremelearning.com.au/how-to-generate-uniformly-random-points-on-n-spheres-and-n-balls/
-vec3 vec3::randomInUnitSphere(RandomNumberGenerator& rng) {
-	auto radius = std::cbrt(rng.randomDouble());
-	return radius * vec3::randomOnUnitSphere(rng);
+template<typename Scalar>
+Vec3<Scalar> Vec3<Scalar>::inUnitSphere(Scalar u, Scalar v, Scalar w) {
+	auto radius = std::cbrt(w);
+	return radius * Vec3::onUnitSphere(u, v);
 }
 
-vec3 vec3::randomOnUnitSphere(RandomNumberGenerator& rng) {
-	auto cosTheta = rng.randomDouble(-1.0, 1.0);
-	auto sinTheta = std::sqrt(1 - cosTheta * cosTheta);
+template<typename Scalar>
+Vec3<Scalar> Vec3<Scalar>::onUnitSphere(Scalar u, Scalar v) {
+	auto cosTheta = 1 - 2 * u;
+	auto sinTheta = std::sqrt(std::max<Scalar>(1 - cosTheta * cosTheta, 0));
 	
-	auto phi = rng.randomDouble(0.0, 2 * std::numbers::pi);
-	return vec3(
+	auto phi = 2 * std::numbers::pi_v<Scalar> * v;
+	return Vec3(
 		std::cos(phi) * sinTheta, // stops samples from gathering at the poles
 		std::sin(phi) * sinTheta,
 		cosTheta
 	);
 }
 
-vec3 vec3::randomInUnitDisk(RandomNumberGenerator& rng) {
-	auto radius = std::sqrt(rng.randomDouble());
-	auto theta = rng.randomDouble(0.0, 2 * std::numbers::pi);
-	return vec3(
+template<typename Scalar>
+Vec3<Scalar> Vec3<Scalar>::inUnitDisk(Scalar u, Scalar v) {
+	auto radius = std::sqrt(u);
+	auto theta = 2 * std::numbers::pi_v<Scalar> * v;
+	return Vec3(
 		radius * std::cos(theta),
 		radius * std::sin(theta),
-		0.0
+		0
 	);
 }
-
@@ -0,0 +1,925 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include "bounding_box.h"
+#include "bounding_volume_hierarchy.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "ray_packet.h"
+#include "stats.h"
+
+// 8 children fill one (float) or two (double) AVX registers, without AVX 4
+// is the sweet spot
+#if defined(__AVX__)
+constexpr int DEFAULT_BVH_WIDTH = 8;
+#else
+constexpr int DEFAULT_BVH_WIDTH = 4;
+#endif
+
+#if defined(__AVX__)
+// Thin wrappers over one SIMD register of reals, so that the slab test of
+// WideBvhNode is written once for both precisions
+struct SimdDouble4 {
+	using Register = __m256d;
+	static constexpr int SIZE = 4;
+
+	static Register broadcast(double value) { return _mm256_set1_pd(value); }
+	static Register load(const double* values) { return _mm256_load_pd(values); }
+	static void store(double* values, Register a) { _mm256_storeu_pd(values, a); }
+	static Register subtract(Register a, Register b) { return _mm256_sub_pd(a, b); }
+	static Register multiply(Register a, Register b) { return _mm256_mul_pd(a, b); }
+	static Register min(Register a, Register b) { return _mm256_min_pd(a, b); }
+	static Register max(Register a, Register b) { return _mm256_max_pd(a, b); }
+	static int lessOrEqualMask(Register a, Register b) {
+		return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LE_OQ));
+	}
+};
+
+struct SimdFloat8 {
+	using Register = __m256;
+	static constexpr int SIZE = 8;
+
+	static Register broadcast(float value) { return _mm256_set1_ps(value); }
+	static Register load(const float* values) { return _mm256_load_ps(values); }
+	static void store(float* values, Register a) { _mm256_storeu_ps(values, a); }
+	static Register subtract(Register a, Register b) { return _mm256_sub_ps(a, b); }
+	static Register multiply(Register a, Register b) { return _mm256_mul_ps(a, b); }
+	static Register min(Register a, Register b) { return _mm256_min_ps(a, b); }
+	static Register max(Register a, Register b) { return _mm256_max_ps(a, b); }
+	static int lessOrEqualMask(Register a, Register b) {
+		return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ));
+	}
+};
+
+struct SimdFloat4 {
+	using Register = __m128;
+	static constexpr int SIZE = 4;
+
+	static Register broadcast(float value) { return _mm_set1_ps(value); }
+	static Register load(const float* values) { return _mm_load_ps(values); }
+	static void store(float* values, Register a) { _mm_storeu_ps(values, a); }
+	static Register subtract(Register a, Register b) { return _mm_sub_ps(a, b); }
+	static Register multiply(Register a, Register b) { return _mm_mul_ps(a, b); }
+	static Register min(Register a, Register b) { return _mm_min_ps(a, b); }
+	static Register max(Register a, Register b) { return _mm_max_ps(a, b); }
+	static int lessOrEqualMask(Register a, Register b) {
+		return _mm_movemask_ps(_mm_cmp_ps(a, b, _CMP_LE_OQ));
+	}
+};
+
+// Widest of the above that evenly divides Width children, void if none does
+template<int Width>
+using SimdForWidth = std::conditional_t<
+	std::is_same_v<real, double>,
+	std::conditional_t<Width % 4 == 0, SimdDouble4, void>,
+	std::conditional_t<Width % 8 == 0, SimdFloat8,
+		std::conditional_t<Width % 4 == 0, SimdFloat4, void>>
+>;
+#endif
+
+// Node of a BVH with up to Width children, laid out so that one ray can be
+// tested against all children at once.
+//
+// Child bounds are stored as a structure of arrays:
+// bounds[0][axis] holds the minimum corners of all children along that axis,
+// bounds[1][axis] the maximum corners.
+template<int Width>
+struct alignas(64) WideBvhNode {
+	static constexpr uint32_t EMPTY = std::numeric_limits<uint32_t>::max();
+
+	real bounds[2][3][Width];
+
+	// Interior child: index of its node
+	// Leaf child: index of its first primitive
+	// Unused slot: EMPTY
+	uint32_t children[Width];
+	// 0 for interior children and unused slots
+	uint16_t primitiveCounts[Width];
+
+	WideBvhNode() {
+		// Inverted bounds so that unused slots never get hit
+		for (int axis = 0; axis < 3; axis++) {
+			for (int lane = 0; lane < Width; lane++) {
+				bounds[0][axis][lane] = std::numeric_limits<real>::infinity();
+				bounds[1][axis][lane] = -std::numeric_limits<real>::infinity();
+			}
+		}
+
+		for (int lane = 0; lane < Width; lane++) {
+			children[lane] = EMPTY;
+			primitiveCounts[lane] = 0;
+		}
+	}
+
+	void setBounds(int lane, const BoundingBox& box) {
+		for (int axis = 0; axis < 3; axis++) {
+			bounds[0][axis][lane] = box.cornerMin[axis];
+			bounds[1][axis][lane] = box.cornerMax[axis];
+		}
+	}
+
+	// Slab test of the lanes of a packet against one child. Returns the
+	// lanes that hit it, and where the first of them enters it in tNear.
+	uint32_t hitByPacket(
+		int child,
+		const RayPacket& packet,
+		uint32_t laneMask,
+		real tMin,
+		const real tMax[RayPacket::MAX_SIZE],
+		real& tNear
+	) const;
+
+	// Slab test of the ray against every child. Returns a bitmask of the
+	// children that were hit and writes where the ray enters each of them
+	// to tNear. Unused slots are never hit by finite rays, but NaNs are
+	// ignored, so the ray has to be finite (see Ray::isFinite()).
+	int hitChildren(
+		const InverseRay& ray, real tMin, real tMax, real tNear[Width]
+	) const;
+};
+
+template<int Width>
+int WideBvhNode<Width>::hitChildren(
+	const InverseRay& ray, real tMin, real tMax, real tNear[Width]
+) const {
+	int hitMask = 0;
+
+#if defined(__AVX__)
+	using Simd = SimdForWidth<Width>;
+
+	if constexpr (!std::is_void_v<Simd>) {
+		using Register = typename Simd::Register;
+		const Register scale = Simd::broadcast(BoundingBox::ROUNDING_ERROR_SCALE);
+
+		for (int lane = 0; lane < Width; lane += Simd::SIZE) {
+			Register entry = Simd::broadcast(tMin);
+			Register exit = Simd::broadcast(tMax);
+
+			for (int axis = 0; axis < 3; axis++) {
+				int isNegative = ray.directionIsNegative[axis];
+				const Register origin = Simd::broadcast(ray.origin[axis]);
+				const Register inverseDirection =
+					Simd::broadcast(ray.inverseDirection[axis]);
+
+				Register nearPlane = Simd::load(&bounds[isNegative][axis][lane]);
+				Register farPlane = Simd::load(&bounds[1 - isNegative][axis][lane]);
+
+				Register t0 = Simd::multiply(
+					Simd::subtract(nearPlane, origin), inverseDirection
+				);
+				Register t1 = Simd::multiply(
+					Simd::multiply(Simd::subtract(farPlane, origin), inverseDirection),
+					scale
+				);
+
+				// NaNs (0 * infinity) pick the second operand, i.e. are ignored
+				entry = Simd::max(t0, entry);
+				exit = Simd::min(t1, exit);
+			}
+
+			Simd::store(&tNear[lane], entry);
+			hitMask |= Simd::lessOrEqualMask(entry, exit) << lane;
+		}
+
+		return hitMask;
+	}
+#endif
+
+	for (int lane = 0; lane < Width; lane++) {
+		real entry = tMin;
+		real exit = tMax;
+
+		for (int axis = 0; axis < 3; axis++) {
+			int isNegative = ray.directionIsNegative[axis];
+			real t0 = (bounds[isNegative][axis][lane] - ray.origin[axis])
+				* ray.inverseDirection[axis];
+			real t1 = (bounds[1 - isNegative][axis][lane] - ray.origin[axis])
+				* ray.inverseDirection[axis]
+				* BoundingBox::ROUNDING_ERROR_SCALE;
+
+			entry = t0 > entry ? t0 : entry;
+			exit = t1 < exit ? t1 : exit;
+		}
+
+		tNear[lane] = entry;
+		if (entry <= exit)
+			hitMask |= 1 << lane;
+	}
+
+	return hitMask;
+}
+
+template<int Width>
+uint32_t WideBvhNode<Width>::hitByPacket(
+	int child,
+	const RayPacket& packet,
+	uint32_t laneMask,
+	real tMin,
+	const real tMax[RayPacket::MAX_SIZE],
+	real& tNear
+) const {
+	const real boxMin[3] = {
+		bounds[0][0][child], bounds[0][1][child], bounds[0][2][child]
+	};
+	const real boxMax[3] = {
+		bounds[1][0][child], bounds[1][1][child], bounds[1][2][child]
+	};
+
+	// Cheap early out for the whole packet
+	real farthestTMax = tMin;
+	forEachLane(laneMask, [&](int lane) {
+		farthestTMax = std::max(farthestTMax, tMax[lane]);
+	});
+	if (!packet.mayHit(boxMin, boxMax, tMin, farthestTMax))
+		return 0;
+
+	// Then every lane on its own. Branchless so the loop vectorizes.
+	real entries[RayPacket::MAX_SIZE];
+	uint32_t hitMask = 0;
+
+	for (int lane = 0; lane < packet.size; lane++) {
+		real entry = tMin;
+		real exit = tMax[lane];
+
+		for (int axis = 0; axis < 3; axis++) {
+			real t0 = (boxMin[axis] - packet.origin[axis][lane])
+				* packet.inverseDirection[axis][lane];
+			real t1 = (boxMax[axis] - packet.origin[axis][lane])
+				* packet.inverseDirection[axis][lane];
+
+			real tNearPlane = t0 < t1 ? t0 : t1;
+			real tFarPlane = (t0 < t1 ? t1 : t0) * BoundingBox::ROUNDING_ERROR_SCALE;
+
+			entry = tNearPlane > entry ? tNearPlane : entry;
+			exit = tFarPlane < exit ? tFarPlane : exit;
+		}
+
+		entries[lane] = entry;
+		hitMask |= static_cast<uint32_t>(entry <= exit) << lane;
+	}
+
+	hitMask &= laneMask;
+
+	tNear = std::numeric_limits<real>::infinity();
+	forEachLane(hitMask, [&](int lane) {
+		tNear = std::min(tNear, entries[lane]);
+	});
+
+	return hitMask;
+}
+
+// BVH with Width children per node (BVH4, BVH8), made by collapsing a binary
+// BvhTree. Every node tests all of its children in one go with SIMD, and
+// children are visited nearest first.
+//
+// Leaves are the leaves of the binary tree, so primitives are stored in the
+// order given by primitiveOrder, same as for BvhTree.
+template<int Width>
+class WideBvhTree {
+public:
+	static_assert(Width >= 2 && Width <= 16, "Unsupported BVH width");
+
+	using Node = WideBvhNode<Width>;
+
+	std::vector<Node> nodes;
+	std::vector<uint32_t> primitiveOrder;
+
+	WideBvhTree() {}
+
+	WideBvhTree(const BvhTree& binaryTree) :
+		primitiveOrder(binaryTree.primitiveOrder),
+		aabb(binaryTree.boundingBox()) {
+		nodes.reserve(binaryTree.nodes.size() / (Width - 1) + 1);
+		collapse(binaryTree, 0);
+	}
+
+	// Tree built before, e.g. loaded from a scene cache
+	WideBvhTree(std::vector<Node> nodes, const BoundingBox& aabb) :
+		nodes(std::move(nodes)), aabb(aabb) {}
+
+	const BoundingBox& boundingBox() const {
+		return aabb;
+	}
+
+	// Whether traversal stays in bounds on these nodes, over primitiveCount
+	// primitives: every child comes after its parent and exists, every leaf
+	// is within the primitives, unused slots can't be hit, and the tree is
+	// no deeper than the traversal stack allows. For trees read from files.
+	bool isValid(size_t primitiveCount) const {
+		if (nodes.empty())
+			return false;
+
+		// Levels of the nodes, 1 for the root. Parents come first.
+		std::vector<int> levels(nodes.size(), 0);
+		levels[0] = 1;
+
+		for (size_t index = 0; index < nodes.size(); index++) {
+			const Node& node = nodes[index];
+			if (levels[index] == 0 || levels[index] > BvhTree::MAX_DEPTH)
+				return false;
+
+			for (int lane = 0; lane < Width; lane++) {
+				uint32_t child = node.children[lane];
+				if (child == Node::EMPTY) {
+					for (int axis = 0; axis < 3; axis++) {
+						if (node.bounds[0][axis][lane] != std::numeric_limits<real>::infinity()
+							|| node.bounds[1][axis][lane] != -std::numeric_limits<real>::infinity())
+							return false;
+					}
+					continue;
+				}
+
+				if (node.primitiveCounts[lane] > 0) {
+					if (uint64_t(child) + node.primitiveCounts[lane] > primitiveCount)
+						return false;
+					continue;
+				}
+
+				if (child <= index || child >= nodes.size())
+					return false;
+				levels[child] = std::max(levels[child], levels[index] + 1);
+			}
+		}
+
+		return true;
+	}
+
+	// Recomputes every node's bounds for primitives that moved, keeping the
+	// shape of the tree. primitiveBounds(i) gives the bounds of the
+	// primitive at position i of the leaves. Children come after their
+	// parent in nodes, so one pass from the back sees every child before
+	// its parent.
+	template<typename PrimitiveBounds>
+	void refit(PrimitiveBounds&& primitiveBounds) {
+		for (size_t index = nodes.size(); index-- > 0;) {
+			Node& node = nodes[index];
+
+			for (int lane = 0; lane < Width; lane++) {
+				if (node.children[lane] == Node::EMPTY)
+					continue;
+
+				BoundingBox box;
+				if (node.primitiveCounts[lane] > 0) {
+					uint32_t first = node.children[lane];
+					box = primitiveBounds(first);
+					for (uint32_t i = 1; i < node.primitiveCounts[lane]; i++)
+						box = BoundingBox::merge(box, primitiveBounds(first + i));
+				}
+				else {
+					box = nodeBounds(nodes[node.children[lane]]);
+				}
+
+				node.setBounds(lane, box);
+			}
+		}
+
+		if (!nodes.empty())
+			aabb = nodeBounds(nodes[0]);
+	}
+
+	// Expected cost of a ray that hits the root by the surface area
+	// heuristic: visiting a node costs 1, and so does every primitive
+	// tested in a leaf. Refitting after things move apart makes boxes
+	// overlap and grow, which shows as a higher cost than the tree had
+	// when built.
+	double sahCost() const {
+		double rootArea = aabb.surfaceArea();
+		if (nodes.empty() || !(rootArea > 0))
+			return 0;
+
+		double cost = 1;
+		for (const auto& node : nodes) {
+			for (int lane = 0; lane < Width; lane++) {
+				if (node.children[lane] == Node::EMPTY)
+					continue;
+
+				double area = laneBounds(node, lane).surfaceArea();
+				double laneCost = node.primitiveCounts[lane] > 0 ? node.primitiveCounts[lane] : 1;
+				cost += area / rootArea * laneCost;
+			}
+		}
+		return cost;
+	}
+
+	// Same contract as BvhTree::traverse()
+	template<typename IntersectPrimitive>
+	bool traverse(
+		const Ray& ray,
+		real tMin,
+		real tMax,
+		IntersectPrimitive&& intersect
+	) const {
+		// Would get into unused child slots, see hitChildren()
+		if (!ray.isFinite())
+			return false;
+
+		return traverseFrom(
+			InverseRay(ray), StackEntry{ 0, 0, tMin }, tMin, tMax, intersect
+		);
+	}
+
+	// Same contract as BvhTree::traverseAny()
+	template<typename TestPrimitive>
+	bool traverseAny(
+		const Ray& ray,
+		real tMin,
+		real tMax,
+		TestPrimitive&& test
+	) const {
+		if (!ray.isFinite())
+			return false;
+
+		const InverseRay inverseRay(ray);
+		TraversalCounts counts;
+
+		StackEntry stack[STACK_SIZE];
+		int stackSize = 0;
+		stack[stackSize++] = StackEntry{ 0, 0, tMin };
+
+		while (stackSize > 0) {
+			StackEntry entry = stack[--stackSize];
+
+			if (entry.primitiveCount > 0) {
+				for (uint32_t i = 0; i < entry.primitiveCount; i++) {
+					counts.primitiveTests++;
+					if (test(entry.index + i))
+						return true;
+				}
+				continue;
+			}
+
+			const Node& node = nodes[entry.index];
+			counts.nodesVisited++;
+			counts.boxTests += Width;
+			real tNear[Width];
+			int hitMask = node.hitChildren(inverseRay, tMin, tMax, tNear);
+
+			// No sorting, any hit will do
+			forEachLane(hitMask, [&](int lane) {
+				stack[stackSize++] = StackEntry{
+					node.children[lane], node.primitiveCounts[lane], tNear[lane]
+				};
+			});
+		}
+
+		return false;
+	}
+
+	// Traces the lanes of a packet in laneMask together.
+	//
+	// intersect(i, laneMask) is called for every primitive i reached by the
+	// lanes in laneMask. It should lower tMax[lane] of the lanes that hit it.
+	//
+	// Once only a single lane is left in a subtree the packet has diverged,
+	// and that lane carries on with the single ray traversal.
+	template<typename IntersectPrimitive>
+	void traversePacket(
+		const RayPacket& packet,
+		uint32_t laneMask,
+		real tMin,
+		real tMax[RayPacket::MAX_SIZE],
+		IntersectPrimitive&& intersect
+	) const {
+		PacketStackEntry stack[STACK_SIZE];
+		int stackSize = 0;
+		stack[stackSize++] = { 0, 0, laneMask, tMin };
+		TraversalCounts counts;
+
+		while (stackSize > 0) {
+			PacketStackEntry entry = stack[--stackSize];
+
+			// Drop the lanes that hit something closer since the entry was
+			// pushed
+			forEachLane(entry.laneMask, [&](int lane) {
+				if (entry.tNear > tMax[lane])
+					entry.laneMask &= ~(1u << lane);
+			});
+			if (entry.laneMask == 0)
+				continue;
+
+			if (std::has_single_bit(entry.laneMask)) {
+				int lane = std::countr_zero(entry.laneMask);
+				Ray ray = packet.ray(lane);
+				if (!ray.isFinite())
+					continue;
+
+				traverseFrom(
+					InverseRay(ray),
+					StackEntry{ entry.index, entry.primitiveCount, entry.tNear },
+					tMin,
+					tMax[lane],
+					[&](uint32_t i, real&) {
+						intersect(i, entry.laneMask);
+						return false;
+					}
+				);
+				continue;
+			}
+
+			// Tests of the whole packet count once per lane
+			int laneCount = std::popcount(entry.laneMask);
+
+			if (entry.primitiveCount > 0) {
+				counts.primitiveTests += entry.primitiveCount * laneCount;
+				for (uint32_t i = 0; i < entry.primitiveCount; i++)
+					intersect(entry.index + i, entry.laneMask);
+				continue;
+			}
+
+			const Node& node = nodes[entry.index];
+			counts.nodesVisited++;
+
+			// Push the children hit by any lane, farthest first
+			int firstPushed = stackSize;
+			for (int child = 0; child < Width; child++) {
+				if (node.children[child] == Node::EMPTY)
+					continue;
+
+				counts.boxTests += laneCount;
+				real tNear;
+				uint32_t childMask =
+					node.hitByPacket(child, packet, entry.laneMask, tMin, tMax, tNear);
+				if (childMask == 0)
+					continue;
+
+				PacketStackEntry childEntry = {
+					node.children[child],
+					node.primitiveCounts[child],
+					childMask,
+					tNear
+				};
+
+				int position = stackSize++;
+				while (position > firstPushed
+					&& stack[position - 1].tNear < childEntry.tNear) {
+					stack[position] = stack[position - 1];
+					position--;
+				}
+				stack[position] = childEntry;
+			}
+		}
+	}
+
+	// Any-hit version of traversePacket(), for shadow rays. test(i, laneMask)
+	// returns the lanes of laneMask that primitive i blocks, which need no
+	// more tests. Returns all the blocked lanes.
+	template<typename TestPrimitive>
+	uint32_t traverseAnyPacket(
+		const RayPacket& packet,
+		uint32_t laneMask,
+		real tMin,
+		const real tMax[RayPacket::MAX_SIZE],
+		TestPrimitive&& test
+	) const {
+		PacketStackEntry stack[STACK_SIZE];
+		int stackSize = 0;
+		stack[stackSize++] = { 0, 0, laneMask, tMin };
+		TraversalCounts counts;
+		uint32_t blocked = 0;
+
+		while (stackSize > 0) {
+			PacketStackEntry entry = stack[--stackSize];
+
+			entry.laneMask &= ~blocked;
+			if (entry.laneMask == 0)
+				continue;
+
+			if (entry.primitiveCount > 0) {
+				for (uint32_t i = 0; i < entry.primitiveCount && entry.laneMask != 0; i++) {
+					counts.primitiveTests += std::popcount(entry.laneMask);
+					uint32_t hitMask = test(entry.index + i, entry.laneMask);
+					blocked |= hitMask;
+					entry.laneMask &= ~hitMask;
+				}
+
+				if (blocked == laneMask)
+					break;
+				continue;
+			}
+
+			const Node& node = nodes[entry.index];
+			counts.nodesVisited++;
+			int laneCount = std::popcount(entry.laneMask);
+
+			// No sorting, any hit will do
+			for (int child = 0; child < Width; child++) {
+				if (node.children[child] == Node::EMPTY)
+					continue;
+
+				counts.boxTests += laneCount;
+				real tNear;
+				uint32_t childMask =
+					node.hitByPacket(child, packet, entry.laneMask, tMin, tMax, tNear);
+				if (childMask == 0)
+					continue;
+
+				stack[stackSize++] = {
+					node.children[child], node.primitiveCounts[child], childMask, tNear
+				};
+			}
+		}
+
+		return blocked;
+	}
+
+private:
+	struct StackEntry {
+		uint32_t index;
+		uint16_t primitiveCount;
+		real tNear;
+	};
+
+	struct PacketStackEntry {
+		uint32_t index;
+		uint16_t primitiveCount;
+		uint32_t laneMask;
+		real tNear; // closest entry of all lanes in laneMask
+	};
+
+	template<typename IntersectPrimitive>
+	bool traverseFrom(
+		const InverseRay& inverseRay,
+		StackEntry start,
+		real tMin,
+		real& tMax,
+		IntersectPrimitive&& intersect
+	) const {
+		bool hitAnything = false;
+		TraversalCounts counts;
+
+		StackEntry stack[STACK_SIZE];
+		int stackSize = 0;
+		stack[stackSize++] = start;
+
+		while (stackSize > 0) {
+			StackEntry entry = stack[--stackSize];
+
+			// Something closer was hit after this entry was pushed
+			if (entry.tNear > tMax)
+				continue;
+
+			if (entry.primitiveCount > 0) {
+				counts.primitiveTests += entry.primitiveCount;
+				for (uint32_t i = 0; i < entry.primitiveCount; i++) {
+					if (intersect(entry.index + i, tMax))
+						hitAnything = true;
+				}
+				continue;
+			}
+
+			const Node& node = nodes[entry.index];
+			counts.nodesVisited++;
+			counts.boxTests += Width;
+			real tNear[Width];
+			int hitMask = node.hitChildren(inverseRay, tMin, tMax, tNear);
+
+			// Push the hit children farthest first, so the nearest one is
+			// on top of the stack
+			int firstPushed = stackSize;
+			for (int lane = 0; lane < Width; lane++) {
+				if (!(hitMask & (1 << lane)))
+					continue;
+
+				StackEntry child = {
+					node.children[lane], node.primitiveCounts[lane], tNear[lane]
+				};
+
+				// Insertion sort, at most Width entries
+				int position = stackSize++;
+				while (position > firstPushed
+					&& stack[position - 1].tNear < child.tNear) {
+					stack[position] = stack[position - 1];
+					position--;
+				}
+				stack[position] = child;
+			}
+		}
+
+		return hitAnything;
+	}
+
+	// Every level of the tree leaves at most Width - 1 entries behind
+	static constexpr int STACK_SIZE = BvhTree::MAX_DEPTH * (Width - 1) + 1;
+
+	BoundingBox aabb;
+
+	static BoundingBox laneBounds(const Node& node, int lane) {
+		point3 cornerMin, cornerMax;
+		for (int axis = 0; axis < 3; axis++) {
+			cornerMin[axis] = node.bounds[0][axis][lane];
+			cornerMax[axis] = node.bounds[1][axis][lane];
+		}
+		return BoundingBox(cornerMin, cornerMax);
+	}
+
+	// Bounds of all the children of node
+	static BoundingBox nodeBounds(const Node& node) {
+		BoundingBox box = laneBounds(node, 0);
+		for (int lane = 1; lane < Width; lane++) {
+			if (node.children[lane] != Node::EMPTY)
+				box = BoundingBox::merge(box, laneBounds(node, lane));
+		}
+		return box;
+	}
+
+	// Turns the binary subtree at binaryIndex into wide nodes and returns the
+	// index of its root
+	uint32_t collapse(const BvhTree& binaryTree, uint32_t binaryIndex) {
+		uint32_t nodeIndex = static_cast<uint32_t>(nodes.size());
+		nodes.emplace_back();
+
+		const BvhNode& binaryNode = binaryTree.nodes[binaryIndex];
+
+		// A tree that is just a leaf gets a root with one child
+		if (binaryNode.isLeaf()) {
+			nodes[nodeIndex].setBounds(0, binaryNode.aabb);
+			nodes[nodeIndex].children[0] = binaryNode.offset;
+			nodes[nodeIndex].primitiveCounts[0] = binaryNode.primitiveCount;
+			return nodeIndex;
+		}
+
+		// Pull grandchildren up until the node is full, opening the largest
+		// interior child first since it's the most likely to be hit
+		std::vector<uint32_t> candidates = { binaryIndex + 1, binaryNode.offset };
+		while (candidates.size() < static_cast<size_t>(Width)) {
+			auto largest = candidates.end();
+			real largestArea = -1.0;
+
+			for (auto it = candidates.begin(); it != candidates.end(); it++) {
+				const BvhNode& candidate = binaryTree.nodes[*it];
+				if (candidate.isLeaf())
+					continue;
+
+				real area = candidate.aabb.surfaceArea();
+				if (area > largestArea) {
+					largest = it;
+					largestArea = area;
+				}
+			}
+
+			if (largest == candidates.end())
+				break;
+
+			uint32_t opened = *largest;
+			*largest = opened + 1;
+			candidates.push_back(binaryTree.nodes[opened].offset);
+		}
+
+		for (int lane = 0; lane < static_cast<int>(candidates.size()); lane++) {
+			const BvhNode& child = binaryTree.nodes[candidates[lane]];
+			nodes[nodeIndex].setBounds(lane, child.aabb);
+
+			if (child.isLeaf()) {
+				nodes[nodeIndex].children[lane] = child.offset;
+				nodes[nodeIndex].primitiveCounts[lane] = child.primitiveCount;
+			}
+			else {
+				// Can't keep a reference to the node across this call, it
+				// may reallocate nodes
+				uint32_t childIndex = collapse(binaryTree, candidates[lane]);
+				nodes[nodeIndex].children[lane] = childIndex;
+				nodes[nodeIndex].primitiveCounts[lane] = 0;
+			}
+		}
+
+		return nodeIndex;
+	}
+};
+
+// Wide BVH over the hittables of a scene
+template<int Width>
+class WideBoundingVolumeHierarchy : public Hittable {
+public:
+	WideBoundingVolumeHierarchy(
+		const HittableList& list,
+		real tStart,
+		real tEnd,
+		const BvhBuildConfig& config = BvhBuildConfig()
+	) : WideBoundingVolumeHierarchy(list.hittables, tStart, tEnd, config) { }
+
+	WideBoundingVolumeHierarchy(
+		const std::vector<std::shared_ptr<Hittable>>& list,
+		real tStart,
+		real tEnd,
+		const BvhBuildConfig& config = BvhBuildConfig()
+	) {
+		std::vector<BoundingBox> bounds;
+		bounds.reserve(list.size());
+
+		for (const auto& hittable : list) {
+			auto box = hittable->boundingBox(tStart, tEnd);
+			if (!box)
+				throw std::invalid_argument("Hittable does not have a Bounding Box");
+
+			bounds.push_back(box.value());
+		}
+
+		tree = WideBvhTree<Width>(BvhTree(bounds, config));
+
+		// Store the hittables in the order the leaves expect
+		hittables.reserve(list.size());
+		for (auto index : tree.primitiveOrder)
+			hittables.push_back(list[index]);
+	}
+
+	// Tree built before, with hittables already in the order of its leaves
+	WideBoundingVolumeHierarchy(
+		WideBvhTree<Width> tree,
+		std::vector<std::shared_ptr<Hittable>> hittables
+	) : tree(std::move(tree)), hittables(std::move(hittables)) {}
+
+	const WideBvhTree<Width>& getTree() const { return tree; }
+	const std::vector<std::shared_ptr<Hittable>>& getHittables() const { return hittables; }
+
+	// Follows hittables that moved, keeping the shape of the tree. Cheaper
+	// than building it again, but the tree gets worse the further things
+	// move, see WideBvhTree::sahCost().
+	void refit(real tStart, real tEnd) {
+		tree.refit([&](uint32_t index) {
+			auto box = hittables[index]->boundingBox(tStart, tEnd);
+			if (!box)
+				throw std::invalid_argument("Hittable does not have a Bounding Box");
+			return box.value();
+		});
+	}
+
+	double sahCost() const {
+		return tree.sahCost();
+	}
+
+	virtual bool intersect(
+		const Ray& ray, real tMin, real tMax, HitCandidate& closest
+	) const override {
+		return tree.traverse(ray, tMin, tMax, [&](uint32_t index, real& tMax) {
+			if (!hittables[index]->intersect(ray, tMin, tMax, closest))
+				return false;
+
+			tMax = closest.t;
+			return true;
+		});
+	}
+
+	virtual HitRecord finalize(const Ray& ray, const HitCandidate& candidate) const override {
+		return candidate.hittable->finalize(ray, candidate);
+	}
+
+	virtual uint32_t occludedPacket(
+		const RayPacket& packet,
+		uint32_t laneMask,
+		real tMin,
+		const real tMax[RayPacket::MAX_SIZE]
+	) const override {
+		return tree.traverseAnyPacket(
+			packet, laneMask, tMin, tMax,
+			[&](uint32_t index, uint32_t laneMask) {
+				return hittables[index]->occludedPacket(packet, laneMask, tMin, tMax);
+			}
+		);
+	}
+
+	virtual bool occluded(const Ray& ray, real tMin, real tMax) const override {
+		return tree.traverseAny(ray, tMin, tMax, [&](uint32_t index) {
+			return hittables[index]->occluded(ray, tMin, tMax);
+		});
+	}
+
+	virtual void intersectPacket(
+		const RayPacket& packet,
+		uint32_t laneMask,
+		real tMin,
+		PacketHits& hits
+	) const override {
+		tree.traversePacket(
+			packet, laneMask, tMin, hits.tMax,
+			[&](uint32_t index, uint32_t laneMask) {
+				hittables[index]->intersectPacket(packet, laneMask, tMin, hits);
+			}
+		);
+	}
+
+	virtual std::optional<BoundingBox> boundingBox(real tStart, real tEnd) const override {
+		return tree.boundingBox();
+	}
+
+	virtual void collectEmitters(std::vector<Emitter>& emitters) const override {
+		for (const auto& hittable : hittables)
+			hittable->collectEmitters(emitters);
+	}
+
+private:
+	WideBvhTree<Width> tree;
+	std::vector<std::shared_ptr<Hittable>> hittables;
+};